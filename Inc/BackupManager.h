@@ -21,6 +21,8 @@
 #include <string>
 #include <memory>
 
+#include <glib.h>
+
 #include "Singleton.h"
 
 #include <luna-service2/lunaservice.h>
@@ -49,8 +51,18 @@ private:
 
 	std::unique_ptr<PrefsDb> m_p_backupDb;
 
-	void copyKeysToBackupDb();
+	// preBackup copies the keys a few at a time from an idle source and replies once they are all in
+	std::list<std::string>	m_pendingBackupKeys;
+	LSHandle*	m_preBackupHandle;
+	LSMessage*	m_preBackupMessage;
+	bool	m_preBackupFilenamesOnly;
+	guint	m_copyKeysSource;
+
+	std::list<std::string> backupKeyList();
 	void initFilesForBackup(bool filenamesOnly);
+	void finishPreBackup();
+
+	static gboolean cbCopyKeysToBackupDb(gpointer data);
 
 	static bool preBackupCallback( LSHandle* lshandle, LSMessage *message, void *user_data);
 	static bool postRestoreCallback( LSHandle* lshandle, LSMessage *message, void *user_data);
@@ -28,6 +28,7 @@
 
 struct LSHandle;
 struct LSMessage;
+class JsonWriter;
 
 class ClockHandler : public Trackable
 {
@@ -140,6 +141,7 @@ public:
 
 	static time_t evaluateDelay(const timespec& sourceTimeStamp);
 	static pbnjson::JValue timestampJson(void);
+	static void writeTimestamp(JsonWriter &writer);
 
 private:
 	struct Clock {
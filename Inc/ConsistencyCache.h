@@ -0,0 +1,74 @@
+// Copyright (c) 2026 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+
+#ifndef CONSISTENCYCACHE_H
+#define CONSISTENCYCACHE_H
+
+#include <cstdint>
+#include <list>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+
+#include <glib.h>
+
+// keys found consistent by their handler, remembered until the key gets another value or one
+// of the files the check looked at changes or is replaced (inotify on the file and on its name in
+// its directory). Only passing verdicts are kept: a failing one restores the default, which
+// changes the value anyway
+class ConsistencyCache
+{
+public:
+	ConsistencyCache();
+	~ConsistencyCache();
+
+	// true if key was found consistent with the value it has now and nothing it depends on changed
+	bool isConsistent(const std::string& key) const;
+
+	// key with value passed its check, which depends on files; without a watch on all of them
+	// the verdict isn't kept
+	void setConsistent(const std::string& key, const std::string& value, const std::list<std::string>& files);
+
+	void invalidate(const std::string& key);
+	void clear();
+
+private:
+	// an inotify watch and the name in the watched directory it is about; no name: any
+	// event on the watched file itself
+	typedef std::pair<int, std::string> Watch;
+
+	struct Verdict
+	{
+		std::string value;
+		std::list<Watch> watches;
+	};
+
+	bool startWatching();
+	bool addWatch(const std::string& path, uint32_t mask, const std::string& name, const std::string& key, Verdict& r_verdict);
+	void dropWatches(const Verdict& verdict, const std::string& key);
+	static gboolean cbFilesChanged(GIOChannel* channel, GIOCondition condition, gpointer data);
+
+	std::map<std::string, Verdict> m_verdicts;
+	std::map<Watch, std::set<std::string> > m_watchedKeys;	// inotify watch -> keys whose verdict uses it
+
+	int m_inotifyFd;
+	GIOChannel* m_channel;
+	guint m_watchSource;
+};
+
+#endif /* CONSISTENCYCACHE_H */
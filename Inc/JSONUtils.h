@@ -23,6 +23,10 @@
 #include <luna-service2/lunaservice.h>
 #include <pbnjson.hpp>
 
+#include <cstring>
+#include <string>
+#include <type_traits>
+
 /*
  * Helper macros to build schemas in a more reliable, readable & editable way in C++
  */
@@ -182,6 +186,74 @@ private:
 // build a standard reply returnValue & errorCode/errorText if defined
 pbnjson::JValue createJsonReply(bool returnValue = true, int errorCode = 0, const char * errorText = 0);
 
+/*
+ * Writes JSON text straight into a string, for replies that are built on every call or every
+ * notification: no pbnjson DOM and no stringify() pass. Keys and strings are escaped, raw()
+ * splices already serialized JSON (preference values are stored that way). The writer only
+ * adds the separators, so the caller is responsible for a well formed sequence of calls.
+ * clear() keeps the buffer's capacity for the next reply
+ */
+class JsonWriter
+{
+public:
+	explicit JsonWriter(size_t reserve = 256)	{ mBuffer.reserve(reserve); }
+
+	void					clear()							{ mBuffer.clear(); }
+
+	JsonWriter &			beginObject()					{ separate(); mBuffer += '{'; return *this; }
+	JsonWriter &			endObject()						{ mBuffer += '}'; return *this; }
+	JsonWriter &			beginArray()					{ separate(); mBuffer += '['; return *this; }
+	JsonWriter &			endArray()						{ mBuffer += ']'; return *this; }
+
+	// name of the member whose value comes next
+	JsonWriter &			key(const char * name)			{ return key(name, strlen(name)); }
+	JsonWriter &			key(const std::string & name)	{ return key(name.data(), name.size()); }
+
+	JsonWriter &			value(const char * str)			{ separate(); appendString(mBuffer, str, strlen(str)); return *this; }
+	JsonWriter &			value(const std::string & str)	{ separate(); appendString(mBuffer, str.data(), str.size()); return *this; }
+	JsonWriter &			value(bool boolean)				{ separate(); mBuffer += boolean ? "true" : "false"; return *this; }
+	// any integer type (time_t, long, int32_t...), like toJValue()
+	template <class T>
+	typename std::enable_if<std::is_integral<T>::value, JsonWriter &>::type
+							value(T number)					{ return integer(static_cast<int64_t>(number)); }
+
+	// already serialized JSON, copied as is; nothing at all is written as null, which keeps the
+	// text well formed (an empty stored value counts as null elsewhere too)
+	JsonWriter &			raw(const std::string & json)
+	{
+		separate();
+		if (json.empty())
+			mBuffer += "null";
+		else
+			mBuffer += json;
+		return *this;
+	}
+
+	// key and value in one call
+	template <class T> JsonWriter &	put(const char * name, const T & v)	{ return key(name).value(v); }
+
+	const std::string &		str() const						{ return mBuffer; }
+	const char *			c_str() const					{ return mBuffer.c_str(); }
+	// hands the text over, leaving the writer empty
+	std::string				release()						{ std::string text; text.swap(mBuffer); return text; }
+
+	// appends str as a quoted JSON string
+	static void				appendString(std::string & r_buffer, const char * str, size_t length);
+
+private:
+	JsonWriter &			key(const char * name, size_t length);
+	JsonWriter &			integer(int64_t number);
+
+	// a comma, unless this is the first member/element or the value of a key
+	void					separate()
+	{
+		if (!mBuffer.empty() && mBuffer.back() != '{' && mBuffer.back() != '[' && mBuffer.back() != ':')
+			mBuffer += ',';
+	}
+
+	std::string				mBuffer;
+};
+
 
 template <typename T>
 T toInteger(const pbnjson::JValue &value)
@@ -224,4 +296,17 @@ inline pbnjson::JValue toJValue<struct tm>(const struct tm& tmValue)
 	return jValue;
 }
 
+// same object as toJValue<struct tm>() for a JsonWriter
+inline void writeJson(JsonWriter &writer, const struct tm &tmValue)
+{
+	writer.beginObject()
+		.put("year", tmValue.tm_year + 1900)
+		.put("month", tmValue.tm_mon + 1)
+		.put("day", tmValue.tm_mday)
+		.put("hour", tmValue.tm_hour)
+		.put("minute", tmValue.tm_min)
+		.put("second", tmValue.tm_sec)
+		.endObject();
+}
+
 #endif // JSONUTILS_H
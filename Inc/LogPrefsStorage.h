@@ -0,0 +1,105 @@
+// Copyright (c) 2026 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+
+#ifndef LOGPREFSSTORAGE_H
+#define LOGPREFSSTORAGE_H
+
+#include <sys/types.h>
+
+#include <unordered_map>
+#include <vector>
+
+#include <glib.h>
+
+#include "PrefsStorage.h"
+
+// append-only log of records with an in-memory index of the latest one per key. A write is one
+// append (and one fdatasync); once superseded records take up most of the file it is rewritten
+// with only the live ones.
+//
+// The file is a sequence of frames: payload length and CRC-32 (both 32 bit little endian), then
+// the payload. The first frame is a header, put frames carry a record and a commit frame makes
+// the puts before it durable. On replay a torn last frame (a short one, or the file's unwritten
+// end) and puts without a commit are cut off. Corruption anywhere else, the header included,
+// moves the file aside to <filename>.corrupt and open() fails; nothing is truncated.
+class LogPrefsStorage : public PrefsStorage
+{
+public:
+	// sync: fdatasync() on every commit
+	LogPrefsStorage(const std::string& filename, bool sync);
+	~LogPrefsStorage();
+
+	// opens or creates the file and replays it into the index
+	bool open();
+
+	const std::string& filename() const { return m_filename; }
+
+	virtual const char* name() const { return "log"; }
+
+	virtual bool get(const std::string& key, Record& r_record);
+	virtual bool put(const Record& record);
+
+	virtual bool beginBatch();
+	virtual bool commitBatch();
+	virtual void rollbackBatch();
+
+	virtual bool iterate(const std::function<void(const Record&)>& visit);
+
+	virtual bool snapshot(const std::string& filename);
+
+	// rewrites the file with only the live records; writes schedule it from an idle source
+	// once superseded records take up most of the file
+	bool compact();
+
+private:
+	struct Entry
+	{
+		Record record;
+		size_t frameSize;		// bytes of its put frame in the file
+	};
+
+	bool replay();
+	static bool isTornTail(const std::string& data, size_t pos, size_t length);
+	bool quarantine(const char* problem, size_t offset);
+	bool append(const std::string& frames);
+	void apply(std::vector<Entry>& entries);
+	bool isSparse() const;
+	void compactIfSparse();
+	static gboolean cbCompact(gpointer data);
+
+	static void appendFrame(std::string& r_frames, const std::string& payload);
+	static std::string headerPayload();
+	static std::string putPayload(const Record& record);
+	static bool parsePut(const std::string& payload, Record& r_record);
+
+	std::string m_filename;
+	bool m_sync;
+	int m_fd;
+	off_t m_size;
+	size_t m_liveBytes;		// put frames still in the index; the rest of m_size is garbage
+
+	std::unordered_map<std::string, Entry> m_index;
+
+	// the open batch: frames to append and entries to index on commit
+	bool m_inBatch;
+	std::string m_batchFrames;
+	std::vector<Entry> m_batchEntries;
+
+	guint m_compactSource;
+};
+
+#endif /* LOGPREFSSTORAGE_H */
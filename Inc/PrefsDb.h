@@ -20,13 +20,35 @@
 
 #include <string>
 #include <map>
+#include <functional>
 #include <list>
+#include <set>
+#include <vector>
+#include <memory>
+#include <unordered_map>
 
+#include <stdint.h>
+#include <time.h>
 #include <sqlite3.h>
+#include <glib.h>
+#include <pbnjson.hpp>
 
 #include "Singleton.h"
 
 class BackupManager;
+class PrefsStorage;
+
+// a preference value as setPreferences handles it: parsed once with the request and serialized
+// once. Validation, the database, subscribers and the key's handler all work on this one copy
+struct PrefValue
+{
+	PrefValue(std::string key, const pbnjson::JValue& value)
+	: key(std::move(key)), value(value), json(value.stringify()) {}
+
+	std::string key;
+	pbnjson::JValue value;
+	std::string json;		// canonical JSON: stored, and sent to subscribers, as it is
+};
 
 class PrefsDb : public Singleton<PrefsDb>
 {
@@ -38,27 +60,138 @@ public:
 
 	bool setPref(const std::string& key, const std::string& value);
 
+	// groups setPref() calls into one transaction (one journal sync). Batches nest; only
+	// the outermost commitBatch() commits. Cached values are updated on commit only.
+	// With the writer thread (below) the transaction is handed to it on commit, and so is a
+	// setPref() outside of a batch; both return once it is queued. The cache, and listeners,
+	// have the new values from then on; a write that fails takes them back
+	bool beginBatch();
+	bool commitBatch();
+	void rollbackBatch();
+	bool inBatch() const { return m_batchDepth > 0; }
+
+	// sysservice.conf [PrefsDb] writerThread: setPrefsAsync() hands its transaction to a thread
+	// with its own connection and done runs on the main loop once it is durable. The values are
+	// in the cache, and so visible to reads, right away; if the write fails they go back to what
+	// is stored and the listener is told about the keys again. done may run from an idle
+	// callback when the writer is stopped (merge(), closing the db) with writes in flight.
+	// Without the writer thread the transaction is written before setPrefsAsync() returns.
+	// done is called exactly once either way. r_unchangedKeys gets the keys whose value is stored
+	// already; nothing is written for those. The values are stored as their canonical JSON
+	// without being parsed again; prefs only has to live until setPrefsAsync() returns
+	typedef void (*WriteDoneCallback)(bool ok, gpointer userData);
+	void setPrefsAsync(const std::vector<PrefValue>& prefs,
+					   WriteDoneCallback done, gpointer userData,
+					   std::set<std::string>* r_unchangedKeys = 0);
+	bool writerThreadRunning() const { return m_writerThread != 0; }
+
+	// told about each key whose value changed in the cache, outside of batches (a batch's keys on
+	// commit), and with an empty key when any may have (the cache was reloaded or dropped)
+	typedef std::function<void(const std::string& key)> ChangeListener;
+	void setChangeListener(const ChangeListener& listener) { m_changeListener = listener; }
+
+	// keys listed in sysservice.conf [PrefsDb] coalesceKeys: writes go to the cache and an
+	// append-only journal right away and reach the database once per coalescing window. Each
+	// journal append is fdatasync()ed before the write is acknowledged (not with synchronous=OFF),
+	// and takes its revision then
+	bool isCoalescedKey(const std::string& key) const
+	{ return m_coalescedKeys.find(key) != m_coalescedKeys.end(); }
+	bool flushCoalescedWrites();
+
+	// keys listed in sysservice-volatilekeys.json: runtime state kept in the cache only. Writes
+	// never reach the disk, so after a restart the key has its stored (default) value again;
+	// volatile keys are left out of backups and restores
+	bool isVolatileKey(const std::string& key) const
+	{ return m_volatileKeys.find(key) != m_volatileKeys.end(); }
+
+	// keys starting with '.' are the service's own bookkeeping (.prefsdb.setting.*, .sysservice*):
+	// readable by name, but left out of prefix listings and prefix subscriptions
+	static bool isInternalKey(const std::string& key) { return !key.empty() && key[0] == '.'; }
+
 	std::string getPref(const std::string& key);
 	bool getPref(const std::string& key,std::string& r_val);
+	// key's current value (in the open batch, else in the cache) is value, and is stored already
+	// if it went to the writer thread; false without a cache
+	bool hasValue(const std::string& key, const std::string& value) const;
+
+	// setPref() with the value a key already has doesn't write. Per key, since the service started:
+	// writes that reached the storage, writes skipped that way and the bytes (key, value and its
+	// JSON form) of the stored ones
+	struct WriteStats {
+		uint64_t writes;
+		uint64_t suppressed;
+		uint64_t bytes;
+	};
+	const std::unordered_map<std::string, WriteStats>& writeStats() const { return m_writeStats; }
+	time_t writeStatsSince() const { return m_writeStatsSince; }
 
 	std::map<std::string, std::string> getPrefs(const std::list<std::string>& keys);	
+	// same as getPrefs() but returns each value's canonical JSON text, ready to be put into a reply;
+	// with a sinceRevision only keys changed after that revision
+	std::map<std::string, std::string> getPrefsAsJson(const std::list<std::string>& keys, sqlite3_int64 sinceRevision = 0);
+
+	// every stored write takes the next revision of a global sequence and records it with the key,
+	// so clients that saw currentRevision() can later ask for just the keys changed since
+	sqlite3_int64 currentRevision() const { return m_revision; }
+	// names the revision sequence; a new database or a restore starts a new one, and revisions of
+	// another epoch say nothing about what changed since
+	const std::string& epoch() const { return m_epoch; }
+	std::list<std::string> getKeysChangedSince(sqlite3_int64 revision);
 	std::map<std::string,std::string> getAllPrefs();
 
-	int merge(PrefsDb * p_sourceDb,bool overwriteSameKeys=true);
-	int merge(const std::string& sourceDbFilename,bool overwriteSameKeys=true);
+	// keys starting with prefix, in ascending order, beginning after startAfter if that is given.
+	// At most limit keys (0 == no limit); r_more is set if more keys follow the returned ones.
+	// Internal keys are never listed
+	std::list<std::string> getKeysByPrefix(const std::string& prefix, const std::string& startAfter = std::string(),
+										   size_t limit = 0, bool* r_more = 0);
+
+	// r_changedKeys gets the keys whose value the merge actually changed
+	int merge(PrefsDb * p_sourceDb,bool overwriteSameKeys=true,std::list<std::string>* r_changedKeys=0);
+	int merge(const std::string& sourceDbFilename,bool overwriteSameKeys=true,std::list<std::string>* r_changedKeys=0);
 
 	int copyKeys(PrefsDb * p_sourceDb,const std::list<std::string>& keys,bool overwriteSame=true);
 
+	// copyKeys() spread over several calls (preBackup copies a few keys per main loop iteration).
+	// Every copyKeysStep() between beginCopyKeys() and endCopyKeys() copies the source as it was
+	// when beginCopyKeys() ran: the values of keys are taken up front (coalesced ones and those
+	// queued for the source's writer thread included), writes it makes meanwhile don't count.
+	// No transaction on the source stays open in between. copyKeysStep() copies up to maxKeys
+	// keys (0 == all) from the front of keys, in a batch of its own, and removes them from the
+	// list; it returns the number of rows written, -1 on error. endCopyKeys() ends the copy.
+	bool beginCopyKeys(PrefsDb * p_sourceDb,const std::list<std::string>& keys);
+	int copyKeysStep(std::list<std::string>& keys,size_t maxKeys,bool overwriteSame=true);
+	bool endCopyKeys();
+
+	// consistent copy of the whole database into filename, a standalone sqlite database; values
+	// still queued for the writer thread aren't in it yet
+	bool snapshot(const std::string& filename);
+
 	std::string databaseFile() const
 	{ return m_dbFilename; }
 
 	void setDatabaseFileDeleteOnDestruction(bool deleteAtDestructor=true);
 
+	// folds the write-ahead log back into the database file (no-op unless in WAL mode);
+	// truncate also resets the -wal file to zero length
+	bool checkpoint(bool truncate=false);
+
+	// last full integrity check recorded in the database (a JSON object, empty if there was none)
+	// and whether a background check is running right now
+	std::string lastIntegrityCheck();
+	bool integrityCheckRunning() const { return m_integrityThread != 0; }
+	// quick_check on open, full check on a worker thread later (sysservice.conf [PrefsDb] integrityCheck)
+	bool backgroundIntegrityCheck() const;
+
+	// debug aid: compares the in-memory cache with the database contents, logs every
+	// divergent key and returns how many were found (0 == consistent)
+	int verifyCache();
+
 	//keeping all this in one place so that all of system service has one place to look it up in, rather than all over the other source files
 	static const char* s_defaultPrefsFile;
 	static const char* s_defaultPlatformPrefsFile;
 	static const char* s_customizationOverridePrefsFile;
 	static const char* s_custCareNumberFile;
+	static const char* s_volatileKeysFile;
 	static const char* s_prefsDbPath;
 	static const char* s_tempBackupDbFilenameOnly;
 	static const char* s_prefsPath;
@@ -85,17 +218,92 @@ private:
 	void openPrefsDb();
 	void closePrefsDb();
 
+	// sysservice.conf [PrefsDb] backend: "sqlite" keeps the preferences in m_dbFilename, "log" in
+	// an append-only log next to it. Each one takes over the other's preferences when it starts
+	// and finds them (log -> sqlite: the log file exists, sqlite -> log: it doesn't)
+	bool openSqliteStorage();
+	bool openLogStorage();
+	void closeStorage();
+	bool exportToLog(const std::string& filename);
+	bool importLog(const std::string& filename);
+	std::string logFilename() const;
+
+	// canonical: value is canonical JSON already (see PrefValue), so it is its own serialization
+	bool setPref(const std::string& key, const std::string& value, bool canonical);
+	bool writePref(const std::string& key, const std::string& value, bool canonical = false);
+	void notifyChanged(const std::string& key) { if (m_changeListener) m_changeListener(key); }
+	void countWrite(const std::string& key, const std::string& value, const std::string& json);
+	// copyKeys with both sides in sqlite: sourceDb attached to this db's connection, one
+	// transaction around all copyAttachedKeys() calls
+	bool attachSource(PrefsDb * p_sourceDb,const std::list<std::string>& keys);
+	bool detachSource(bool commit);
+	int copyAttachedKeys(std::list<std::string>::const_iterator first,std::list<std::string>::const_iterator last,
+						 bool overwriteSameKeys);
+
+	// merge and copyKeys through the caches, for when either side isn't sqlite
+	int mergeValues(const std::map<std::string, std::string>& values, bool overwriteSameKeys,
+					std::list<std::string>* r_changedKeys);
+
+	bool volatileWrite(const std::string& key, const std::string& value, bool canonical = false);
+	void loadVolatileKeys();
+
+	bool coalesceWrite(const std::string& key, const std::string& value, bool canonical = false);
+	bool appendToCoalesceJournal(const std::string& key, const std::string& value);
+	void discardCoalesceJournal();
+	void rewriteCoalesceJournal();
+	void replayCoalesceJournal();
+	static gboolean cbCoalesceTimeout(gpointer data);
+
+	void configureConnection();
+	void scheduleCheckpoint();
+	static gboolean cbCheckpointTimeout(gpointer data);
+
+	bool loadCache();
+	std::map<std::string,std::string> readAllPrefsFromDb();
+
 	bool checkTableConsistency();
+	void resyncDefaults();
+	bool upgradeValueColumns();
+	bool fillValueColumns();
 	bool integrityCheckDb();
+	void scheduleIntegrityCheck();
+	void stopIntegrityCheck();
+	void recordIntegrityCheck(bool ok, const std::string& message);
+	static gboolean cbIntegrityCheckTimeout(gpointer data);
+	static gboolean cbIntegrityCheckDone(gpointer data);
+	static gpointer integrityCheckThread(gpointer data);
+
+	struct WriteJob;
+	void startWriter();
+	void stopWriter();
+	void queueWrite(WriteJob* job);
+	bool commitBatch(WriteDoneCallback done, gpointer userData);
+	bool closeBatch(WriteJob*& r_job);
+	void completeWrites(bool deferDone = false);
+	void completeCoalesceFlush(const WriteJob* job);
+	void runFinishedJobs();
+	static gboolean cbFinishedJobs(gpointer data);
+	static gpointer writerThread(gpointer data);
+	static gboolean cbWritesDone(gpointer data);
 	void loadDefaultPrefs();
 	void loadDefaultPlatformPrefs();
 	void backupDefaultPrefs();
 
-	void synchronizeDefaults();
-	void synchronizePlatformDefaults();
-	void synchronizeCustomerCareInfo();
+	std::string defaultsFingerprint();
+	void renewEpoch();
+
+	// false if the file's preferences couldn't be written; a missing or invalid file has none
+	bool synchronizeDefaults();
+	bool synchronizePlatformDefaults();
+	bool synchronizeCustomerCareInfo();
 	
-	void updateWithCustomizationPrefOverrides();
+	bool updateWithCustomizationPrefOverrides();
+
+	// prepared statements are owned by the connection and finalized in closePrefsDb();
+	// callers must sqlite3_reset() them after use, never finalize them
+	sqlite3_stmt* cachedStatement(sqlite3_stmt*& r_stmt, const char* sql);
+	sqlite3_stmt* multiGetStatement(size_t keyCount);
+	void finalizeStatements();
 
 	// MUST RUN sqlite3_finalize(x);  on return value 'x' from runSqlQuery(..) unless x == 0
 	sqlite3_stmt* runSqlQuery(const std::string& queryStr);
@@ -103,7 +311,87 @@ private:
 	bool runSqlCommand(const std::string& cmdStr);
 
 private:
+	// a value as it is stored: the raw string, its canonical JSON serialization and the
+	// revision of its last write
+	struct StoredPref {
+		std::string value;
+		std::string json;
+		sqlite3_int64 revision;
+	};
+
+	// m_storage holds the preferences; m_prefsDb is its connection with the sqlite backend, 0 with the log
+	std::unique_ptr<PrefsStorage> m_storage;
 	sqlite3* m_prefsDb;
+	std::vector<sqlite3_stmt*> m_getPrefsStmts;	// [n-1] selects n keys at once
+
+	// write-through copy of the Preferences table; serves all reads once loaded
+	std::unordered_map<std::string, StoredPref> m_cache;
+	std::set<std::string> m_cacheKeys;			// ordered index of m_cache, for prefix scans
+	bool m_cacheLoaded;
+
+	// values written by the open batch, applied to m_cache on commit
+	std::unordered_map<std::string, StoredPref> m_batchValues;
+	int m_batchDepth;
+	bool m_batchRolledBack;
+	bool m_batchQueued;			// goes to the writer thread on commit
+	std::set<std::string> m_batchCoalescedKeys;
+
+	// the open copy: its source, and the values read in place of the attached ones (copyKeys()),
+	// or all of them (beginCopyKeys())
+	PrefsDb* m_copySource;
+	std::map<std::string, std::string> m_copyValues;
+
+	ChangeListener m_changeListener;
+
+	std::unordered_map<std::string, WriteStats> m_writeStats;
+	time_t m_writeStatsSince;
+
+	// volatile keys and their values; the values outlive closePrefsDb() (restores reopen the db)
+	std::set<std::string> m_volatileKeys;
+	std::unordered_map<std::string, StoredPref> m_volatileValues;
+
+	// write coalescing: acknowledged values not yet in the database, and their journal
+	std::set<std::string> m_coalescedKeys;
+	std::map<std::string, std::string> m_coalescedValues;
+	std::string m_coalesceJournalFile;
+	int m_coalesceJournalFd;
+	int m_coalesceJournalEntries;
+	guint m_coalesceSource;
+	bool m_coalesceFlushQueued;		// a flush is with the writer thread
+	bool m_walMode;
+	guint m_checkpointSource;
+	gint64 m_lastWriteTime;
+	sqlite3_int64 m_revision;
+	sqlite3_int64 m_batchRevision;		// m_revision to go back to if the batch rolls back
+	std::string m_epoch;
+
+	// background integrity check: m_integrityCheckSource waits for the delay to pass. The worker
+	// thread only touches m_integrityCheckDb and m_integrityCheckResult, and when it is finished
+	// with both posts cbIntegrityCheckDone() as m_integrityCheckDoneSource; the main loop reads
+	// that only after joining the thread
+	GThread* m_integrityThread;
+	sqlite3* m_integrityCheckDb;
+	std::string m_integrityCheckResult;
+	guint m_integrityCheckSource;
+	guint m_integrityCheckDoneSource;
+	bool m_fullCheckAtOpen;
+
+	// writer thread: owns m_writerDb, pops jobs off m_writeQueue and pushes them onto
+	// m_writeDoneQueue for the main loop. m_pendingWrites has the keys of queued jobs with
+	// what is stored for them (m_cache has the newest queued value) and how many jobs are left
+	GThread* m_writerThread;
+	sqlite3* m_writerDb;
+	GAsyncQueue* m_writeQueue;
+	GAsyncQueue* m_writeDoneQueue;
+	struct PendingWrite {
+		bool committed;
+		StoredPref value;
+		int jobs;
+	};
+	std::unordered_map<std::string, PendingWrite> m_pendingWrites;
+	// jobs finished while stopping the writer, their done callbacks still to run
+	std::list<WriteJob*> m_finishedJobs;
+	guint m_finishedJobsSource;
 	bool m_standalone;
 	std::string m_dbFilename;
 	bool m_deleteOnDestroy;
@@ -17,13 +17,22 @@
 #ifndef PREFSFACTORY_H
 #define PREFSFACTORY_H
 
+#include <list>
 #include <map>
+#include <set>
 #include <string>
 #include <memory>
 
+#include <glib.h>
+#include <stdint.h>
+
+#include "ConsistencyCache.h"
+#include "ReplyCache.h"
 #include "Singleton.h"
+#include "SubscriptionTrie.h"
 
 struct LSHandle;
+struct LSMessage;
 
 class PrefsHandler;
 
@@ -50,21 +59,110 @@ public:
 	
 	void postPrefChange(const std::string& key,const std::string& value);
 	void postPrefChangeValueIsCompleteString(const std::string& key,const std::string& json_string);
+	// posts keys changed together (key -> serialized value): every subscriber gets one
+	// update with all of its keys that changed
+	void postPrefChanges(const std::map<std::string,std::string>& changedJson);
+	// subscribes message to changes of every key starting with prefix
+	bool subscribeToPrefix(LSHandle* lsHandle, LSMessage* message, const std::string& prefix);
+	// to be called after every successful LSSubscriptionAdd() for a key posted through this
+	// class: posts for keys nobody ever subscribed to are dropped before anything is serialized
+	void subscriberAdded(const std::string& subscriptionKey);
+	// true if a change of key would reach anybody, directly or through a prefix
+	bool hasSubscribers(const std::string& key);
+	// subscribes message to key with at most one update per intervalMs, carrying the latest value
+	bool subscribeRateLimited(LSHandle* lsHandle, LSMessage* message, const std::string& key, int intervalMs);
+	// interval all subscribers of key are held to (sysservice.conf rateLimits, coalescing), 0 for none
+	int rateLimit(const std::string& key) const;
+
+	struct RateLimitStats
+	{
+		std::string key;
+		int intervalMs;
+		unsigned int subscribers;
+		uint64_t delivered;
+		uint64_t collapsed;		// updates replaced by a newer one before they went out
+	};
+	// one entry per rate limited subscription key updated within its interval
+	std::list<RateLimitStats> rateLimitStats();
+	// counters of all rate limited subscription keys since the service started
+	void rateLimitTotals(uint64_t& r_delivered, uint64_t& r_collapsed) const;
+	// getPreferences and getPreferenceValues replies; PrefsDb drops the ones built from a key
+	// when it changes. Replies that depend on the UI locale list "locale" among their keys
+	ReplyCache& replyCache() { return m_replyCache; }
+
+	// handler's consistency check for key, or its earlier passing verdict while that still holds
+	bool isPrefConsistent(const std::string& key, const PrefsHandlerPtr& handler);
 	void runConsistencyChecksOnAllHandlers();
 	
-	void refreshAllKeys();		//useful for when the database is completely restored to another version
-								//at some point after sysservice startup (see BackupManager)
+	void refreshAllKeys(int64_t sinceRevision = 0);		//useful for when the database is completely restored to another version
+															//at some point after sysservice startup (see BackupManager);
+															//only keys written after sinceRevision are refreshed
+	// tells handlers and subscribers about keys changed behind their back: every handler
+	// gets its changed keys in one valuesChanged() call, every subscriber one update
+	void refreshKeys(const std::list<std::string>& changedKeys);
 private:
 	PrefsFactory();
 
 	void init();
 	void registerPrefHandler(const PrefsHandlerPtr &handler);
+
+	// a serialized update, shared by every subscriber it goes to and kept alive while deferred
+	typedef std::shared_ptr<const std::string> ReplyPtr;
+
+	unsigned int subscriberCount(const std::string& subscriptionKey);
+	// subscription keys of the prefixes key falls under that still have subscribers
+	std::list<std::string> prefixSubscriptionsOf(const std::string& key);
+	void notifySubscribers(const std::string& key, const ReplyPtr& reply);
+	void deliverToSubscribers(const std::string& key, const std::string& reply);
+	void replyToSubscribers(const std::string& subscriptionKey, const std::string& reply);
+	void collectSubscribers(const std::string& subscriptionKey, const std::string& key,
+							std::map<LSMessage*, std::list<std::string> >& r_updates);
+	void notifyRateLimitedSubscribers(const std::string& key, const ReplyPtr& reply);
+	bool deferNotification(const std::string& subscriptionKey, const std::string& key, int intervalMs,
+						   const ReplyPtr& reply);
+	static guint scheduleDeferredNotification(const std::string& subscriptionKey, int intervalMs);
+	static gboolean cbDeferredNotification(gpointer data);
 	
 private:
 
 	LSHandle* m_serviceHandle;
 		
 	PrefsHandlerMap m_handlersMaps;
+
+	// subscribers of rate limited keys get at most one update per interval, by subscription key.
+	// A key has an entry from an update that went out until an interval passes without another
+	struct ThrottledKey
+	{
+		std::string key;
+		int intervalMs;
+		guint source;			// the end of the current interval
+		ReplyPtr reply;			// the latest update waiting for it
+		uint64_t delivered;
+		uint64_t collapsed;
+	};
+	std::map<std::string, ThrottledKey> m_throttledKeys;
+	// counters of the entries dropped so far
+	uint64_t m_retiredDelivered;
+	uint64_t m_retiredCollapsed;
+	void forgetThrottledKey(std::map<std::string, ThrottledKey>::iterator it);
+
+	// intervals from sysservice.conf
+	std::map<std::string, int> m_rateLimits;
+
+	// slower intervals asked for through getPreferences minIntervalMs, per key; each has its
+	// own subscription key
+	std::map<std::string, std::set<int> > m_rateLimitedSubscriptions;
+
+	// subscribers per subscription key, as of the last time they were needed; keys without
+	// an entry have never been subscribed to
+	std::map<std::string, unsigned int> m_subscriberCounts;
+
+	ConsistencyCache m_consistencyCache;
+	ReplyCache m_replyCache;
+
+	// prefixes subscribed to through getPreferencesByPrefix and wildcard getPreferences keys;
+	// dropped once nobody listens
+	SubscriptionTrie m_prefixSubscriptions;
 };
 
 #endif /* PREFSFACTORY_H */
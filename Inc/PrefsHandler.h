@@ -38,32 +38,22 @@ public:
 	virtual bool validate(const std::string& key, const pbnjson::JValue &value) = 0;
 	virtual bool validate(const std::string& key, const pbnjson::JValue &value, const std::string& originId)
 	{ return validate(key,value); }
+	// validate() and valueChanged() get the value setPreferences parsed; nothing on the way
+	// from one to the other converts it again
 	virtual void valueChanged(const std::string& key, const pbnjson::JValue &value) = 0;
-	virtual void valueChanged(const std::string& key,const std::string& strval)
+	// several of this handler's keys changed at once (e.g. by a restore); handlers whose keys
+	// depend on each other can override this to apply them together
+	virtual void valuesChanged(const std::map<std::string,pbnjson::JValue>& keyvalues)
 	{
-		using namespace pbnjson;
-
-		if (strval.empty())
-			return;
-		//WORKAROUND WRAPPER FOR USING valueChanged() internally.  //TODO: do this the proper way.
-		// the way it is now makes a useless conversion at least once
-		JValue jo = JDomParser::fromString(strval);
-		if (!jo.isValid())
-		{
-			PmLogError(
-				sysServiceLogContext(), "INVALID_PREF_VALUE", 2,
-				PMLOGKS("KEY", key.c_str()),
-				PMLOGKS("VALUE", strval.c_str()),
-				"Can't parse value as json to set preferences, despite is was validated."
-			);
-			return;
-		}
-
-		valueChanged(key,jo);
+		for (const auto& keyvalue : keyvalues)
+			valueChanged(keyvalue.first, keyvalue.second);
 	}
 	virtual pbnjson::JValue valuesForKey(const std::string& key) = 0;
 	// FIXME: We very likely need a windowed version the above function
 	virtual bool isPrefConsistent() { return true; }
+	// files isPrefConsistent() looks at: a passing verdict is reused until the value or one of
+	// these changes
+	virtual std::list<std::string> consistencyFiles() { return std::list<std::string>(); }
 	virtual void restoreToDefault() {}
 	virtual bool shouldRefreshKeys(std::map<std::string,std::string>& keyvalues) { return false;}
 
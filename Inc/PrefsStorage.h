@@ -0,0 +1,63 @@
+// Copyright (c) 2026 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+
+#ifndef PREFSSTORAGE_H
+#define PREFSSTORAGE_H
+
+#include <functional>
+#include <string>
+
+#include <sqlite3.h>
+
+// where PrefsDb keeps its preferences. PrefsDb owns the cache, the revision sequence, batching
+// and coalescing; a backend only stores records and hands them back
+class PrefsStorage
+{
+public:
+	// one stored preference. Legacy (key, value) stores leave type and json empty and revision 0
+	struct Record
+	{
+		std::string key;
+		std::string value;
+		std::string type;
+		std::string json;
+		sqlite3_int64 revision;
+	};
+
+	virtual ~PrefsStorage() {}
+
+	virtual const char* name() const = 0;
+
+	virtual bool get(const std::string& key, Record& r_record) = 0;
+	// replaces any record with the same key
+	virtual bool put(const Record& record) = 0;
+
+	// puts between beginBatch() and commitBatch() become durable together. Batches don't nest;
+	// a failed commit leaves the store as it was before beginBatch()
+	virtual bool beginBatch() = 0;
+	virtual bool commitBatch() = 0;
+	virtual void rollbackBatch() = 0;
+
+	// calls visit for every stored record, in no particular order
+	virtual bool iterate(const std::function<void(const Record&)>& visit) = 0;
+
+	// writes every record to filename as a standalone (key, value) sqlite database, the format
+	// BackupManager hands out and PrefsDb::createStandalone() opens
+	virtual bool snapshot(const std::string& filename) = 0;
+};
+
+#endif /* PREFSSTORAGE_H */
@@ -0,0 +1,75 @@
+// Copyright (c) 2026 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+
+#ifndef REPLYCACHE_H
+#define REPLYCACHE_H
+
+#include <stdint.h>
+
+#include <list>
+#include <set>
+#include <string>
+#include <unordered_map>
+
+// serialized replies by normalized request (e.g. the sorted key set of a getPreferences call).
+// Each reply lists the keys it was built from and is dropped as soon as one of them changes;
+// past maxBytes the least recently used replies go first
+class ReplyCache
+{
+public:
+	explicit ReplyCache(size_t maxBytes);
+
+	// the reply stored for request, 0 if there is none
+	const std::string* find(const std::string& request);
+	void insert(const std::string& request, const std::list<std::string>& keys, const std::string& reply);
+
+	// drops every reply built from key; an empty key drops them all
+	void invalidate(const std::string& key);
+
+	struct Stats
+	{
+		uint64_t hits;
+		uint64_t misses;
+		uint64_t invalidated;		// replies dropped because one of their keys changed
+		uint64_t evicted;			// replies dropped to stay under maxBytes
+	};
+	const Stats& stats() const { return m_stats; }
+	size_t size() const { return m_entries.size(); }
+	size_t bytes() const { return m_bytes; }
+	size_t maxBytes() const { return m_maxBytes; }
+
+private:
+	struct Entry
+	{
+		std::string reply;
+		std::list<std::string> keys;
+		std::list<std::string>::iterator lru;
+		size_t bytes;
+	};
+	typedef std::unordered_map<std::string, Entry> EntryMap;
+
+	void erase(EntryMap::iterator it);
+
+	EntryMap m_entries;
+	std::unordered_map<std::string, std::set<std::string> > m_requestsByKey;
+	std::list<std::string> m_lru;		// requests, most recently used first
+	size_t m_bytes;
+	size_t m_maxBytes;
+	Stats m_stats;
+};
+
+#endif /* REPLYCACHE_H */
@@ -34,6 +34,7 @@ public:
 	virtual void valueChanged(const std::string& key, const pbnjson::JValue &value);
 	virtual pbnjson::JValue valuesForKey(const std::string& key);
 	virtual bool isPrefConsistent();
+	virtual std::list<std::string> consistencyFiles();
 	virtual void restoreToDefault();
 };
  
@@ -18,6 +18,7 @@
 #define SETTINGS_H
 
 #include <string>
+#include <list>
 
 #include <glib.h>
 
@@ -52,6 +53,23 @@ public:
 	bool	m_image2svcAvailable;
 	std::string m_comPalmImage2BinaryFile;
 
+	// systemprefs.db connection tuning (PrefsDb); empty/0 keeps the sqlite default
+	std::string m_prefsDbJournalMode;
+	std::string m_prefsDbSynchronous;
+	int	m_prefsDbCacheSizeKb;
+	int	m_prefsDbMmapSize;
+	int	m_prefsDbCheckpointIdleMs;
+	std::list<std::string> m_prefsDbCoalescedKeys;
+	int	m_prefsDbCoalesceWindowMs;
+	int	m_prefsDbCoalesceJournalMax;
+	std::string m_prefsDbIntegrityCheck;
+	int	m_prefsDbIntegrityCheckMaxAgeSec;
+	bool	m_prefsDbWriterThread;
+	std::string m_prefsDbBackend;		// "sqlite" or "log"
+
+	// "key:milliseconds" entries: subscribers of key get at most one update per interval (PrefsFactory)
+	std::list<std::string> m_notifyRateLimits;
+
 	ESchemaErrorOptions schemaValidationOption;
 	bool	switchTimezoneOnManualTime;
 	bool	useLocalizedTZ;
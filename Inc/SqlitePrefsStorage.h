@@ -0,0 +1,60 @@
+// Copyright (c) 2026 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+
+#ifndef SQLITEPREFSSTORAGE_H
+#define SQLITEPREFSSTORAGE_H
+
+#include "PrefsStorage.h"
+
+// the Preferences table of an open connection. The connection stays the caller's: PrefsDb keeps
+// using it for what only sqlite has (WAL checkpoints, integrity checks, schema upgrades, ATTACH)
+class SqlitePrefsStorage : public PrefsStorage
+{
+public:
+	// a legacy table has only the key and value columns (standalone and backup databases)
+	SqlitePrefsStorage(sqlite3* db, bool legacy);
+	~SqlitePrefsStorage();
+
+	// the statement put() runs, for connections that write without a SqlitePrefsStorage
+	static const char* putQuery(bool legacy);
+
+	virtual const char* name() const { return "sqlite"; }
+
+	virtual bool get(const std::string& key, Record& r_record);
+	virtual bool put(const Record& record);
+
+	virtual bool beginBatch();
+	virtual bool commitBatch();
+	virtual void rollbackBatch();
+
+	virtual bool iterate(const std::function<void(const Record&)>& visit);
+
+	// online backup API copy of the whole database, including what is still in the -wal file
+	virtual bool snapshot(const std::string& filename);
+
+private:
+	// prepared once and owned by this object; reset after use, never finalized by callers
+	sqlite3_stmt* statement(sqlite3_stmt*& r_stmt, const char* sql);
+
+	sqlite3* m_db;
+	bool m_legacy;
+	sqlite3_stmt* m_getStmt;
+	sqlite3_stmt* m_putStmt;
+	sqlite3_stmt* m_iterateStmt;
+};
+
+#endif /* SQLITEPREFSSTORAGE_H */
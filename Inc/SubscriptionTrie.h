@@ -0,0 +1,60 @@
+// Copyright (c) 2026 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+
+#ifndef SUBSCRIPTIONTRIE_H
+#define SUBSCRIPTIONTRIE_H
+
+#include <list>
+#include <map>
+#include <memory>
+#include <string>
+
+// the set of subscribed key prefixes, as a character trie: finding every prefix a key falls
+// under walks the key once, however many prefixes there are
+class SubscriptionTrie
+{
+public:
+	SubscriptionTrie();
+	~SubscriptionTrie();
+
+	void insert(const std::string& prefix);
+	// drops prefix and the nodes only it used
+	void erase(const std::string& prefix);
+
+	// the stored prefixes key starts with, shortest first (the empty prefix matches every key).
+	// Internal keys (see PrefsDb::isInternalKey()) match none
+	std::list<std::string> matches(const std::string& key) const;
+
+	bool empty() const { return m_size == 0; }
+	size_t size() const { return m_size; }
+
+private:
+	struct Node
+	{
+		Node() : terminal(false) {}
+
+		bool terminal;		// a prefix ends here
+		std::map<char, std::unique_ptr<Node> > children;
+	};
+
+	static bool erase(Node& node, const std::string& prefix, size_t depth, bool& r_erased);
+
+	Node m_root;
+	size_t m_size;
+};
+
+#endif /* SUBSCRIPTIONTRIE_H */
@@ -33,6 +33,7 @@
 
 class TimeZoneInfo;
 class PreferredZones;
+class JsonWriter;
 
 //a container only
 class NitzParameters
@@ -271,7 +272,7 @@ private:
      * Attach system-time information to json object.
      * Useful for building getSystemTime response
      */
-    void attachSystemTime(pbnjson::JValue &json);
+    void attachSystemTime(JsonWriter &writer);
 
     static bool jsonUtil_ZoneFromJson(const pbnjson::JValue &json,TimeZoneInfo& r_zoneInfo);
 
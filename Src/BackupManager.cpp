@@ -35,6 +35,9 @@ using namespace pbnjson;
 
 std::string BackupManager::s_backupKeylistFilename = WEBOS_INSTALL_WEBOS_SYSCONFDIR "/sysservice-backupkeys.json";
 
+// keys copied into the backup db per main loop iteration during preBackup
+static const size_t s_backupKeysPerStep = 32;
+
 /*!
  * \page com_palm_systemservice_backup Service API com.webos.service.systemservice/backup/
  *
@@ -58,6 +61,10 @@ LSMethod BackupManager::s_BackupServerMethods[]  = {
 BackupManager::BackupManager()
 	: m_doBackupFiles(true)
 	, m_p_backupDb(nullptr)
+	, m_preBackupHandle(nullptr)
+	, m_preBackupMessage(nullptr)
+	, m_preBackupFilenamesOnly(false)
+	, m_copyKeysSource(0)
 {
 }
 
@@ -71,29 +78,80 @@ void BackupManager::setServiceHandle(LSHandle* serviceHandle)
 	}
 }
 
-void BackupManager::copyKeysToBackupDb()
+std::list<std::string> BackupManager::backupKeyList()
 {
-	if (!m_p_backupDb)
-		return;
+	std::list<std::string> keylist;
 
 	//open the backup keys list to figure out what to copy
 	JValue backupKeysJson = JDomParser::fromFile(BackupManager::s_backupKeylistFilename.c_str());
 
 	if (!backupKeysJson.isArray()) {
 		PmLogWarning(sysServiceLogContext(), "STRING_KEY_NOT_EXIST",0,"file does not contain an array of string keys");
-		return;
+		return keylist;
 	}
 
-	std::list<std::string> keylist;
 	for (const JValue key: backupKeysJson.items()) {
 		if (!key.isString()) {
 			PmLogWarning(sysServiceLogContext(),"INVALID_KEY",0,"Invalid key (skipping)");
 			continue;
 		}
 
+		// runtime state, not worth restoring
+		if (PrefsDb::instance()->isVolatileKey(key.asString())) {
+			PmLogDebug(sysServiceLogContext(), "volatile key %s not backed up", key.asString().c_str());
+			continue;
+		}
+
 		keylist.push_back(key.asString());
 	}
-	m_p_backupDb->copyKeys(PrefsDb::instance(), keylist);
+	return keylist;
+}
+
+gboolean BackupManager::cbCopyKeysToBackupDb(gpointer data)
+{
+	BackupManager* self = static_cast<BackupManager*>(data);
+
+	if (self->m_p_backupDb && !self->m_pendingBackupKeys.empty())
+	{
+		int n = self->m_p_backupDb->copyKeysStep(self->m_pendingBackupKeys, s_backupKeysPerStep);
+		if (n < 0)
+		{
+			// back up whatever made it in, same as when single keys failed to copy
+			PmLogWarning(sysServiceLogContext(),"BACKUP_COPY_ERROR",0,"failed to copy %zu keys into the backup db",self->m_pendingBackupKeys.size());
+			self->m_pendingBackupKeys.clear();
+		}
+		if (!self->m_pendingBackupKeys.empty())
+			return G_SOURCE_CONTINUE;
+	}
+
+	self->m_copyKeysSource = 0;
+	if (self->m_p_backupDb && self->m_p_backupDb->m_copySource && !self->m_p_backupDb->endCopyKeys())
+		PmLogWarning(sysServiceLogContext(),"BACKUP_COPY_ERROR",0,"failed to commit the keys copied into the backup db");
+	self->finishPreBackup();
+	return G_SOURCE_REMOVE;
+}
+
+void BackupManager::finishPreBackup()
+{
+	LSHandle* lshandle = m_preBackupHandle;
+	LSMessage* message = m_preBackupMessage;
+	m_preBackupHandle = nullptr;
+	m_preBackupMessage = nullptr;
+
+	// adding the files for backup at the time of request.
+	initFilesForBackup(m_preBackupFilenamesOnly);
+
+	if (!m_doBackupFiles)
+	{
+		PmLogWarning(sysServiceLogContext(),"NO_BACKUP",0,"opted not to do a backup at this time due to doBackup internal var");
+		(void) sendPreBackupResponse(lshandle,message,std::list<std::string>());
+	}
+	else
+	{
+		(void) sendPreBackupResponse(lshandle,message,m_backupFiles);
+	}
+
+	LSMessageUnref(message);
 }
 
 void BackupManager::initFilesForBackup(bool useFilenameWithoutPath)
@@ -119,8 +177,7 @@ void BackupManager::initFilesForBackup(bool useFilenameWithoutPath)
 
 			if (Settings::instance()->m_saveLastBackedUpTempDb)
 			{
-				Utils::fileCopy(m_p_backupDb->databaseFile().c_str(),
-						(std::string(PrefsDb::s_mediaPartitionPath)+std::string(PrefsDb::s_sysserviceDir)+std::string("/lastBackedUpTempDb.db")).c_str());
+				(void) m_p_backupDb->snapshot(std::string(PrefsDb::s_mediaPartitionPath)+std::string(PrefsDb::s_sysserviceDir)+std::string("/lastBackedUpTempDb.db"));
 			}
 		}
 	}
@@ -136,6 +193,9 @@ com.webos.service.systemservice/backup/preBackup
 
 Make a backup of LunaSysService preferences.
 
+The keys listed in sysservice-backupkeys.json (except volatile ones, see sysservice-volatilekeys.json) are copied into the backup database
+a few at a time between other requests; the reply is sent once the copy is complete.
+
 \subsection com_palm_systemservice_pre_backup_syntax Syntax:
 \code
 {
@@ -217,6 +277,12 @@ bool BackupManager::preBackupCallback( LSHandle* lshandle, LSMessage *message, v
 
 	BackupManager *self = BackupManager::instance();
 
+	if (self->m_preBackupMessage)
+	{
+		PmLogWarning(sysServiceLogContext(),"BACKUP_IN_PROGRESS",0,"preBackup called while the previous one is still copying keys...aborting!");
+		return self->sendPreBackupResponse(lshandle,message,std::list<std::string>());
+	}
+
 	// try and create it
 	std::string dbfile = tempDir;
 	if (dbfile.empty() || *dbfile.rbegin() != '/')
@@ -231,18 +297,22 @@ bool BackupManager::preBackupCallback( LSHandle* lshandle, LSMessage *message, v
 		return self->sendPreBackupResponse(lshandle,message,std::list<std::string>());
 	}
 
-	// Attempt to copy relevant keys into the temporary backup database
-	self->copyKeysToBackupDb();
-	// adding the files for backup at the time of request.
-	self->initFilesForBackup(myTmp);
-
-	if (!self->m_doBackupFiles)
+	// Attempt to copy relevant keys into the temporary backup database. The copy is spread over
+	// idle callbacks so that a long key list doesn't hold up other requests, and all of them read
+	// the preferences as they are now; the reply goes out from finishPreBackup()
+	self->m_pendingBackupKeys = self->backupKeyList();
+	if (!self->m_p_backupDb->beginCopyKeys(PrefsDb::instance(), self->m_pendingBackupKeys))
 	{
-		PmLogWarning(sysServiceLogContext(),"NO_BACKUP",0,"opted not to do a backup at this time due to doBackup internal var");
-		return self->sendPreBackupResponse(lshandle,message,std::list<std::string>());
+		PmLogWarning(sysServiceLogContext(),"BACKUP_COPY_ERROR",0,"failed to start copying keys into the backup db");
+		self->m_pendingBackupKeys.clear();
 	}
+	self->m_preBackupFilenamesOnly = myTmp;
+	self->m_preBackupHandle = lshandle;
+	self->m_preBackupMessage = message;
+	LSMessageRef(message);
+	self->m_copyKeysSource = g_idle_add(BackupManager::cbCopyKeysToBackupDb, self);
 
-	return self->sendPreBackupResponse(lshandle, message, self->m_backupFiles);
+	return true;
 }
 
 /*! \page com_palm_systemservice_backup
@@ -302,6 +372,9 @@ bool BackupManager::postRestoreCallback( LSHandle* lshandle, LSMessage *message,
 	std::string tempDir = root["tempDir"].asString();
 	JValue files = root["files"];
 
+	// keys whose value one of the merges changed
+	std::list<std::string> changedKeys;
+
 	for (const JValue &file: files.items())
 	{
 		std::string path = file.isString() ? file.asString() : "";
@@ -332,7 +405,7 @@ bool BackupManager::postRestoreCallback( LSHandle* lshandle, LSMessage *message,
 			}
 
 			//run a merge
-			int rc = PrefsDb::instance()->merge(path);
+			int rc = PrefsDb::instance()->merge(path, true, &changedKeys);
 			if (rc == 0)
 			{
 				PmLogWarning(sysServiceLogContext(),"ERROR_OR_EMPTY_BACKUP",0,"merge() from [%s] didn't merge anything...could be an error or just an empty backup db",path.c_str());
@@ -342,8 +415,10 @@ bool BackupManager::postRestoreCallback( LSHandle* lshandle, LSMessage *message,
 
 	// if for whatever reason the main db got closed, reopen it (the function will act ok if already open)
 	PrefsDb::instance()->openPrefsDb();
-	//now refresh all the keys
-	PrefsFactory::instance()->refreshAllKeys();
+	//now refresh the keys the restore changed
+	changedKeys.sort();
+	changedKeys.unique();
+	PrefsFactory::instance()->refreshKeys(changedKeys);
 
 	return BackupManager::instance()->sendPostRestoreResponse(lshandle,message);
 }
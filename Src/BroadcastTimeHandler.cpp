@@ -27,21 +27,6 @@
 #include "JSONUtils.h"
 #include "TimePrefsHandler.h"
 
-#define SCHEMA_LOCALTIME { \
-					"type": "object", \
-					"description": "Local time in components", \
-					"properties": { \
-						"year": { "type": "integer", "minimum": 1900 }, \
-						"month": { "type": "integer", "minimum": 1, "maximum": 12 }, \
-						"day": { "type": "integer", "minimum": 1, "maximum": 31 }, \
-						"hour": { "type": "integer", "minimum": 0, "maximum": 23 }, \
-						"minute": { "type": "integer", "minimum": 0, "maximum": 59 }, \
-						"second": { "type": "integer", "minimum": 0, "maximum": 59 } \
-					}, \
-					"required": [ "year", "month", "day", "hour", "minute", "second" ], \
-					"additionalProperties": false \
-				}
-
 namespace {
 	const char *effectiveBroadcastKey = "effectiveBroadcastKey";
 	pbnjson::JSchemaFragment schemaGeneric("{}");
@@ -78,43 +63,6 @@ namespace {
 		}
 	));
 
-	// schema for /time/getBroadcastTime
-	pbnjson::JSchemaFragment schemaGetBroadcastTimeReply(JSON(
-		{
-			"type": "object",
-			"description": "Time info received from broadcast signal",
-			"properties": {
-				"returnValue": {
-					"type": "boolean",
-					"enum": [true]
-				},
-				"subscribed": {
-					"type": "boolean"
-				},
-				"utc": {
-					"type": "integer",
-					"description": "UTC time in seconds since epoch"
-				},
-				"adjustedUtc": {
-					"type": "integer",
-					"description": "UTC time in seconds since epoch adjusted with Time-Zone from local time"
-				},
-				"local": {
-					"type": "integer",
-					"description": "Local time in seconds since epoch"
-				},
-				"localtime": SCHEMA_LOCALTIME,
-				"systemTimeSource": {
-					"type": "string",
-					"description": "Tag for clock system-time were synchronized with"
-				},
-				"timestamp": SCHEMA_TIMESTAMP
-			},
-			"required": [ "returnValue", "local" ],
-			"additionalProperties": false
-		}
-	));
-
 	bool reply(LSHandle* handle, LSMessage *message, const pbnjson::JValue &response, const pbnjson::JSchema &schema = schemaGeneric)
 	{
 		std::string serialized;
@@ -137,6 +85,19 @@ namespace {
 		return true;
 	}
 
+	bool reply(LSHandle* handle, LSMessage *message, const JsonWriter &response)
+	{
+		LSError lsError;
+		LSErrorInit(&lsError);
+		if (!LSMessageReply(handle, message, response.c_str(), &lsError))
+		{
+			PmLogCritical(sysServiceLogContext(), "LSMESSAGE_REPLY_FAILED", 0, "LSMessageReply failed, Error:%s", lsError.message);
+			LSErrorFree (&lsError);
+			return false;
+		}
+		return true;
+	}
+
 	time_t toLocal(time_t utc)
 	{
 		// this is unusual for Unix to store local time in time_t
@@ -163,7 +124,7 @@ namespace {
 		return timelocal(&localTm);
 	}
 
-	void addLocalTime(pbnjson::JValue &root, time_t local)
+	void addLocalTime(JsonWriter &root, time_t local)
 	{
 		// gmtime/localtime both takes UTC and returns datetime broken into
 		// components either without TZ or with TZ adjustment
@@ -175,16 +136,17 @@ namespace {
 		}
 		else
 		{
-			root.put("localtime", toJValue(tmLocal));
+			root.key("localtime");
+			writeJson(root, tmLocal);
 		}
 	}
 
 	/**
-	 * Builds JValue which represents answer to getEffectiveBroadcastTime
+	 * Writes the members of an answer to getEffectiveBroadcastTime
 	 *
 	 * @return false if error met and as result answer contains error info
 	 */
-	bool answerEffectiveBroadcastTime(pbnjson::JValue &answer, const TimePrefsHandler &timePrefsHandler,
+	bool answerEffectiveBroadcastTime(JsonWriter &answer, const TimePrefsHandler &timePrefsHandler,
 															   const BroadcastTime &broadcastTime)
 	{
 		time_t adjustedUtc, local;
@@ -226,9 +188,10 @@ namespace {
 			return false;
 		}
 
-		answer.put("adjustedUtc", toJValue(adjustedUtc));
-		answer.put("local", toJValue(local));
-		answer.put("timestamp", ClockHandler::timestampJson());
+		answer.put("adjustedUtc", adjustedUtc);
+		answer.put("local", local);
+		answer.key("timestamp");
+		ClockHandler::writeTimestamp(answer);
 		addLocalTime(answer, local);
 
 		if (systemTimeUsed)
@@ -309,14 +272,17 @@ bool TimePrefsHandler::cbGetBroadcastTime(LSHandle* handle, LSMessage *message,
 		return reply(handle, message, createJsonReply(false, -2, "No information available"));
 	}
 
-	pbnjson::JValue answer = pbnjson::Object();
+	JsonWriter answer;
+	answer.beginObject();
 	answer.put("returnValue", true);
-	answer.put("utc", toJValue(utc));
-	answer.put("local", toJValue(local));
-	answer.put("timestamp", ClockHandler::timestampJson());
+	answer.put("utc", utc);
+	answer.put("local", local);
+	answer.key("timestamp");
+	ClockHandler::writeTimestamp(answer);
 	addLocalTime(answer, local);
+	answer.endObject();
 
-	return reply(handle, message, answer, schemaGetBroadcastTimeReply);
+	return reply(handle, message, answer);
 }
 
 bool TimePrefsHandler::cbGetEffectiveBroadcastTime(LSHandle* handle, LSMessage *message,
@@ -330,15 +296,16 @@ bool TimePrefsHandler::cbGetEffectiveBroadcastTime(LSHandle* handle, LSMessage *
 
 	pbnjson::JValue request = parser.get();
 
-	pbnjson::JValue answer = pbnjson::Object();
+	JsonWriter answer;
+	answer.beginObject();
 	if (!answerEffectiveBroadcastTime(answer, *timePrefsHandler, broadcastTime))
 	{
 		// error?
 		answer.put("returnValue", false);
+		answer.endObject();
 		return reply(handle, message, answer);
 	}
 	answer.put("returnValue", true);
-	answer.put("timestamp", ClockHandler::timestampJson());
 
 	// handle subscription
 	if (request["subscribe"].asBool())
@@ -353,13 +320,15 @@ bool TimePrefsHandler::cbGetEffectiveBroadcastTime(LSHandle* handle, LSMessage *
 		LSErrorFree(&lsError);
 		answer.put("subscribed", subscribed);
 	}
+	answer.endObject();
 
-	return reply(handle, message, answer, schemaGetBroadcastTimeReply);
+	return reply(handle, message, answer);
 }
 
 void TimePrefsHandler::postBroadcastEffectiveTimeChange()
 {
-	pbnjson::JValue answer = pbnjson::Object();
+	JsonWriter answer;
+	answer.beginObject();
 
 	// ignore error (will be reported as one of the reply
 	if (!answerEffectiveBroadcastTime(answer, *this, m_broadcastTime))
@@ -367,18 +336,11 @@ void TimePrefsHandler::postBroadcastEffectiveTimeChange()
 		PmLogWarning(sysServiceLogContext(),"FAILED_TO_POST_ERROR",0,"Failed to prepare post answer for getEffectiveBroadcastTime subscription (ignoring)");
 		return;
 	}
-
-	std::string serialized;
-
-	pbnjson::JGenerator serializer(NULL);
-	if (!serializer.toString(answer, schemaGeneric, serialized)) {
-		PmLogCritical(sysServiceLogContext(), "JGENERATOR_FAILED", 0, "JGenerator failed");
-		return;
-	}
+	answer.endObject();
 
 	LSError lsError;
 	LSErrorInit(&lsError);
-	if(!LSSubscriptionReply(m_serviceHandle, effectiveBroadcastKey, serialized.c_str(), &lsError))
+	if(!LSSubscriptionReply(m_serviceHandle, effectiveBroadcastKey, answer.c_str(), &lsError))
 	{
 		PmLogCritical(sysServiceLogContext(), "LSSUBSCRIPTIONREPLY_FAILED", 0, "LSSubscriptionReply failed, Error:%s", lsError.message);
 	}
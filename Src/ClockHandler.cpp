@@ -540,6 +540,18 @@ time_t ClockHandler::evaluateDelay(const timespec& sourceTimeStamp)
 	return delay;
 }
 
+void ClockHandler::writeTimestamp(JsonWriter &writer)
+{
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	writer.beginObject()
+		.put("source", "monotonic")
+		.put("sec", ts.tv_sec)
+		.put("nsec", ts.tv_nsec)
+		.endObject();
+}
+
 pbnjson::JValue ClockHandler::timestampJson(void)
 {
 	pbnjson::JValue ret = pbnjson::Object();
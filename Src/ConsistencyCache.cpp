@@ -0,0 +1,189 @@
+// Copyright (c) 2026 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+
+#include "ConsistencyCache.h"
+#include "Logging.h"
+#include "PrefsDb.h"
+#include "Utils.h"
+
+// anything that could turn a file that passed into one that doesn't
+static const uint32_t s_fileMask = IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF;
+// another file given the name (renamed over it, or deleted and created again), or the name gone
+static const uint32_t s_dirMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR;
+
+ConsistencyCache::ConsistencyCache()
+: m_inotifyFd(-1)
+, m_channel(0)
+, m_watchSource(0)
+{
+}
+
+ConsistencyCache::~ConsistencyCache()
+{
+	if (m_watchSource)
+		g_source_remove(m_watchSource);
+	if (m_channel)
+		g_io_channel_unref(m_channel);
+	if (m_inotifyFd >= 0)
+		close(m_inotifyFd);
+}
+
+bool ConsistencyCache::isConsistent(const std::string& key) const
+{
+	auto it = m_verdicts.find(key);
+	return it != m_verdicts.end() && PrefsDb::instance()->hasValue(key, it->second.value);
+}
+
+void ConsistencyCache::setConsistent(const std::string& key, const std::string& value, const std::list<std::string>& files)
+{
+	invalidate(key);
+
+	if (!files.empty() && !startWatching())
+		return;
+
+	Verdict verdict;
+	verdict.value = value;
+	for (const std::string& file : files) {
+		// the name in its directory, and the file itself if there is one: a watch on the file
+		// alone stays with the old inode when the name is given to another one
+		Utils::gstring dir = g_path_get_dirname(file.c_str());
+		Utils::gstring name = g_path_get_basename(file.c_str());
+		if (!addWatch(dir.get(), s_dirMask, name.get(), key, verdict) ||
+			(!addWatch(file, s_fileMask, std::string(), key, verdict) && errno != ENOENT)) {
+			PmLogDebug(sysServiceLogContext(), "not caching the verdict for %s, can't watch %s: %s", key.c_str(), file.c_str(), strerror(errno));
+			dropWatches(verdict, key);
+			return;
+		}
+	}
+
+	m_verdicts[key] = verdict;
+}
+
+void ConsistencyCache::invalidate(const std::string& key)
+{
+	auto it = m_verdicts.find(key);
+	if (it == m_verdicts.end())
+		return;
+
+	dropWatches(it->second, key);
+	m_verdicts.erase(it);
+}
+
+void ConsistencyCache::clear()
+{
+	while (!m_verdicts.empty())
+		invalidate(m_verdicts.begin()->first);
+}
+
+bool ConsistencyCache::startWatching()
+{
+	if (m_inotifyFd >= 0)
+		return true;
+
+	m_inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (m_inotifyFd < 0) {
+		PmLogWarning(sysServiceLogContext(), "INOTIFY_INIT_FAIL", 0, "Can't watch files for consistency checks: %s", strerror(errno));
+		return false;
+	}
+
+	m_channel = g_io_channel_unix_new(m_inotifyFd);
+	m_watchSource = g_io_add_watch(m_channel, G_IO_IN, cbFilesChanged, this);
+	return true;
+}
+
+bool ConsistencyCache::addWatch(const std::string& path, uint32_t mask, const std::string& name, const std::string& key, Verdict& r_verdict)
+{
+	// a directory may also be a file some check looked at: masks add up instead of replacing
+	// each other
+	int wd = inotify_add_watch(m_inotifyFd, path.c_str(), mask | IN_MASK_ADD);
+	if (wd < 0)
+		return false;
+
+	Watch watch(wd, name);
+	r_verdict.watches.push_back(watch);
+	m_watchedKeys[watch].insert(key);
+	return true;
+}
+
+void ConsistencyCache::dropWatches(const Verdict& verdict, const std::string& key)
+{
+	for (const Watch& watch : verdict.watches) {
+		auto it = m_watchedKeys.find(watch);
+		if (it == m_watchedKeys.end())
+			continue;
+
+		it->second.erase(key);
+		if (!it->second.empty())
+			continue;
+		m_watchedKeys.erase(it);
+
+		// the same file or directory watched for another key (or name) keeps its watch
+		auto used = m_watchedKeys.lower_bound(Watch(watch.first, std::string()));
+		if (used == m_watchedKeys.end() || used->first.first != watch.first)
+			(void) inotify_rm_watch(m_inotifyFd, watch.first);
+	}
+}
+
+gboolean ConsistencyCache::cbFilesChanged(GIOChannel*, GIOCondition, gpointer data)
+{
+	ConsistencyCache* self = static_cast<ConsistencyCache*>(data);
+
+	char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t length;
+	while ((length = read(self->m_inotifyFd, buffer, sizeof(buffer))) > 0) {
+		for (char* p = buffer; p < buffer + length; ) {
+			const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(p);
+			p += sizeof(struct inotify_event) + event->len;
+
+			std::set<std::string> keys;
+			if (event->mask & IN_IGNORED) {
+				// the kernel dropped the watch (file or directory gone): every verdict using it
+				// goes without touching it again, and the next setConsistent() for those keys
+				// watches whatever has the name by then
+				auto it = self->m_watchedKeys.lower_bound(Watch(event->wd, std::string()));
+				while (it != self->m_watchedKeys.end() && it->first.first == event->wd) {
+					keys.insert(it->second.begin(), it->second.end());
+					it = self->m_watchedKeys.erase(it);
+				}
+			}
+			else {
+				// the file itself, or the name of one in the directory; invalidate() drops the watches
+				auto it = self->m_watchedKeys.find(Watch(event->wd, std::string()));
+				if (it != self->m_watchedKeys.end())
+					keys.insert(it->second.begin(), it->second.end());
+				if (event->len > 0) {
+					it = self->m_watchedKeys.find(Watch(event->wd, event->name));
+					if (it != self->m_watchedKeys.end())
+						keys.insert(it->second.begin(), it->second.end());
+				}
+			}
+
+			// every verdict that looked at the file goes
+			for (const std::string& key : keys) {
+				PmLogDebug(sysServiceLogContext(), "file checked for %s changed, checking it again next time", key.c_str());
+				self->invalidate(key);
+			}
+		}
+	}
+
+	return G_SOURCE_CONTINUE;
+}
@@ -18,6 +18,9 @@
 
 #include <luna-service2++/error.hpp>
 
+#include <cinttypes>
+#include <cstdio>
+
 bool JsonMessageParser::parse(const char * callerFunction)
 {
 	if (!mParser.parse(mJson, mSchema))
@@ -41,6 +44,61 @@ pbnjson::JValue createJsonReply(bool returnValue, int errorCode, const char *err
 	return reply;
 }
 
+JsonWriter & JsonWriter::key(const char * name, size_t length)
+{
+	separate();
+	appendString(mBuffer, name, length);
+	mBuffer += ':';
+	return *this;
+}
+
+JsonWriter & JsonWriter::integer(int64_t number)
+{
+	separate();
+	char digits[24];
+	int length = snprintf(digits, sizeof(digits), "%" PRId64, number);
+	mBuffer.append(digits, length);
+	return *this;
+}
+
+void JsonWriter::appendString(std::string & r_buffer, const char * str, size_t length)
+{
+	static const char hex[] = "0123456789abcdef";
+
+	r_buffer += '"';
+
+	// copy runs of characters that need no escape in one go
+	size_t start = 0;
+	for (size_t i = 0; i < length; ++i)
+	{
+		unsigned char c = static_cast<unsigned char>(str[i]);
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		r_buffer.append(str + start, i - start);
+		start = i + 1;
+
+		switch (c)
+		{
+		case '"':  r_buffer += "\\\""; break;
+		case '\\': r_buffer += "\\\\"; break;
+		case '\b': r_buffer += "\\b"; break;
+		case '\f': r_buffer += "\\f"; break;
+		case '\n': r_buffer += "\\n"; break;
+		case '\r': r_buffer += "\\r"; break;
+		case '\t': r_buffer += "\\t"; break;
+		default:
+			r_buffer += "\\u00";
+			r_buffer += hex[c >> 4];
+			r_buffer += hex[c & 0xf];
+			break;
+		}
+	}
+	r_buffer.append(str + start, length - start);
+
+	r_buffer += '"';
+}
+
 LSMessageJsonParser::LSMessageJsonParser(LSMessage *message, const char *schema)
 	: mMessage(message)
 	, mSchema(pbnjson::JSchema::fromString(schema))
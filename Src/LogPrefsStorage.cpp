@@ -0,0 +1,513 @@
+// Copyright (c) 2026 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "Logging.h"
+#include "LogPrefsStorage.h"
+#include "SqlitePrefsStorage.h"
+
+static const char s_headerMagic[] = "prefslog";
+static const char s_logVersion = '1';
+static const char s_putFrame = 'P';
+static const char s_commitFrame = 'C';
+
+// below this the file isn't worth rewriting, however much of it is garbage
+static const off_t s_minCompactBytes = 64 * 1024;
+
+static uint32_t crc32(const std::string& data)
+{
+	static const std::vector<uint32_t> table = [] {
+		std::vector<uint32_t> t(256);
+		for (uint32_t i = 0; i < 256; ++i) {
+			uint32_t c = i;
+			for (int k = 0; k < 8; ++k)
+				c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+			t[i] = c;
+		}
+		return t;
+	}();
+
+	uint32_t crc = 0xffffffff;
+	for (unsigned char byte: data)
+		crc = table[(crc ^ byte) & 0xff] ^ (crc >> 8);
+	return crc ^ 0xffffffff;
+}
+
+static void putUint(std::string& r_out, uint64_t value, int bytes)
+{
+	for (int i = 0; i < bytes; ++i)
+		r_out += (char) ((value >> (8 * i)) & 0xff);
+}
+
+static uint64_t getUint(const std::string& in, size_t pos, int bytes)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < bytes; ++i)
+		value |= (uint64_t) (unsigned char) in[pos + i] << (8 * i);
+	return value;
+}
+
+static void putField(std::string& r_out, const std::string& field)
+{
+	putUint(r_out, field.size(), 4);
+	r_out += field;
+}
+
+static bool getField(const std::string& in, size_t& r_pos, std::string& r_field)
+{
+	if (in.size() - r_pos < 4)
+		return false;
+	size_t length = getUint(in, r_pos, 4);
+	r_pos += 4;
+	if (in.size() - r_pos < length)
+		return false;
+	r_field.assign(in, r_pos, length);
+	r_pos += length;
+	return true;
+}
+
+static bool writeAll(int fd, const std::string& data)
+{
+	const char* p = data.data();
+	size_t left = data.size();
+	while (left > 0) {
+		ssize_t n = write(fd, p, left);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += n;
+		left -= n;
+	}
+	return true;
+}
+
+LogPrefsStorage::LogPrefsStorage(const std::string& filename, bool sync)
+: m_filename(filename)
+, m_sync(sync)
+, m_fd(-1)
+, m_size(0)
+, m_liveBytes(0)
+, m_inBatch(false)
+, m_compactSource(0)
+{
+}
+
+LogPrefsStorage::~LogPrefsStorage()
+{
+	if (m_compactSource)
+		g_source_remove(m_compactSource);
+	if (m_fd >= 0)
+		close(m_fd);
+}
+
+bool LogPrefsStorage::open()
+{
+	if (m_fd >= 0)
+		return true;
+
+	m_fd = ::open(m_filename.c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+	if (m_fd < 0) {
+		PmLogWarning(sysServiceLogContext(), "PREFS_LOG_ERROR", 0, "Failed to open preferences log [%s]: %s",
+					 m_filename.c_str(), strerror(errno));
+		return false;
+	}
+
+	if (!replay()) {
+		close(m_fd);
+		m_fd = -1;
+		return false;
+	}
+	return true;
+}
+
+bool LogPrefsStorage::replay()
+{
+	m_index.clear();
+	m_liveBytes = 0;
+	m_size = 0;
+
+	struct stat st;
+	if (fstat(m_fd, &st) != 0)
+		return false;
+
+	std::string data(st.st_size, '\0');
+	for (size_t done = 0; done < data.size(); ) {
+		ssize_t n = pread(m_fd, &data[done], data.size() - done, done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			PmLogWarning(sysServiceLogContext(), "PREFS_LOG_ERROR", 0, "Failed to read preferences log [%s]", m_filename.c_str());
+			return false;
+		}
+		done += n;
+	}
+
+	size_t pos = 0;
+	size_t committed = 0;
+	bool header = false;
+	std::vector<Entry> pending;
+
+	// a frame that doesn't check out ends the replay. At the end of the file that is a write
+	// the crash interrupted; anywhere else the records after it can't be trusted, and can't be
+	// given up either
+	while (pos < data.size()) {
+		size_t length = (data.size() - pos >= 8) ? getUint(data, pos, 4) : 0;
+		uint32_t crc = (data.size() - pos >= 8) ? getUint(data, pos + 4, 4) : 0;
+		bool complete = (data.size() - pos >= 8) && length > 0 && data.size() - pos - 8 >= length;
+
+		std::string payload;
+		if (complete)
+			payload = data.substr(pos + 8, length);
+		if (!complete || crc32(payload) != crc) {
+			if (!isTornTail(data, pos, length))
+				return quarantine(header ? "corrupt frame" : "corrupt header", pos);
+			break;
+		}
+
+		if (!header) {
+			if (payload != headerPayload())
+				return quarantine("not a preferences log header", pos);
+			header = true;
+		}
+		else if (payload[0] == s_putFrame) {
+			Entry entry { Record(), 8 + length };
+			if (!parsePut(payload, entry.record))
+				return quarantine("malformed record", pos);
+			pending.push_back(std::move(entry));
+		}
+		else if (payload[0] == s_commitFrame) {
+			apply(pending);
+		}
+		else {
+			return quarantine("unknown frame", pos);
+		}
+
+		pos += 8 + length;
+		if (pending.empty())
+			committed = pos;
+	}
+
+	// a torn last frame, or puts without their commit frame: never acknowledged
+	if (committed < data.size()) {
+		PmLogWarning(sysServiceLogContext(), "PREFS_LOG_TRUNCATED", 0, "Dropping %zu bytes of incomplete records from [%s]",
+					 data.size() - committed, m_filename.c_str());
+		if (ftruncate(m_fd, committed) != 0)
+			return false;
+	}
+	m_size = committed;
+
+	if (m_size == 0) {
+		std::string frames;
+		appendFrame(frames, headerPayload());
+		if (!append(frames))
+			return false;
+	}
+
+	PmLogDebug(sysServiceLogContext(), "replayed %zu preferences from [%s], %zu of %lld bytes live",
+			   m_index.size(), m_filename.c_str(), m_liveBytes, (long long) m_size);
+	return true;
+}
+
+bool LogPrefsStorage::isTornTail(const std::string& data, size_t pos, size_t length)
+{
+	// the frame (or its length and CRC) runs into the end of the file
+	if (data.size() - pos < 8 || data.size() - pos - 8 <= length)
+		return true;
+
+	// or the file was extended but its last blocks never written
+	return data.find_first_not_of('\0', pos) == std::string::npos;
+}
+
+bool LogPrefsStorage::quarantine(const char* problem, size_t offset)
+{
+	// kept for whoever can recover it; opening again starts from the database
+	std::string corruptFilename = m_filename + ".corrupt";
+	if (rename(m_filename.c_str(), corruptFilename.c_str()) != 0) {
+		PmLogCritical(sysServiceLogContext(), "PREFS_LOG_CORRUPT", 0, "%s at offset %zu of preferences log [%s], failed to move it aside: %s",
+					  problem, offset, m_filename.c_str(), strerror(errno));
+		return false;
+	}
+
+	PmLogCritical(sysServiceLogContext(), "PREFS_LOG_CORRUPT", 0, "%s at offset %zu of preferences log [%s], moved it to [%s]",
+				  problem, offset, m_filename.c_str(), corruptFilename.c_str());
+	return false;
+}
+
+bool LogPrefsStorage::append(const std::string& frames)
+{
+	if (m_fd < 0)
+		return false;
+
+	if (!writeAll(m_fd, frames) || (m_sync && fdatasync(m_fd) != 0)) {
+		PmLogWarning(sysServiceLogContext(), "PREFS_LOG_ERROR", 0, "Failed to append to preferences log [%s]: %s",
+					 m_filename.c_str(), strerror(errno));
+		// don't leave a partial frame for the next append to follow
+		(void) ftruncate(m_fd, m_size);
+		return false;
+	}
+
+	m_size += frames.size();
+	return true;
+}
+
+void LogPrefsStorage::apply(std::vector<Entry>& entries)
+{
+	for (Entry& entry: entries) {
+		std::unordered_map<std::string, Entry>::iterator it = m_index.find(entry.record.key);
+		if (it != m_index.end()) {
+			m_liveBytes -= it->second.frameSize;
+			m_liveBytes += entry.frameSize;
+			it->second = std::move(entry);
+		}
+		else {
+			m_liveBytes += entry.frameSize;
+			std::string key = entry.record.key;
+			m_index.emplace(std::move(key), std::move(entry));
+		}
+	}
+	entries.clear();
+}
+
+bool LogPrefsStorage::isSparse() const
+{
+	return m_size > s_minCompactBytes && (size_t) m_size > 2 * m_liveBytes;
+}
+
+void LogPrefsStorage::compactIfSparse()
+{
+	// rewriting the file takes a while; not on the write that crossed the line
+	if (isSparse() && !m_compactSource)
+		m_compactSource = g_idle_add_full(G_PRIORITY_LOW, cbCompact, this, NULL);
+}
+
+gboolean LogPrefsStorage::cbCompact(gpointer data)
+{
+	LogPrefsStorage* self = static_cast<LogPrefsStorage*>(data);
+
+	// a batch is committed (or rolled back) first
+	if (self->m_inBatch)
+		return G_SOURCE_CONTINUE;
+
+	self->m_compactSource = 0;
+	if (self->isSparse())
+		(void) self->compact();
+	return G_SOURCE_REMOVE;
+}
+
+bool LogPrefsStorage::get(const std::string& key, Record& r_record)
+{
+	std::unordered_map<std::string, Entry>::const_iterator it = m_index.find(key);
+	if (it == m_index.end())
+		return false;
+	r_record = it->second.record;
+	return true;
+}
+
+bool LogPrefsStorage::put(const Record& record)
+{
+	std::string frames;
+	appendFrame(frames, putPayload(record));
+	Entry entry { record, frames.size() };
+
+	if (m_inBatch) {
+		m_batchFrames += frames;
+		m_batchEntries.push_back(std::move(entry));
+		return true;
+	}
+
+	appendFrame(frames, std::string(1, s_commitFrame));
+	if (!append(frames))
+		return false;
+
+	std::vector<Entry> entries;
+	entries.push_back(std::move(entry));
+	apply(entries);
+	compactIfSparse();
+	return true;
+}
+
+bool LogPrefsStorage::beginBatch()
+{
+	if (m_inBatch)
+		return false;
+
+	m_inBatch = true;
+	m_batchFrames.clear();
+	m_batchEntries.clear();
+	return true;
+}
+
+bool LogPrefsStorage::commitBatch()
+{
+	if (!m_inBatch)
+		return false;
+	m_inBatch = false;
+
+	if (m_batchEntries.empty())
+		return true;
+
+	appendFrame(m_batchFrames, std::string(1, s_commitFrame));
+	bool ok = append(m_batchFrames);
+	if (ok)
+		apply(m_batchEntries);
+
+	m_batchFrames.clear();
+	m_batchEntries.clear();
+
+	if (ok)
+		compactIfSparse();
+	return ok;
+}
+
+void LogPrefsStorage::rollbackBatch()
+{
+	m_inBatch = false;
+	m_batchFrames.clear();
+	m_batchEntries.clear();
+}
+
+bool LogPrefsStorage::iterate(const std::function<void(const Record&)>& visit)
+{
+	for (const auto& entry: m_index)
+		visit(entry.second.record);
+	return true;
+}
+
+bool LogPrefsStorage::snapshot(const std::string& filename)
+{
+	sqlite3* snapshotDb = 0;
+	if (sqlite3_open(filename.c_str(), &snapshotDb) != SQLITE_OK) {
+		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to open [%s] for a snapshot: %s", filename.c_str(), sqlite3_errmsg(snapshotDb));
+		sqlite3_close(snapshotDb);
+		return false;
+	}
+
+	bool ok = sqlite3_exec(snapshotDb,
+						   "PRAGMA journal_mode=DELETE;"
+						   "CREATE TABLE IF NOT EXISTS Preferences "
+						   "(key   TEXT NOT NULL ON CONFLICT FAIL UNIQUE ON CONFLICT REPLACE, "
+						   " value TEXT);", NULL, NULL, NULL) == SQLITE_OK;
+	{
+		SqlitePrefsStorage target(snapshotDb, true);
+		ok = ok && target.beginBatch();
+		for (const auto& entry: m_index)
+			ok = ok && target.put(entry.second.record);
+
+		if (ok)
+			ok = target.commitBatch();
+		else
+			target.rollbackBatch();
+	}
+
+	if (!ok)
+		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Snapshot into [%s] failed: %s", filename.c_str(), sqlite3_errmsg(snapshotDb));
+
+	sqlite3_close(snapshotDb);
+	return ok;
+}
+
+bool LogPrefsStorage::compact()
+{
+	if (m_fd < 0 || m_inBatch)
+		return false;
+
+	std::string frames;
+	appendFrame(frames, headerPayload());
+	for (const auto& entry: m_index)
+		appendFrame(frames, putPayload(entry.second.record));
+	appendFrame(frames, std::string(1, s_commitFrame));
+
+	// the old file stays in place until the new one is complete on disk
+	std::string tempFilename = m_filename + ".compact";
+	int fd = ::open(tempFilename.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	bool ok = (fd >= 0) && writeAll(fd, frames) && fdatasync(fd) == 0;
+	if (fd >= 0)
+		close(fd);
+
+	if (!ok || rename(tempFilename.c_str(), m_filename.c_str()) != 0) {
+		PmLogWarning(sysServiceLogContext(), "PREFS_LOG_ERROR", 0, "Failed to compact preferences log [%s]: %s",
+					 m_filename.c_str(), strerror(errno));
+		unlink(tempFilename.c_str());
+		return false;
+	}
+
+	gchar* dirPath = g_path_get_dirname(m_filename.c_str());
+	int dirFd = ::open(dirPath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dirFd >= 0) {
+		(void) fsync(dirFd);
+		close(dirFd);
+	}
+	g_free(dirPath);
+
+	close(m_fd);
+	m_fd = ::open(m_filename.c_str(), O_RDWR | O_APPEND | O_CLOEXEC);
+	if (m_fd < 0) {
+		PmLogWarning(sysServiceLogContext(), "PREFS_LOG_ERROR", 0, "Failed to reopen preferences log [%s]: %s",
+					 m_filename.c_str(), strerror(errno));
+		return false;
+	}
+
+	PmLogDebug(sysServiceLogContext(), "compacted [%s] from %lld to %zu bytes", m_filename.c_str(), (long long) m_size, frames.size());
+	m_size = frames.size();
+	return true;
+}
+
+void LogPrefsStorage::appendFrame(std::string& r_frames, const std::string& payload)
+{
+	putUint(r_frames, payload.size(), 4);
+	putUint(r_frames, crc32(payload), 4);
+	r_frames += payload;
+}
+
+std::string LogPrefsStorage::headerPayload()
+{
+	return std::string(s_headerMagic) + s_logVersion;
+}
+
+std::string LogPrefsStorage::putPayload(const Record& record)
+{
+	std::string payload(1, s_putFrame);
+	putField(payload, record.key);
+	putField(payload, record.value);
+	putField(payload, record.type);
+	putField(payload, record.json);
+	putUint(payload, (uint64_t) record.revision, 8);
+	return payload;
+}
+
+bool LogPrefsStorage::parsePut(const std::string& payload, Record& r_record)
+{
+	size_t pos = 1;
+	if (!getField(payload, pos, r_record.key) || !getField(payload, pos, r_record.value) ||
+		!getField(payload, pos, r_record.type) || !getField(payload, pos, r_record.json))
+		return false;
+
+	if (payload.size() - pos != 8)
+		return false;
+	r_record.revision = (sqlite3_int64) getUint(payload, pos, 8);
+	return true;
+}
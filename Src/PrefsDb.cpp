@@ -21,11 +21,19 @@
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+
+#include <algorithm>
+#include <iterator>
 
 #include "Logging.h"
 #include "PrefsDb.h"
+#include "LogPrefsStorage.h"
+#include "SqlitePrefsStorage.h"
 #include "Utils.h"
 #include "SystemRestore.h"
+#include "Settings.h"
 
 using namespace pbnjson;
 
@@ -33,6 +41,7 @@ const char* PrefsDb::s_defaultPrefsFile = WEBOS_INSTALL_WEBOS_SYSCONFDIR "/defau
 const char* PrefsDb::s_defaultPlatformPrefsFile = WEBOS_INSTALL_WEBOS_SYSCONFDIR "/defaultPreferences-platform.txt";
 const char* PrefsDb::s_customizationOverridePrefsFile = WEBOS_INSTALL_SYSMGR_DATADIR "/customization/cust-preferences.txt";
 const char* PrefsDb::s_custCareNumberFile = WEBOS_INSTALL_WEBOS_SYSCONFDIR "/CustomerCareNumber.txt";
+const char* PrefsDb::s_volatileKeysFile = WEBOS_INSTALL_WEBOS_SYSCONFDIR "/sysservice-volatilekeys.json";
 const char* PrefsDb::s_prefsDbPath = WEBOS_INSTALL_SYSMGR_LOCALSTATEDIR "/preferences/systemprefs.db";
 const char* PrefsDb::s_tempBackupDbFilenameOnly = "systemprefs_backup.db";
 const char* PrefsDb::s_prefsPath = WEBOS_INSTALL_SYSMGR_LOCALSTATEDIR "/preferences";
@@ -64,15 +73,145 @@ const char* PrefsDb::s_volumeIconFileAndPathDest = MEDIAPARTITIONPATH ".VolumeIc
 const char* PrefsDb::s_sysDefaultWallpaperKey = ".prefsdb.setting.default.wallpaper";
 const char* PrefsDb::s_sysDefaultRingtoneKey = ".prefsdb.setting.default.ringtone";
 
+// sha1 of every file the defaults resync reads, as of the last successful resync
+static const char* s_defaultsFingerprintKey = ".prefsdb.setting.defaultsFingerprint";
+
+// random id of the current revision sequence, see epoch()
+static const char* s_epochKey = ".prefsdb.setting.epoch";
+
+// outcome of the last full integrity check: {"ok": boolean, "time": seconds since epoch, "message": string}.
+// An internal key: not listed by prefix and not in the backup key list
+static const char* s_integrityCheckKey = ".prefsdb.setting.integrityCheck";
+// the background integrity check starts this long after open, once the service is answering requests
+static const guint s_integrityCheckDelaySec = 30;
+
+// getPrefs() requests with more keys than this are split into several lookups
+static const size_t s_maxKeysPerLookup = 16;
+// bound parameters per copyAttachedKeys() statement (SQLITE_MAX_VARIABLE_NUMBER is 999 on old builds)
+static const size_t s_maxKeysPerCopy = 256;
+
+static bool quotesRequired(const std::string& value)
+{
+	bool isQuotes(true);
+
+	const char* val_str = value.c_str();
+	char* pEnd;
+	double result = strtod(val_str, &pEnd);
+	if (!(abs(result - 0.0) < 0.1)) {
+		isQuotes = false;			// maybe number, will continue check
+		while (*pEnd != '\0') {
+			if (!isspace(*pEnd)) {		// if we have not spaces symbols after number => we have string
+				isQuotes = true;
+				break;
+			}
+			pEnd++;
+		}
+	}
+	else if (val_str != pEnd) {	// check if value == 0.0
+		isQuotes = false;		// number detected
+	}
+
+	if (isQuotes) {
+		switch(value[0]) {
+		case '"':
+			isQuotes = false;
+			break;
+		case 'f':
+			if ("false" == value) {
+				isQuotes = false;
+			}
+			break;
+		case 't':
+			if ("true" == value) {
+				isQuotes = false;
+			}
+			break;
+		case 'n':
+			if ("null" == value) {
+				isQuotes = false;
+			}
+			break;
+		}
+	}
+
+	return isQuotes;
+}
+
+static const char* valueTypeName(const JValue& value)
+{
+	if (value.isObject())
+		return "object";
+	if (value.isArray())
+		return "array";
+	if (value.isString())
+		return "string";
+	if (value.isNumber())
+		return "number";
+	if (value.isBoolean())
+		return "boolean";
+	return "null";
+}
+
+// values are stored as strings that are not always JSON on their own (bare strings and numbers
+// from the defaults files); this resolves them the way getPreferences always has, once, at write time
+static std::string canonicalJson(const std::string& value, const char** r_type = 0)
+{
+	JValue parsed = JDomParser::fromString(value);
+	if (!parsed.isValid()) {
+		// not JSON, try to work with json primitive (ex. string, number)
+		std::string primitive;
+		if (quotesRequired(value))
+			primitive = "[\"" + value + "\"]";
+		else
+			primitive = "[" + value + "]";
+
+		JValue arr = JDomParser::fromString(primitive);
+		parsed = arr.isValid() ? arr[0] : JValue(value);
+	}
+
+	if (r_type)
+		*r_type = valueTypeName(parsed);
+	return parsed.stringify();
+}
+
+// canonicalJson() for a value that may be canonical JSON already, which is then its own result
+static std::string storedJson(const std::string& value, bool canonical, const char** r_type = 0)
+{
+	if (!canonical)
+		return canonicalJson(value, r_type);
+
+	if (r_type) {
+		// the first character of canonical JSON tells its type
+		switch (value.empty() ? 'n' : value[0]) {
+		case '{': *r_type = "object"; break;
+		case '[': *r_type = "array"; break;
+		case '"': *r_type = "string"; break;
+		case 't': case 'f': *r_type = "boolean"; break;
+		case 'n': *r_type = "null"; break;
+		default: *r_type = "number"; break;
+		}
+	}
+	return value;
+}
+
+// removes a database file together with its journal / write-ahead log companions
+static void unlinkDatabaseFiles(const std::string& dbFilename)
+{
+	unlink(dbFilename.c_str());
+	unlink((dbFilename + "-journal").c_str());
+	unlink((dbFilename + "-wal").c_str());
+	unlink((dbFilename + "-shm").c_str());
+}
+
 PrefsDb* PrefsDb::createStandalone(const std::string& dbFilename,bool deleteExisting)
 {
 	if (deleteExisting)
 	{
-		unlink(dbFilename.c_str());
+		unlinkDatabaseFiles(dbFilename);
 	}
 
 	PrefsDb * pDb = new PrefsDb(dbFilename);
-	if (pDb->m_prefsDb)
+	if (pDb->m_storage)
 		return pDb;
 
 	//else, creation failed...delete the faulty pDb and return 0
@@ -82,6 +221,31 @@ PrefsDb* PrefsDb::createStandalone(const std::string& dbFilename,bool deleteExis
 
 PrefsDb::PrefsDb()
 : m_prefsDb(0)
+, m_cacheLoaded(false)
+, m_batchDepth(0)
+, m_batchRolledBack(false)
+, m_batchQueued(false)
+, m_copySource(0)
+, m_writeStatsSince(time(NULL))
+, m_coalesceJournalFd(-1)
+, m_coalesceJournalEntries(0)
+, m_coalesceSource(0)
+, m_coalesceFlushQueued(false)
+, m_walMode(false)
+, m_checkpointSource(0)
+, m_lastWriteTime(0)
+, m_revision(0)
+, m_batchRevision(0)
+, m_integrityThread(0)
+, m_integrityCheckDb(0)
+, m_integrityCheckSource(0)
+, m_integrityCheckDoneSource(0)
+, m_fullCheckAtOpen(false)
+, m_writerThread(0)
+, m_writerDb(0)
+, m_writeQueue(0)
+, m_writeDoneQueue(0)
+, m_finishedJobsSource(0)
 , m_standalone(false)
 , m_dbFilename(s_prefsDbPath)
 , m_deleteOnDestroy(false)
@@ -91,6 +255,31 @@ PrefsDb::PrefsDb()
 
 PrefsDb::PrefsDb(const std::string& standaloneDbFilename)
 : m_prefsDb(0)
+, m_cacheLoaded(false)
+, m_batchDepth(0)
+, m_batchRolledBack(false)
+, m_batchQueued(false)
+, m_copySource(0)
+, m_writeStatsSince(time(NULL))
+, m_coalesceJournalFd(-1)
+, m_coalesceJournalEntries(0)
+, m_coalesceSource(0)
+, m_coalesceFlushQueued(false)
+, m_walMode(false)
+, m_checkpointSource(0)
+, m_lastWriteTime(0)
+, m_revision(0)
+, m_batchRevision(0)
+, m_integrityThread(0)
+, m_integrityCheckDb(0)
+, m_integrityCheckSource(0)
+, m_integrityCheckDoneSource(0)
+, m_fullCheckAtOpen(false)
+, m_writerThread(0)
+, m_writerDb(0)
+, m_writeQueue(0)
+, m_writeDoneQueue(0)
+, m_finishedJobsSource(0)
 , m_standalone(true)
 , m_dbFilename(standaloneDbFilename)
 , m_deleteOnDestroy(false)
@@ -101,328 +290,1340 @@ PrefsDb::PrefsDb(const std::string& standaloneDbFilename)
 PrefsDb::~PrefsDb()
 {
 	closePrefsDb();
+	runFinishedJobs();
 	if (m_deleteOnDestroy)
 	{
 		//on purpose that it doesn't respect deleteOnDestroy for the singleton copy
-		unlink(m_dbFilename.c_str());
+		unlinkDatabaseFiles(m_dbFilename);
 	}
 }
 
+void PrefsDb::setDatabaseFileDeleteOnDestruction(bool deleteAtDestructor)
+{
+	m_deleteOnDestroy = deleteAtDestructor;
+}
+
 bool PrefsDb::setPref(const std::string& key, const std::string& value)
 {
-	if (!m_prefsDb)
+	return setPref(key, value, false);
+}
+
+bool PrefsDb::setPref(const std::string& key, const std::string& value, bool canonical)
+{
+	if (!m_storage)
 		return false;
 
 	if (key.empty())
 		return false;
 
-	char *queryStr = sqlite3_mprintf("INSERT INTO Preferences "
-									  "VALUES (%Q, %Q)",
-									  key.c_str(), value.c_str());
-
-	if (!queryStr)
+	if (inBatch() && m_batchRolledBack)
 		return false;
 
-	int ret = sqlite3_exec(m_prefsDb, queryStr, NULL, NULL, NULL);
+	if (hasValue(key, value)) {
+		if (!m_standalone)
+			++m_writeStats[key].suppressed;
+		return true;
+	}
 
-	if (ret) {
-		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to execute query for key %s", key.c_str());
+	if (m_cacheLoaded && isVolatileKey(key))
+		return volatileWrite(key, value, canonical);
 
-		sqlite3_free(queryStr);
-		return false;
+	if (m_cacheLoaded && isCoalescedKey(key)) {
+		if (!inBatch())
+			return coalesceWrite(key, value, canonical);
+
+		// journaled when the batch commits, dropped with it on rollback
+		m_batchValues[key].value = value;
+		m_batchCoalescedKeys.insert(key);
+		return true;
+	}
+
+	return writePref(key, value, canonical);
+}
+
+// one transaction for the writer thread, handed to it and back
+struct PrefsDb::WriteJob
+{
+	struct Row
+	{
+		std::string key;
+		std::string value;
+		std::string json;
+		const char* type;
+		sqlite3_int64 revision;
+	};
+
+	std::vector<Row> rows;
+	WriteDoneCallback done;
+	gpointer userData;
+	bool ok;
+	bool stop;
+	bool flush;		// rows are coalesced values, acknowledged and announced already
+};
+
+bool PrefsDb::writePref(const std::string& key, const std::string& value, bool canonical)
+{
+	const char* type = 0;
+	StoredPref pref { value, storedJson(value, canonical, &type), m_standalone ? 0 : m_revision + 1 };
+
+	// with the writer thread a batch is written when it commits, and a single write right away,
+	// both by the thread
+	if (inBatch() ? m_batchQueued : (m_writerThread != 0)) {
+		m_revision = pref.revision;
+		if (inBatch())
+			m_batchValues[key] = std::move(pref);
+		else
+			queueWrite(new WriteJob { { WriteJob::Row { key, value, pref.json, type, pref.revision } }, 0, 0, false, false, false });
+
+		PmLogDebug(sysServiceLogContext(),"set queued ( [%s] , [---, length %zu] )", key.c_str(), value.size());
+		return true;
 	}
 
-	sqlite3_free(queryStr);
+	if (!m_storage->put(PrefsStorage::Record { key, value, type, pref.json, pref.revision }))
+		return false;
+
+	m_revision = pref.revision;
+
+	if (inBatch()) {
+		m_batchValues[key] = std::move(pref);
+	}
+	else {
+		countWrite(key, pref.value, pref.json);
+		if (m_cacheLoaded) {
+			m_cache[key] = std::move(pref);
+			m_cacheKeys.insert(key);
+		}
+		notifyChanged(key);
+		scheduleCheckpoint();
+	}
 
 	PmLogDebug(sysServiceLogContext(),"set ( [%s] , [---, length %zu] )", key.c_str(), value.size());
 	return true;
 }
 
-std::string PrefsDb::getPref(const std::string& key)
+bool PrefsDb::beginBatch()
 {
-	sqlite3_stmt* statement = 0;
-	const char* tail = 0;
-	std::string result = "";
-
-	if (!m_prefsDb || key.empty())
-		return result;
+	if (!m_storage)
+		return false;
 
-	char *queryStr = sqlite3_mprintf("SELECT value FROM Preferences WHERE key=%Q",key.c_str());
+	// a nested batch can't join one that was rolled back; the caller returns without a
+	// matching commit or rollback, so the depth is left as it is
+	if (m_batchDepth > 0) {
+		if (m_batchRolledBack)
+			return false;
+		++m_batchDepth;
+		return true;
+	}
+	m_batchDepth = 1;
 
-	if (!queryStr)
-		goto Done;
+	m_batchValues.clear();
+	m_batchCoalescedKeys.clear();
+	m_batchRolledBack = false;
+	m_batchRevision = m_revision;
 
-	if (sqlite3_prepare(m_prefsDb, queryStr, -1, &statement, &tail)) {
-		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to prepare sql statement: %s", queryStr);
-		goto Done;
+	// the writer thread gets the whole batch as one job on commit, there is nothing to open here
+	m_batchQueued = (m_writerThread != 0);
+	if (!m_batchQueued && !m_storage->beginBatch()) {
+		m_batchDepth = 0;
+		return false;
 	}
 
-	if (sqlite3_step(statement) == SQLITE_ROW) {
-		const unsigned char* res = sqlite3_column_text(statement, 0);
-		if (res)
-			result = (const char*) res;
-	}
+	return true;
+}
 
-Done:
+bool PrefsDb::commitBatch()
+{
+	return commitBatch(0, 0);
+}
 
-	if (statement)
-		sqlite3_finalize(statement);
+bool PrefsDb::commitBatch(WriteDoneCallback done, gpointer userData)
+{
+	WriteJob* job = 0;
+	bool ok = closeBatch(job);
+
+	if (job && !job->rows.empty()) {
+		if (m_writeQueue) {
+			job->done = done;
+			job->userData = userData;
+			queueWrite(job);
+			return ok;
+		}
 
-	if (queryStr)
-		sqlite3_free(queryStr);
+		// the writer thread was stopped while the batch was open
+		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Writer thread gone, dropped %zu batched preferences", job->rows.size());
+		ok = false;
+	}
 
-	return result;
+	delete job;
+	if (done)
+		done(ok, userData);
+	return ok;
 }
 
-bool PrefsDb::getPref(const std::string& key,std::string& r_val)
+bool PrefsDb::closeBatch(WriteJob*& r_job)
 {
-	sqlite3_stmt* statement = 0;
-	const char* tail = 0;
-	bool result = false;
+	if (!m_storage || m_batchDepth == 0)
+		return false;
 
-	if (!m_prefsDb || key.empty())
-		return result;
+	if (--m_batchDepth > 0)
+		return !m_batchRolledBack;
 
-	char *queryStr = sqlite3_mprintf("SELECT value FROM Preferences WHERE key=%Q",key.c_str());
+	if (m_batchRolledBack) {
+		m_batchRolledBack = false;
+		return false;
+	}
 
-	if (!queryStr)
-		goto Done;
+	if (!m_batchQueued && !m_storage->commitBatch()) {
+		m_revision = m_batchRevision;
+		m_batchValues.clear();
+		m_batchCoalescedKeys.clear();
+		return false;
+	}
 
-	if (sqlite3_prepare(m_prefsDb, queryStr, -1, &statement, &tail)) {
-		PmLogWarning(sysServiceLogContext(),"SQL_ERROR",0,"Failed to prepare sql statement: %s", queryStr);
-		goto Done;
+	for (const std::string& key: m_batchCoalescedKeys) {
+		(void) coalesceWrite(key, m_batchValues[key].value);
+		m_batchValues.erase(key);
 	}
+	m_batchCoalescedKeys.clear();
+
+	if (m_batchQueued) {
+		// everything but volatile keys goes to the writer thread, which announces it once stored
+		r_job = new WriteJob { {}, 0, 0, false, false, false };
+		for (auto it = m_batchValues.begin(); it != m_batchValues.end(); ) {
+			if (isVolatileKey(it->first)) {
+				++it;
+				continue;
+			}
 
-	if (sqlite3_step(statement) == SQLITE_ROW) {
-		const unsigned char* res = sqlite3_column_text(statement, 0);
-		if (res)
-		{
-			r_val = (const char*) res;
-			result = true;
+			WriteJob::Row row { it->first, it->second.value, it->second.json, 0, it->second.revision };
+			(void) storedJson(row.json, true, &row.type);
+			r_job->rows.push_back(std::move(row));
+			it = m_batchValues.erase(it);
 		}
 	}
 
-	Done:
+	for (const auto& pref: m_batchValues) {
+		if (!isVolatileKey(pref.first))
+			countWrite(pref.first, pref.second.value, pref.second.json);
+	}
 
-	if (statement)
-		sqlite3_finalize(statement);
-	if (queryStr)
-		sqlite3_free(queryStr);
+	if (m_cacheLoaded) {
+		for (auto& pref: m_batchValues) {
+			if (isVolatileKey(pref.first))
+				m_volatileValues[pref.first] = pref.second;
+			m_cache[pref.first] = std::move(pref.second);
+			m_cacheKeys.insert(pref.first);
+		}
+	}
+	for (const auto& pref: m_batchValues)
+		notifyChanged(pref.first);
+	m_batchValues.clear();
 
-	return result;
+	if (!m_batchQueued)
+		scheduleCheckpoint();
+	return true;
 }
 
-std::map<std::string,std::string> PrefsDb::getAllPrefs()
+void PrefsDb::rollbackBatch()
 {
-	sqlite3_stmt* statement = 0;
-	const char* tail = 0;
-	int ret = 0;
-	std::string query;
-	std::map<std::string, std::string> result;
+	if (!m_storage || m_batchDepth == 0)
+		return;
 
-	if (!m_prefsDb)
-		return result;
+	if (!m_batchRolledBack) {
+		if (!m_batchQueued)
+			m_storage->rollbackBatch();
+		m_revision = m_batchRevision;
+		m_batchValues.clear();
+		m_batchCoalescedKeys.clear();
+		m_batchRolledBack = true;
+	}
 
-	query = "SELECT * FROM Preferences;";
+	if (--m_batchDepth == 0)
+		m_batchRolledBack = false;
+}
 
-	ret = sqlite3_prepare(m_prefsDb, query.c_str(), -1, &statement, &tail);
-	if (ret) {
-		PmLogWarning(sysServiceLogContext(),"SQL_ERROR",0,"Failed to prepare sql statement");
-		goto Done;
+void PrefsDb::setPrefsAsync(const std::vector<PrefValue>& prefs,
+							WriteDoneCallback done, gpointer userData,
+							std::set<std::string>* r_unchangedKeys)
+{
+	bool ok = (m_storage != nullptr);
+	for (const PrefValue& pref: prefs) {
+		ok = ok && !pref.key.empty();
+		if (ok && r_unchangedKeys && hasValue(pref.key, pref.json))
+			r_unchangedKeys->insert(pref.key);
 	}
 
-	while ((ret = sqlite3_step(statement)) == SQLITE_ROW) {
-		const char* key = (const char*) sqlite3_column_text(statement, 0);
-		const char* val = (const char*) sqlite3_column_text(statement, 1);
-		if (!key || !val)
-			continue;
-
-		result[key] = val;
+	if (!ok || !beginBatch()) {
+		if (done)
+			done(false, userData);
+		return;
 	}
 
-	Done:
+	for (const PrefValue& pref: prefs)
+		ok = ok && setPref(pref.key, pref.json, true);
 
-	if (statement)
-		sqlite3_finalize(statement);
+	if (!ok) {
+		rollbackBatch();
+		if (done)
+			done(false, userData);
+		return;
+	}
 
-	return result;
+	// done runs from here without the writer thread, or nested into another batch
+	(void) commitBatch(done, userData);
 }
 
-int PrefsDb::merge(PrefsDb * p_sourceDb,bool overwriteSameKeys)
+void PrefsDb::queueWrite(WriteJob* job)
 {
-	if (!p_sourceDb || (p_sourceDb == this))
-		return 0;
-	return merge(p_sourceDb->m_dbFilename,overwriteSameKeys);
-}
+	// the cache has the values from now on, and listeners hear about them now, so that nothing
+	// (the reply cache) serves the old value next to the new one. The committed values are
+	// kept aside until the thread has stored the new ones, so that a failed write can go back
+	if (!job->flush) {
+		for (const WriteJob::Row& row: job->rows) {
+			auto inserted = m_pendingWrites.emplace(row.key, PendingWrite { false, StoredPref(), 0 });
+			PendingWrite& pending = inserted.first->second;
+			if (inserted.second) {
+				std::unordered_map<std::string, StoredPref>::const_iterator cached = m_cache.find(row.key);
+				if (cached != m_cache.end()) {
+					pending.committed = true;
+					pending.value = cached->second;
+				}
+			}
+			++pending.jobs;
 
-int PrefsDb::merge(const std::string& sourceDbFilename,bool overwriteSameKeys)
-{
-	if (overwriteSameKeys)
-	{
-		//can use the ATTACH method
-		std::string attachCmd = std::string("ATTACH '")+sourceDbFilename+std::string("' AS backupDb;");
-		bool sqlOk = runSqlCommand(attachCmd.c_str());
-		if (!sqlOk)
-		{
-			PmLogWarning(sysServiceLogContext(),"SQL_ERROR",0,"Failed to run ATTACH cmd to attach [%s] to this db",sourceDbFilename.c_str());
-			return 0;
-		}
-		std::string mergeCmd = std::string("INSERT INTO main.Preferences SELECT * FROM backupDb.Preferences;");
-		sqlOk = runSqlCommand(mergeCmd.c_str());
-		if (!sqlOk)
-		{
-			PmLogWarning(sysServiceLogContext(),"SQL_ERROR",0,"Failed to run INSERT command to merge [%s] into this db",sourceDbFilename.c_str());
-		}
-		else
-		{
-			PmLogDebug(sysServiceLogContext(),"successfully merged [%s] into this db", sourceDbFilename.c_str());
+			if (m_cacheLoaded) {
+				m_cache[row.key] = StoredPref { row.value, row.json, row.revision };
+				m_cacheKeys.insert(row.key);
+			}
+			notifyChanged(row.key);
 		}
-
-		closePrefsDb();
-		openPrefsDb();
-	}
-	else
-	{
-		PmLogWarning(sysServiceLogContext(),"MERGE_ERROR",0,"Non-destructive merge not yet implemented! Nothing merged");
-		return 0;
 	}
 
-	return 1;
-
+	g_async_queue_push(m_writeQueue, job);
 }
 
-int PrefsDb::copyKeys(PrefsDb * p_sourceDb,const std::list<std::string>& keys,bool overwriteSameKeys)
+bool PrefsDb::hasValue(const std::string& key, const std::string& value) const
 {
-	if (!p_sourceDb || (p_sourceDb == this))
-		return 0;
-	if (keys.empty())
-		return 0;
-	if (p_sourceDb->m_prefsDb == 0)
-		return 0;
+	if (!m_cacheLoaded)
+		return false;
 
-	PmLogDebug(sysServiceLogContext(),"source DB file: [%s] , target DB file: [%s] , overwriteSameKeys = %s",
-		p_sourceDb->m_dbFilename.c_str(), m_dbFilename.c_str(),(overwriteSameKeys ? "YES" : "NO"));
-	int n=0;
-	for (std::list<std::string>::const_iterator it = keys.begin(); it != keys.end();++it)
-	{
-		std::string val;
-		if (p_sourceDb->getPref(*it,val))
-		{
-			std::string myVal;
-			if (!getPref(*it,myVal) || overwriteSameKeys)
-			{
-				PMLOG_TRACE("copying key,value = ( [%s] , [%s] ) , overwriting [%s] ",
-					(*it).c_str(),val.c_str(),myVal.c_str());
-				setPref(*it,val);
-				++n;
-			}
-		}
+	if (inBatch()) {
+		std::unordered_map<std::string, StoredPref>::const_iterator it = m_batchValues.find(key);
+		if (it != m_batchValues.end())
+			return it->second.value == value;
 	}
-	return n;
+
+	std::unordered_map<std::string, StoredPref>::const_iterator it = m_cache.find(key);
+	if (it == m_cache.end() || it->second.value != value)
+		return false;
+
+	// values queued for the writer thread may yet fail; the newest has to match what is
+	// stored as well
+	std::unordered_map<std::string, PendingWrite>::const_iterator pending = m_pendingWrites.find(key);
+	return pending == m_pendingWrites.end() || (pending->second.committed && pending->second.value.value == value);
 }
 
-sqlite3_stmt* PrefsDb::runSqlQuery(const std::string& queryStr)
+void PrefsDb::countWrite(const std::string& key, const std::string& value, const std::string& json)
 {
-	sqlite3_stmt* statement = 0;
-	int ret = 0;
-	const char* tail = 0;
+	// backup images and other standalone dbs aren't the flash this is about
+	if (m_standalone)
+		return;
 
-	if (!m_prefsDb)
-		return 0;
+	WriteStats& stats = m_writeStats[key];
+	++stats.writes;
+	stats.bytes += key.size() + value.size() + json.size();
+}
 
-	if (queryStr.empty())
-		return 0;
+bool PrefsDb::volatileWrite(const std::string& key, const std::string& value, bool canonical)
+{
+	// a revision like any other write, for getKeysChangedSince() and sinceRevision subscribers
+	StoredPref pref { value, storedJson(value, canonical), m_revision + 1 };
+	m_revision = pref.revision;
 
-	ret = sqlite3_prepare(m_prefsDb, queryStr.c_str(), -1, &statement, &tail);
-	if (ret != SQLITE_OK) {
-		PmLogWarning(sysServiceLogContext(),"SQL_ERROR",0,"Failed to prepare sql statement");
-		if (statement)
-		{
-			sqlite3_finalize(statement);
-		}
-		return 0;
+	if (inBatch()) {
+		m_batchValues[key] = std::move(pref);
+		return true;
 	}
 
-	return statement;
+	m_volatileValues[key] = pref;
+	m_cache[key] = std::move(pref);
+	m_cacheKeys.insert(key);
+	notifyChanged(key);
+
+	PmLogDebug(sysServiceLogContext(),"set volatile ( [%s] , [---, length %zu] )", key.c_str(), value.size());
+	return true;
 }
 
-bool PrefsDb::runSqlCommand(const std::string& cmdStr)
+void PrefsDb::loadVolatileKeys()
 {
-	bool rc = false;
-	int ret = 0;
-	char * pErrMsg = 0;
+	m_volatileKeys.clear();
 
-	char * queryStr = sqlite3_mprintf("%s",cmdStr.c_str());
-	if (!queryStr)
-		return false;
+	if (!g_file_test(s_volatileKeysFile, G_FILE_TEST_EXISTS))
+		return;
 
-	ret = sqlite3_exec(m_prefsDb, queryStr, NULL, NULL, &pErrMsg);
-	if (ret) {
-		PmLogWarning(sysServiceLogContext(),"SQL_ERROR",0,"Failed to execute cmd [%s] - extended error: [%s]",queryStr, pErrMsg ? pErrMsg : "<none>");
-		rc = false;
+	JValue keys = JDomParser::fromFile(s_volatileKeysFile);
+	if (!keys.isArray()) {
+		PmLogWarning(sysServiceLogContext(), "STRING_KEY_NOT_EXIST", 0, "[%s] does not contain an array of string keys", s_volatileKeysFile);
+		return;
 	}
-	else
-		rc = true;
 
-	if (queryStr)
-		sqlite3_free(queryStr);
-	if (pErrMsg)
-		sqlite3_free(pErrMsg);
-	return rc;
+	for (const JValue key: keys.items()) {
+		if (key.isString())
+			m_volatileKeys.insert(key.asString());
+		else
+			PmLogWarning(sysServiceLogContext(), "INVALID_KEY", 0, "Invalid key in [%s] (skipping)", s_volatileKeysFile);
+	}
 }
 
-//TODO: STILL UNSAFE IF THE KEY HAS SINGLE QUOTES IN IT! (SEE getPref() FOR EXAMPLE OF HOW TO FIX)
-std::map<std::string, std::string> PrefsDb::getPrefs(const std::list<std::string>& keys)
+bool PrefsDb::coalesceWrite(const std::string& key, const std::string& value, bool canonical)
 {
-	sqlite3_stmt* statement = 0;
-	const char* tail = 0;
-	int ret = 0;
-	std::string query;
-	std::map<std::string, std::string> result;
-	std::list<std::string>::const_iterator it;
+	// nothing is acknowledged without a journal record; if that fails write through, and an
+	// older coalesced value must not be flushed over it later
+	if (!appendToCoalesceJournal(key, value)) {
+		m_coalescedValues.erase(key);
+		return writePref(key, value, canonical);
+	}
 
-	if (!m_prefsDb)
-		return result;
+	// the revision moves now, for sinceRevision readers, and the flush stores the value with it
+	StoredPref& cached = m_cache[key];
+	cached.value = value;
+	cached.json = storedJson(value, canonical);
+	cached.revision = ++m_revision;
+	m_cacheKeys.insert(key);
+	m_coalescedValues[key] = value;
+	notifyChanged(key);
+
+	if (m_coalesceJournalEntries >= Settings::instance()->m_prefsDbCoalesceJournalMax) {
+		(void) flushCoalescedWrites();
+	}
+	else if (!m_coalesceSource) {
+		m_coalesceSource = g_timeout_add(Settings::instance()->m_prefsDbCoalesceWindowMs, cbCoalesceTimeout, this);
+	}
 
-	if (keys.empty())
-		goto Done;
+	PmLogDebug(sysServiceLogContext(),"coalesced ( [%s] , [---, length %zu] )", key.c_str(), value.size());
+	return true;
+}
 
-	query = "SELECT * FROM Preferences WHERE key='";
-	query += keys.front() + "'";
+bool PrefsDb::flushCoalescedWrites()
+{
+	if (m_coalesceSource) {
+		g_source_remove(m_coalesceSource);
+		m_coalesceSource = 0;
+	}
 
-	it = keys.begin();
-	++it;
+	if (m_coalescedValues.empty())
+		return true;
 
-	for (; it != keys.end(); ++it)
-		query += " OR key='" + (*it) + "'";
-	query += ";";
+	// can't commit on behalf of somebody else's batch; the journal keeps the values safe
+	if (inBatch())
+		return false;
 
-	ret = sqlite3_prepare(m_prefsDb, query.c_str(), -1, &statement, &tail);
-	if (ret) {
-		PmLogWarning(sysServiceLogContext(),"SQL_ERROR",0,"Failed to prepare sql statement");
-		goto Done;
+	if (m_writerThread) {
+		// the journal is kept until the writer thread has stored the values, values coalesced
+		// meanwhile wait for the next flush
+		if (m_coalesceFlushQueued)
+			return true;
+
+		WriteJob* job = new WriteJob { {}, 0, 0, false, false, true };
+		for (const auto& pref: m_coalescedValues) {
+			WriteJob::Row row { pref.first, pref.second, std::string(), 0, m_cache[pref.first].revision };
+			row.json = storedJson(row.value, false, &row.type);
+			job->rows.push_back(std::move(row));
+		}
+		m_coalescedValues.clear();
+		m_coalesceFlushQueued = true;
+		queueWrite(job);
+		return true;
 	}
 
-	while ((ret = sqlite3_step(statement)) == SQLITE_ROW) {
-		const char* key = (const char*) sqlite3_column_text(statement, 0);
-		const char* val = (const char*) sqlite3_column_text(statement, 1);
-		if (!key || !val)
-			continue;
+	if (!beginBatch())
+		return false;
 
-		result[key] = val;
+	for (const auto& pref: m_coalescedValues) {
+		if (!writePref(pref.first, pref.second)) {
+			rollbackBatch();
+			return false;
+		}
 	}
 
-Done:
+	if (!commitBatch())
+		return false;
 
-	if (statement)
-		sqlite3_finalize(statement);
+	PmLogDebug(sysServiceLogContext(),"flushed %zu coalesced preferences", m_coalescedValues.size());
+	m_coalescedValues.clear();
+	discardCoalesceJournal();
+	return true;
+}
+
+void PrefsDb::completeCoalesceFlush(const WriteJob* job)
+{
+	m_coalesceFlushQueued = false;
+
+	if (!job->ok) {
+		// back into the next flush, unless they were coalesced again meanwhile
+		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to flush coalesced preferences, retrying later");
+		for (const WriteJob::Row& row: job->rows)
+			m_coalescedValues.emplace(row.key, row.value);
+	}
+	else {
+		for (const WriteJob::Row& row: job->rows)
+			countWrite(row.key, row.value, row.json);
+		PmLogDebug(sysServiceLogContext(),"flushed %zu coalesced preferences", job->rows.size());
+		scheduleCheckpoint();
+
+		if (m_coalescedValues.empty())
+			discardCoalesceJournal();
+		else
+			rewriteCoalesceJournal();
+	}
+
+	if (!m_coalescedValues.empty() && !m_coalesceSource)
+		m_coalesceSource = g_timeout_add(Settings::instance()->m_prefsDbCoalesceWindowMs, cbCoalesceTimeout, this);
+}
+
+gboolean PrefsDb::cbCoalesceTimeout(gpointer data)
+{
+	PrefsDb* self = static_cast<PrefsDb*>(data);
+	self->m_coalesceSource = 0;
+
+	if (!self->flushCoalescedWrites()) {
+		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to flush coalesced preferences, retrying later");
+		self->m_coalesceSource = g_timeout_add(Settings::instance()->m_prefsDbCoalesceWindowMs, cbCoalesceTimeout, self);
+	}
+
+	return G_SOURCE_REMOVE;
+}
+
+// journal records are "key\0value\0"; neither keys nor json values contain NUL bytes
+bool PrefsDb::appendToCoalesceJournal(const std::string& key, const std::string& value)
+{
+	if (m_coalesceJournalFd < 0) {
+		m_coalesceJournalFd = open(m_coalesceJournalFile.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+		if (m_coalesceJournalFd < 0) {
+			PmLogWarning(sysServiceLogContext(), "JOURNAL_ERROR", 0, "Failed to open coalesce journal [%s]", m_coalesceJournalFile.c_str());
+			return false;
+		}
+	}
+
+	std::string record;
+	record.reserve(key.size() + value.size() + 2);
+	record.append(key).push_back('\0');
+	record.append(value).push_back('\0');
+
+	// a single append: a crash can only ever leave a truncated last record behind. The value is
+	// acknowledged once this returns, so it is on disk by then, unless synchronous=OFF asked for
+	// nothing to be synced
+	bool sync = strcasecmp(Settings::instance()->m_prefsDbSynchronous.c_str(), "OFF") != 0;
+	if (write(m_coalesceJournalFd, record.data(), record.size()) != (ssize_t) record.size() ||
+		(sync && fdatasync(m_coalesceJournalFd) != 0)) {
+		PmLogWarning(sysServiceLogContext(), "JOURNAL_ERROR", 0, "Failed to append to coalesce journal [%s]", m_coalesceJournalFile.c_str());
+		return false;
+	}
+
+	++m_coalesceJournalEntries;
+	return true;
+}
+
+void PrefsDb::rewriteCoalesceJournal()
+{
+	std::string records;
+	for (const auto& pref: m_coalescedValues) {
+		records.append(pref.first).push_back('\0');
+		records.append(pref.second).push_back('\0');
+	}
+
+	if (m_coalesceJournalFd >= 0) {
+		close(m_coalesceJournalFd);
+		m_coalesceJournalFd = -1;
+	}
+
+	// replaced in one rename; if that fails the old journal still has every value, and more
+	if (!g_file_set_contents(m_coalesceJournalFile.c_str(), records.data(), records.size(), NULL)) {
+		PmLogWarning(sysServiceLogContext(), "JOURNAL_ERROR", 0, "Failed to rewrite coalesce journal [%s]", m_coalesceJournalFile.c_str());
+		return;
+	}
+	m_coalesceJournalEntries = m_coalescedValues.size();
+}
+
+void PrefsDb::discardCoalesceJournal()
+{
+	if (m_coalesceJournalFd >= 0) {
+		close(m_coalesceJournalFd);
+		m_coalesceJournalFd = -1;
+	}
+
+	unlink(m_coalesceJournalFile.c_str());
+	m_coalesceJournalEntries = 0;
+}
+
+void PrefsDb::replayCoalesceJournal()
+{
+	gchar* contents = 0;
+	gsize length = 0;
+
+	if (!g_file_get_contents(m_coalesceJournalFile.c_str(), &contents, &length, NULL))
+		return;
+
+	int replayed = 0;
+	bool ok = beginBatch();
+	const gchar* end = contents + length;
+	const gchar* pos = contents;
+
+	while (ok && pos < end) {
+		const gchar* keyEnd = static_cast<const gchar*>(memchr(pos, '\0', end - pos));
+		if (!keyEnd)
+			break;
+		const gchar* valueEnd = static_cast<const gchar*>(memchr(keyEnd + 1, '\0', end - keyEnd - 1));
+		if (!valueEnd)
+			break;		// torn last record, it was never acknowledged
+
+		ok = writePref(std::string(pos, keyEnd), std::string(keyEnd + 1, valueEnd));
+		pos = valueEnd + 1;
+		++replayed;
+	}
+	g_free(contents);
+
+	if (!ok) {
+		rollbackBatch();
+		PmLogWarning(sysServiceLogContext(), "JOURNAL_ERROR", 0, "Failed to replay coalesce journal [%s]", m_coalesceJournalFile.c_str());
+		return;
+	}
+
+	if (commitBatch()) {
+		PmLogInfo(sysServiceLogContext(), "JOURNAL_REPLAYED", 1, PMLOGKFV("ENTRIES", "%d", replayed), "replayed coalesced preference writes");
+		discardCoalesceJournal();
+	}
+}
+
+std::string PrefsDb::getPref(const std::string& key)
+{
+	std::string result;
+	(void) getPref(key, result);
+	return result;
+}
+
+bool PrefsDb::getPref(const std::string& key,std::string& r_val)
+{
+	bool result = false;
+
+	if (!m_storage || key.empty())
+		return result;
+
+	if (inBatch()) {
+		std::unordered_map<std::string, StoredPref>::const_iterator it = m_batchValues.find(key);
+		if (it != m_batchValues.end()) {
+			r_val = it->second.value;
+			return true;
+		}
+	}
+
+	if (m_cacheLoaded) {
+		std::unordered_map<std::string, StoredPref>::const_iterator it = m_cache.find(key);
+		if (it == m_cache.end())
+			return result;
+		r_val = it->second.value;
+		return true;
+	}
+
+	PrefsStorage::Record record;
+	if (m_storage->get(key, record)) {
+		r_val = record.value;
+		result = true;
+	}
+
+	return result;
+}
+
+std::map<std::string,std::string> PrefsDb::getAllPrefs()
+{
+	if (!m_cacheLoaded)
+		return readAllPrefsFromDb();
+
+	std::map<std::string,std::string> result;
+	for (const auto& pref: m_cache)
+		result[pref.first] = pref.second.value;
+	return result;
+}
+
+// smallest string greater than every string starting with prefix; empty if there is none
+static std::string prefixUpperBound(std::string prefix)
+{
+	while (!prefix.empty() && (unsigned char) prefix.back() == 0xff)
+		prefix.pop_back();
+	if (!prefix.empty())
+		prefix.back() = (char) ((unsigned char) prefix.back() + 1);
+	return prefix;
+}
+
+std::list<std::string> PrefsDb::getKeysByPrefix(const std::string& prefix, const std::string& startAfter,
+												size_t limit, bool* r_more)
+{
+	std::list<std::string> result;
+	bool more = false;
+
+	if (r_more)
+		*r_more = false;
+
+	if (!m_storage)
+		return result;
+
+	std::string upper = prefixUpperBound(prefix);
+
+	if (m_cacheLoaded) {
+		std::set<std::string>::const_iterator it = (startAfter < prefix) ? m_cacheKeys.lower_bound(prefix)
+																		 : m_cacheKeys.upper_bound(startAfter);
+		for (; it != m_cacheKeys.end() && (upper.empty() || *it < upper); ++it) {
+			if (isInternalKey(*it))
+				continue;
+			if (limit && result.size() == limit) {
+				more = true;
+				break;
+			}
+			result.push_back(*it);
+		}
+	}
+	else {
+		// a range over the key's unique index; one row past the limit tells whether there is more
+		std::string query = "SELECT key FROM Preferences WHERE key >= ? AND key > ? AND substr(key, 1, 1) <> '.'";
+		if (!upper.empty())
+			query += " AND key < ?";
+		query += " ORDER BY key";
+		if (limit)
+			query += " LIMIT " + std::to_string(limit + 1);
+
+		sqlite3_stmt* statement = runSqlQuery(query);
+		if (!statement)
+			return result;
+
+		sqlite3_bind_text(statement, 1, prefix.c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_text(statement, 2, startAfter.c_str(), -1, SQLITE_STATIC);
+		if (!upper.empty())
+			sqlite3_bind_text(statement, 3, upper.c_str(), -1, SQLITE_STATIC);
+
+		while (sqlite3_step(statement) == SQLITE_ROW) {
+			const char* key = (const char*) sqlite3_column_text(statement, 0);
+			if (!key)
+				continue;
+			if (limit && result.size() == limit) {
+				more = true;
+				break;
+			}
+			result.push_back(key);
+		}
+		sqlite3_finalize(statement);
+	}
+
+	if (r_more)
+		*r_more = more;
+	return result;
+}
+
+std::map<std::string,std::string> PrefsDb::readAllPrefsFromDb()
+{
+	std::map<std::string, std::string> result;
+
+	if (!m_storage)
+		return result;
+
+	(void) m_storage->iterate([&result](const PrefsStorage::Record& record) {
+		result[record.key] = record.value;
+	});
+
+	return result;
+}
+
+int PrefsDb::merge(PrefsDb * p_sourceDb,bool overwriteSameKeys,std::list<std::string>* r_changedKeys)
+{
+	if (!p_sourceDb || (p_sourceDb == this))
+		return 0;
+	if (!m_prefsDb || !p_sourceDb->m_prefsDb)
+	{
+		return mergeValues(p_sourceDb->getAllPrefs(),overwriteSameKeys,r_changedKeys);
+	}
+	// the merge attaches the source by file name, so it must not have anything left in its log
+	(void) p_sourceDb->checkpoint();
+	return merge(p_sourceDb->m_dbFilename,overwriteSameKeys,r_changedKeys);
+}
+
+int PrefsDb::merge(const std::string& sourceDbFilename,bool overwriteSameKeys,std::list<std::string>* r_changedKeys)
+{
+	// pending values are older than whatever gets restored now, and the restore writes on
+	// this connection; the writer thread is back when the db is reopened
+	stopWriter();
+	(void) flushCoalescedWrites();
+
+	if (!m_prefsDb && m_storage)
+	{
+		// nothing to ATTACH to; read the file and write what differs
+		sqlite3* sourceDb = 0;
+		std::map<std::string,std::string> values;
+		bool opened = (sqlite3_open_v2(sourceDbFilename.c_str(), &sourceDb, SQLITE_OPEN_READONLY, NULL) == SQLITE_OK);
+		if (opened)
+		{
+			SqlitePrefsStorage source(sourceDb, true);
+			(void) source.iterate([&values](const PrefsStorage::Record& record) {
+				values[record.key] = record.value;
+			});
+		}
+		else
+		{
+			PmLogWarning(sysServiceLogContext(),"SQL_ERROR",0,"Failed to open [%s] to merge it into this db",sourceDbFilename.c_str());
+		}
+		sqlite3_close(sourceDb);
+
+		if (!opened)
+			return 0;
+		return mergeValues(values,overwriteSameKeys,r_changedKeys);
+	}
+
+	if (overwriteSameKeys)
+	{
+		//can use the ATTACH method
+		char* attachCmd = sqlite3_mprintf("ATTACH %Q AS backupDb;", sourceDbFilename.c_str());
+		bool sqlOk = attachCmd && runSqlCommand(attachCmd);
+		sqlite3_free(attachCmd);
+		if (!sqlOk)
+		{
+			PmLogWarning(sysServiceLogContext(),"SQL_ERROR",0,"Failed to run ATTACH cmd to attach [%s] to this db",sourceDbFilename.c_str());
+			startWriter();
+			return 0;
+		}
+		// the backup may come from a release without the typed columns, only key and value are
+		// taken from it. Rows whose value is unchanged are left alone to keep their revision, and
+		// volatile keys never reach the disk (nor count as changed), whatever the backup has
+		std::string changedRows = "FROM backupDb.Preferences b "
+								  "WHERE NOT EXISTS (SELECT 1 FROM main.Preferences m WHERE m.key = b.key AND m.value IS b.value)";
+		for (const std::string& key: m_volatileKeys)
+		{
+			char* condition = sqlite3_mprintf(" AND b.key <> %Q", key.c_str());
+			changedRows += condition;
+			sqlite3_free(condition);
+		}
+		if (r_changedKeys)
+		{
+			std::string changedKeysQuery = std::string("SELECT key ") + changedRows + ";";
+			sqlite3_stmt* statement = 0;
+			if (sqlite3_prepare_v2(m_prefsDb, changedKeysQuery.c_str(), -1, &statement, 0) == SQLITE_OK)
+			{
+				while (sqlite3_step(statement) == SQLITE_ROW)
+				{
+					const char* key = (const char*) sqlite3_column_text(statement, 0);
+					if (key)
+						r_changedKeys->push_back(key);
+				}
+			}
+			else
+			{
+				PmLogWarning(sysServiceLogContext(),"SQL_ERROR",0,"Failed to list the keys [%s] changes: %s",sourceDbFilename.c_str(),sqlite3_errmsg(m_prefsDb));
+			}
+			sqlite3_finalize(statement);
+		}
+		std::string mergeCmd = std::string("INSERT INTO main.Preferences (key, value) SELECT key, value ") + changedRows + ";";
+		sqlOk = runSqlCommand(mergeCmd.c_str());
+		if (!sqlOk)
+		{
+			PmLogWarning(sysServiceLogContext(),"SQL_ERROR",0,"Failed to run INSERT command to merge [%s] into this db",sourceDbFilename.c_str());
+		}
+		else
+		{
+			PmLogDebug(sysServiceLogContext(),"successfully merged [%s] into this db", sourceDbFilename.c_str());
+		}
+
+		// number the merged rows while the current revision is known, reopening
+		// only sees what is left in the table
+		if (!m_standalone)
+			(void) fillValueColumns();
+
+		closePrefsDb();
+		openPrefsDb();
+
+		// the restored rows were renumbered; whatever a client saw before may be gone
+		if (!m_standalone)
+			renewEpoch();
+	}
+	else
+	{
+		PmLogWarning(sysServiceLogContext(),"MERGE_ERROR",0,"Non-destructive merge not yet implemented! Nothing merged");
+		startWriter();
+		return 0;
+	}
+
+	return 1;
+
+}
+
+int PrefsDb::mergeValues(const std::map<std::string, std::string>& values, bool overwriteSameKeys,
+						 std::list<std::string>* r_changedKeys)
+{
+	// same outcome as the ATTACH merge: only keys whose value differs are written (and get
+	// a new revision), and those are the ones reported as changed
+	std::list<std::string> changed;
+	std::string current;
+	for (const auto& value: values)
+	{
+		if (isVolatileKey(value.first))
+			continue;
+
+		bool present = getPref(value.first, current);
+		if (!present || (overwriteSameKeys && current != value.second))
+			changed.push_back(value.first);
+	}
+
+	if (changed.empty())
+		return 1;
+
+	bool ok = beginBatch();
+	for (std::list<std::string>::const_iterator it = changed.begin(); ok && it != changed.end(); ++it)
+		ok = writePref(*it, values.at(*it));
+
+	if (!ok || !commitBatch())
+	{
+		if (ok)
+			PmLogWarning(sysServiceLogContext(),"SQL_ERROR",0,"Failed to commit %zu merged preferences",changed.size());
+		else
+			rollbackBatch();
+		return 0;
+	}
+
+	if (r_changedKeys)
+		r_changedKeys->splice(r_changedKeys->end(), changed);
+	return 1;
+}
+
+int PrefsDb::copyKeys(PrefsDb * p_sourceDb,const std::list<std::string>& keys,bool overwriteSameKeys)
+{
+	if (!p_sourceDb || (p_sourceDb == this) || m_copySource)
+		return 0;
+	if (!m_storage || !p_sourceDb->m_storage)
+		return 0;
+
+	if (!m_prefsDb || !p_sourceDb->m_prefsDb)
+	{
+		std::list<std::string> copied;
+		if (!mergeValues(p_sourceDb->getPrefs(keys), overwriteSameKeys, &copied))
+			return 0;
+		return copied.size();
+	}
+
+	// one transaction for all of them
+	if (!attachSource(p_sourceDb, keys))
+		return 0;
+
+	int n = copyAttachedKeys(keys.begin(), keys.end(), overwriteSameKeys);
+	if (!detachSource(n >= 0))
+		return 0;
+
+	return std::max(n,0);
+}
+
+bool PrefsDb::beginCopyKeys(PrefsDb * p_sourceDb,const std::list<std::string>& keys)
+{
+	if (!p_sourceDb || (p_sourceDb == this) || m_copySource)
+		return false;
+	if (!m_storage || !p_sourceDb->m_storage)
+		return false;
+
+	// the values are taken now, from the source's cache when it has one. A read transaction
+	// on the source held until endCopyKeys() would keep its WAL from being checkpointed for
+	// as long as the copy takes
+	m_copyValues = p_sourceDb->getPrefs(keys);
+	m_copySource = p_sourceDb;
+	return true;
+}
+
+int PrefsDb::copyKeysStep(std::list<std::string>& keys,size_t maxKeys,bool overwriteSameKeys)
+{
+	if (!m_copySource)
+		return -1;
+
+	size_t count = maxKeys ? std::min(keys.size(), maxKeys) : keys.size();
+	if (count == 0)
+		return 0;
+
+	std::list<std::string>::iterator last = keys.begin();
+	std::advance(last, count);
+
+	std::map<std::string,std::string> values;
+	for (std::list<std::string>::const_iterator it = keys.begin(); it != last; ++it)
+	{
+		std::map<std::string,std::string>::const_iterator found = m_copyValues.find(*it);
+		if (found != m_copyValues.end())
+			values.insert(*found);
+	}
+
+	std::list<std::string> copied;
+	if (!mergeValues(values, overwriteSameKeys, &copied))
+		return -1;
+
+	keys.erase(keys.begin(), last);
+	return copied.size();
+}
+
+bool PrefsDb::endCopyKeys()
+{
+	if (!m_copySource)
+		return false;
+
+	m_copySource = 0;
+	m_copyValues.clear();
+	return true;
+}
+
+bool PrefsDb::attachSource(PrefsDb * p_sourceDb,const std::list<std::string>& keys)
+{
+	PmLogDebug(sysServiceLogContext(),"source DB file: [%s] , target DB file: [%s] , %zu keys",
+		p_sourceDb->m_dbFilename.c_str(), m_dbFilename.c_str(), keys.size());
+
+	// the source is read through its file; values it only holds in memory (coalesced, or still
+	// queued for its writer thread) replace what is read there
+	m_copyValues.clear();
+	for (const std::string& key: keys)
+	{
+		std::map<std::string,std::string>::const_iterator it = p_sourceDb->m_coalescedValues.find(key);
+		if (it != p_sourceDb->m_coalescedValues.end())
+		{
+			m_copyValues.insert(*it);
+			continue;
+		}
+
+		if (p_sourceDb->m_pendingWrites.count(key))
+		{
+			std::unordered_map<std::string, StoredPref>::const_iterator cached = p_sourceDb->m_cache.find(key);
+			if (cached != p_sourceDb->m_cache.end())
+				m_copyValues.emplace(key, cached->second.value);
+		}
+	}
+
+	// quoted: a file name may have a quote in it
+	char* attachCmd = sqlite3_mprintf("ATTACH %Q AS sourceDb;", p_sourceDb->m_dbFilename.c_str());
+	bool attached = attachCmd && runSqlCommand(attachCmd);
+	sqlite3_free(attachCmd);
+	if (!attached)
+	{
+		PmLogWarning(sysServiceLogContext(),"SQL_ERROR",0,"Failed to run ATTACH cmd to attach [%s] to this db",p_sourceDb->m_dbFilename.c_str());
+		m_copyValues.clear();
+		return false;
+	}
+
+	// deferred: only this db is written, sourceDb is only read and is never locked for writing
+	if (!runSqlCommand("BEGIN TRANSACTION"))
+	{
+		(void) runSqlCommand("DETACH sourceDb;");
+		m_copyValues.clear();
+		return false;
+	}
+
+	m_copySource = p_sourceDb;
+	return true;
+}
+
+bool PrefsDb::detachSource(bool commit)
+{
+	bool ok = commit && runSqlCommand("COMMIT TRANSACTION");
+	if (!ok)
+		(void) runSqlCommand("ROLLBACK TRANSACTION");
+	(void) runSqlCommand("DETACH sourceDb;");
+
+	m_copySource = 0;
+	m_copyValues.clear();
+
+	if (ok)
+	{
+		if (!m_standalone)
+			(void) fillValueColumns();
+		if (m_cacheLoaded)
+			(void) loadCache();
+	}
+
+	return ok;
+}
+
+int PrefsDb::copyAttachedKeys(std::list<std::string>::const_iterator first,std::list<std::string>::const_iterator last,
+							  bool overwriteSameKeys)
+{
+	int n = 0;
+
+	// OR IGNORE overrides the table's ON CONFLICT REPLACE, keeping the keys already here
+	const char* insert = overwriteSameKeys ? "INSERT" : "INSERT OR IGNORE";
+
+	// one statement per s_maxKeysPerCopy keys
+	std::list<std::string>::const_iterator it = first;
+	while (it != last && n >= 0)
+	{
+		size_t chunk = std::min<size_t>(std::distance(it, last), s_maxKeysPerCopy);
+
+		std::string copyCmd = std::string(insert)
+							+ " INTO main.Preferences (key, value) SELECT key, value FROM sourceDb.Preferences WHERE key IN (?";
+		for (size_t i = 1; i < chunk; ++i)
+			copyCmd += ", ?";
+		copyCmd += ")";
+
+		sqlite3_stmt* statement = 0;
+		if (sqlite3_prepare_v2(m_prefsDb, copyCmd.c_str(), -1, &statement, 0) == SQLITE_OK)
+		{
+			for (size_t i = 0; i < chunk; ++i, ++it)
+				sqlite3_bind_text(statement, i + 1, it->c_str(), -1, SQLITE_STATIC);
+
+			if (sqlite3_step(statement) == SQLITE_DONE)
+				n += sqlite3_changes(m_prefsDb);
+			else
+				n = -1;
+		}
+		else
+		{
+			n = -1;
+		}
+		sqlite3_finalize(statement);
+	}
+
+	if (n >= 0 && !m_copyValues.empty())
+	{
+		sqlite3_stmt* statement = runSqlQuery(std::string(insert) + " INTO main.Preferences (key, value) VALUES (?, ?)");
+		for (it = first; statement && it != last && n >= 0; ++it)
+		{
+			std::map<std::string,std::string>::const_iterator found = m_copyValues.find(*it);
+			if (found == m_copyValues.end())
+				continue;
+
+			sqlite3_bind_text(statement, 1, found->first.c_str(), -1, SQLITE_STATIC);
+			sqlite3_bind_text(statement, 2, found->second.c_str(), -1, SQLITE_STATIC);
+			if (sqlite3_step(statement) == SQLITE_DONE)
+				n += sqlite3_changes(m_prefsDb);
+			else
+				n = -1;
+			sqlite3_reset(statement);
+		}
+		if (!statement)
+			n = -1;
+		sqlite3_finalize(statement);
+	}
+
+	if (n < 0)
+		PmLogWarning(sysServiceLogContext(),"SQL_ERROR",0,"Failed to copy keys from [%s]: %s",
+					 m_copySource ? m_copySource->m_dbFilename.c_str() : "",sqlite3_errmsg(m_prefsDb));
+
+	return n;
+}
+
+bool PrefsDb::snapshot(const std::string& filename)
+{
+	if (!m_storage)
+		return false;
+
+	return m_storage->snapshot(filename);
+}
+
+sqlite3_stmt* PrefsDb::runSqlQuery(const std::string& queryStr)
+{
+	sqlite3_stmt* statement = 0;
+	int ret = 0;
+	const char* tail = 0;
+
+	if (!m_prefsDb)
+		return 0;
+
+	if (queryStr.empty())
+		return 0;
+
+	ret = sqlite3_prepare(m_prefsDb, queryStr.c_str(), -1, &statement, &tail);
+	if (ret != SQLITE_OK) {
+		PmLogWarning(sysServiceLogContext(),"SQL_ERROR",0,"Failed to prepare sql statement");
+		if (statement)
+		{
+			sqlite3_finalize(statement);
+		}
+		return 0;
+	}
+
+	return statement;
+}
+
+bool PrefsDb::runSqlCommand(const std::string& cmdStr)
+{
+	bool rc = false;
+	int ret = 0;
+	char * pErrMsg = 0;
+
+	char * queryStr = sqlite3_mprintf("%s",cmdStr.c_str());
+	if (!queryStr)
+		return false;
+
+	ret = sqlite3_exec(m_prefsDb, queryStr, NULL, NULL, &pErrMsg);
+	if (ret) {
+		PmLogWarning(sysServiceLogContext(),"SQL_ERROR",0,"Failed to execute cmd [%s] - extended error: [%s]",queryStr, pErrMsg ? pErrMsg : "<none>");
+		rc = false;
+	}
+	else
+		rc = true;
+
+	if (queryStr)
+		sqlite3_free(queryStr);
+	if (pErrMsg)
+		sqlite3_free(pErrMsg);
+	return rc;
+}
+
+std::map<std::string, std::string> PrefsDb::getPrefs(const std::list<std::string>& keys)
+{
+	int ret = 0;
+	std::map<std::string, std::string> result;
+
+	if (!m_storage)
+		return result;
+
+	if (m_cacheLoaded) {
+		for (const std::string& key: keys) {
+			std::unordered_map<std::string, StoredPref>::const_iterator found = m_cache.find(key);
+			if (found != m_cache.end())
+				result[key] = found->second.value;
+		}
+		return result;
+	}
+
+	if (!m_prefsDb) {
+		std::string value;
+		for (const std::string& key: keys) {
+			if (getPref(key, value))
+				result[key] = value;
+		}
+		return result;
+	}
+
+	std::list<std::string>::const_iterator it = keys.begin();
+	while (it != keys.end()) {
+
+		size_t count = std::min<size_t>(std::distance(it, keys.end()), s_maxKeysPerLookup);
+		sqlite3_stmt* statement = multiGetStatement(count);
+		if (!statement)
+			break;
+
+		for (size_t i = 1; i <= count; ++i, ++it)
+			sqlite3_bind_text(statement, i, it->c_str(), -1, SQLITE_STATIC);
+
+		while ((ret = sqlite3_step(statement)) == SQLITE_ROW) {
+			const char* key = (const char*) sqlite3_column_text(statement, 0);
+			const char* val = (const char*) sqlite3_column_text(statement, 1);
+			if (!key || !val)
+				continue;
+
+			result[key] = val;
+		}
+
+		sqlite3_reset(statement);
+		sqlite3_clear_bindings(statement);
+	}
+
+	return result;
+}
+
+std::map<std::string, std::string> PrefsDb::getPrefsAsJson(const std::list<std::string>& keys, sqlite3_int64 sinceRevision)
+{
+	std::map<std::string, std::string> result;
+
+	if (!m_storage)
+		return result;
+
+	if (!m_cacheLoaded) {
+		std::list<std::string> changed;
+		if (sinceRevision > 0) {
+			std::set<std::string> changedSince;
+			for (const std::string& key: getKeysChangedSince(sinceRevision))
+				changedSince.insert(key);
+			for (const std::string& key: keys)
+				if (changedSince.find(key) != changedSince.end())
+					changed.push_back(key);
+		}
+
+		result = getPrefs(sinceRevision > 0 ? changed : keys);
+		for (auto& pref: result)
+			pref.second = canonicalJson(pref.second);
+		return result;
+	}
+
+	for (const std::string& key: keys) {
+		std::unordered_map<std::string, StoredPref>::const_iterator found = m_cache.find(key);
+		if (found != m_cache.end() && (sinceRevision == 0 || found->second.revision > sinceRevision))
+			result[key] = found->second.json;
+	}
+
+	return result;
+}
+
+std::list<std::string> PrefsDb::getKeysChangedSince(sqlite3_int64 revision)
+{
+	std::list<std::string> result;
+
+	if (!m_storage)
+		return result;
+
+	if (m_cacheLoaded) {
+		for (const std::string& key: m_cacheKeys) {
+			if (m_cache[key].revision > revision)
+				result.push_back(key);
+		}
+		return result;
+	}
+
+	sqlite3_stmt* statement = runSqlQuery("SELECT key FROM Preferences WHERE revision > ? ORDER BY key");
+	if (!statement)
+		return result;
+
+	sqlite3_bind_int64(statement, 1, revision);
+	while (sqlite3_step(statement) == SQLITE_ROW) {
+		const char* key = (const char*) sqlite3_column_text(statement, 0);
+		if (key)
+			result.push_back(key);
+	}
+	sqlite3_finalize(statement);
 
 	return result;
 }
 
+sqlite3_stmt* PrefsDb::cachedStatement(sqlite3_stmt*& r_stmt, const char* sql)
+{
+	if (r_stmt)
+		return r_stmt;
+
+	if (!m_prefsDb)
+		return 0;
+
+	if (sqlite3_prepare_v2(m_prefsDb, sql, -1, &r_stmt, 0) != SQLITE_OK) {
+		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to prepare sql statement: %s (%s)", sql, sqlite3_errmsg(m_prefsDb));
+		sqlite3_finalize(r_stmt);
+		r_stmt = 0;
+	}
+
+	return r_stmt;
+}
+
+sqlite3_stmt* PrefsDb::multiGetStatement(size_t keyCount)
+{
+	if (keyCount == 0 || keyCount > s_maxKeysPerLookup)
+		return 0;
+
+	if (m_getPrefsStmts.size() < keyCount)
+		m_getPrefsStmts.resize(keyCount, 0);
+
+	std::string query = "SELECT key, value FROM Preferences WHERE key IN (?";
+	if (!m_getPrefsStmts[keyCount-1]) {
+		for (size_t i = 1; i < keyCount; ++i)
+			query += ",?";
+		query += ")";
+	}
+
+	return cachedStatement(m_getPrefsStmts[keyCount-1], query.c_str());
+}
+
+void PrefsDb::finalizeStatements()
+{
+	for (sqlite3_stmt* statement: m_getPrefsStmts)
+		sqlite3_finalize(statement);
+	m_getPrefsStmts.clear();
+}
+
 void PrefsDb::openPrefsDb()
 {
-	if (m_prefsDb)
+	if (m_storage)
 	{
 		//already open
 		return;
@@ -434,39 +1635,430 @@ void PrefsDb::openPrefsDb()
         g_free(prefsDirPath);
     }
 
+	bool opened = false;
+	if (!m_standalone && Settings::instance()->m_prefsDbBackend == "log") {
+		opened = openLogStorage();
+		if (!opened)
+			PmLogWarning(sysServiceLogContext(),"PREFS_LOG_ERROR",0,"Failed to open preferences log, using [%s]",m_dbFilename.c_str());
+	}
+	if (!opened && !openSqliteStorage())
+		return;
+
+	if (!m_standalone) {
+		// from here on; whatever opening the db wrote (defaults) is stored as usual
+		loadVolatileKeys();
+
+		const std::list<std::string>& keys = Settings::instance()->m_prefsDbCoalescedKeys;
+		m_coalescedKeys = std::set<std::string>(keys.begin(), keys.end());
+		m_coalesceJournalFile = m_dbFilename + "-coalesce";
+		replayCoalesceJournal();
+	}
+
+	if (!m_cacheLoaded && !loadCache()) {
+		PmLogWarning(sysServiceLogContext(),"CACHE_LOAD_ERROR",0,"Failed to load preferences cache, reading from database directly");
+	}
+
+	// a database without one was just created, and its revisions start over
+	if (!m_standalone && (!getPref(s_epochKey, m_epoch) || m_epoch.empty()))
+		renewEpoch();
+
+	scheduleIntegrityCheck();
+	startWriter();
+}
+
+bool PrefsDb::openSqliteStorage()
+{
 	int ret = sqlite3_open(m_dbFilename.c_str(), &m_prefsDb);
 	if (ret) {
 		PmLogWarning(sysServiceLogContext(),"DB_OPEN_ERROR",0,"Failed to open preferences db [%s]",m_dbFilename.c_str());
+		(void) sqlite3_close(m_prefsDb);
+		m_prefsDb = 0;
+		return false;
+	}
+
+	configureConnection();
+
+	// the type/json columns are only kept in the service's own db; standalone dbs are backup
+	// images that older releases must still be able to restore
+	m_storage.reset(new SqlitePrefsStorage(m_prefsDb, m_standalone));
+
+	if (!checkTableConsistency()) {
+
+		PmLogWarning(sysServiceLogContext(),"TABLE_CREATE_ERROR",0,"Failed to create Preferences table");
+		closeStorage();
+		return false;
+	}
+
+	ret = sqlite3_exec(m_prefsDb,
+					   "CREATE TABLE IF NOT EXISTS Preferences "
+					   "(key   TEXT NOT NULL ON CONFLICT FAIL UNIQUE ON CONFLICT REPLACE, "
+					   " value TEXT);", NULL, NULL, NULL);
+	if (ret) {
+		PmLogWarning(sysServiceLogContext(),"TABLE_CREATE_ERROR",0,"Failed to create Preferences table");
+		closeStorage();
+		return false;
+	}
+
+	// back from the log backend: it has the newer preferences
+	if (!m_standalone && Settings::instance()->m_prefsDbBackend != "log" &&
+		g_file_test(logFilename().c_str(), G_FILE_TEST_EXISTS))
+		(void) importLog(logFilename());
+
+	return true;
+}
+
+bool PrefsDb::openLogStorage()
+{
+	std::string filename = logFilename();
+	bool sync = strcasecmp(Settings::instance()->m_prefsDbSynchronous.c_str(), "OFF") != 0;
+
+	// a log that doesn't hold a complete set of preferences is rebuilt once from the database,
+	// but only one just exported: an existing log has preferences the database doesn't, and is
+	// moved aside rather than overwritten. A corrupt one LogPrefsStorage moves aside itself
+	for (int attempt = 0; attempt < 2; ++attempt) {
+		bool exported = false;
+		if (!g_file_test(filename.c_str(), G_FILE_TEST_EXISTS)) {
+			if (!exportToLog(filename))
+				return false;
+			exported = true;
+		}
+
+		std::unique_ptr<LogPrefsStorage> log(new LogPrefsStorage(filename, sync));
+		if (!log->open())
+			return false;
+		m_storage = std::move(log);
+
+		std::string version;
+		if (loadCache() && getPref("databaseVersion", version)) {
+			resyncDefaults();
+			return true;
+		}
+
+		closeStorage();
+		if (!exported) {
+			std::string corruptFilename = filename + ".corrupt";
+			PmLogCritical(sysServiceLogContext(),"PREFS_LOG_CORRUPT",0,"Preferences log [%s] is incomplete, moving it to [%s]",filename.c_str(),corruptFilename.c_str());
+			(void) rename(filename.c_str(), corruptFilename.c_str());
+
+			// the database is read instead
+			m_cache.clear();
+			m_cacheKeys.clear();
+			m_cacheLoaded = false;
+			m_revision = 0;
+			return false;
+		}
+
+		PmLogWarning(sysServiceLogContext(),"PREFS_LOG_ERROR",0,"Preferences log [%s] is incomplete, rebuilding it",filename.c_str());
+		unlink(filename.c_str());
+	}
+
+	return false;
+}
+
+void PrefsDb::closeStorage()
+{
+	// leave a self-contained database file behind
+	(void) checkpoint(true);
+
+	m_storage.reset();
+	finalizeStatements();
+	(void) sqlite3_close(m_prefsDb);
+	m_prefsDb = 0;
+	m_walMode = false;
+}
+
+std::string PrefsDb::logFilename() const
+{
+	// systemprefs.db -> systemprefs.log
+	std::string filename = m_dbFilename;
+	if (g_str_has_suffix(filename.c_str(), ".db"))
+		filename.resize(filename.size() - 3);
+	return filename + ".log";
+}
+
+bool PrefsDb::exportToLog(const std::string& filename)
+{
+	// what systemprefs.db has, or the defaults if there is no database either
+	if (!openSqliteStorage())
+		return false;
+
+	// built under another name, an interrupted migration starts over on the next open
+	std::string tempFilename = filename + ".migrating";
+	unlink(tempFilename.c_str());
+
+	size_t count = 0;
+	bool ok = false;
+	{
+		LogPrefsStorage log(tempFilename, true);
+		if (log.open() && log.beginBatch()) {
+			ok = true;
+			bool iterated = m_storage->iterate([&log, &ok, &count](const PrefsStorage::Record& record) {
+				ok = ok && log.put(record);
+				++count;
+			});
+
+			if (ok && iterated) {
+				ok = log.commitBatch();
+			}
+			else {
+				log.rollbackBatch();
+				ok = false;
+			}
+		}
+	}
+	closeStorage();
+
+	if (!ok || rename(tempFilename.c_str(), filename.c_str()) != 0) {
+		PmLogWarning(sysServiceLogContext(),"PREFS_LOG_ERROR",0,"Failed to move preferences from [%s] to [%s]",m_dbFilename.c_str(),filename.c_str());
+		unlink(tempFilename.c_str());
+		return false;
+	}
+
+	PmLogInfo(sysServiceLogContext(), "PREFSDB_MIGRATE", 0, "moved %zu preferences from [%s] to [%s]", count, m_dbFilename.c_str(), filename.c_str());
+	return true;
+}
+
+bool PrefsDb::importLog(const std::string& filename)
+{
+	LogPrefsStorage log(filename, false);
+	if (!log.open())
+		return false;
+
+	// records keep their revisions, so clients see nothing changed by the move
+	size_t count = 0;
+	bool ok = m_storage->beginBatch();
+	(void) log.iterate([this, &ok, &count](const PrefsStorage::Record& record) {
+		ok = ok && m_storage->put(record);
+		m_revision = std::max(m_revision, record.revision);
+		++count;
+	});
+	if (ok)
+		ok = m_storage->commitBatch();
+	else
+		m_storage->rollbackBatch();
+
+	if (!ok) {
+		PmLogWarning(sysServiceLogContext(),"SQL_ERROR",0,"Failed to move preferences from [%s] to [%s], keeping the log",filename.c_str(),m_dbFilename.c_str());
+		return false;
+	}
+
+	// the log is stale now; without it a later switch back to the log starts from this database
+	unlink(filename.c_str());
+	PmLogInfo(sysServiceLogContext(), "PREFSDB_MIGRATE", 0, "moved %zu preferences from [%s] to [%s]", count, filename.c_str(), m_dbFilename.c_str());
+
+	if (m_cacheLoaded)
+		(void) loadCache();
+	return true;
+}
+
+void PrefsDb::closePrefsDb()
+{
+	if (!m_storage)
+		return;
+
+	if (m_copySource)
+		(void) endCopyKeys();
+	stopIntegrityCheck();
+	stopWriter();
+
+	if (!flushCoalescedWrites())
+		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Coalesced preferences left in journal [%s]", m_coalesceJournalFile.c_str());
+
+	if (m_coalesceJournalFd >= 0) {
+		close(m_coalesceJournalFd);
+		m_coalesceJournalFd = -1;
+	}
+
+	if (m_checkpointSource) {
+		g_source_remove(m_checkpointSource);
+		m_checkpointSource = 0;
+	}
+
+	closeStorage();
+
+	m_cache.clear();
+	m_cacheKeys.clear();
+	m_cacheLoaded = false;
+	m_revision = 0;
+	notifyChanged(std::string());
+	m_batchValues.clear();
+	m_batchCoalescedKeys.clear();
+	m_batchDepth = 0;
+	m_batchRolledBack = false;
+	m_batchQueued = false;
+	m_pendingWrites.clear();
+	m_coalescedValues.clear();
+	m_coalesceFlushQueued = false;
+	m_coalesceJournalEntries = 0;
+}
+
+void PrefsDb::configureConnection()
+{
+	m_walMode = false;
+
+	if (!m_prefsDb)
+		return;
+
+	if (m_standalone)
+	{
+		// standalone dbs are handed around as single files (backup/restore), keep them self-contained
+		(void) runSqlCommand("PRAGMA journal_mode=DELETE");
+		return;
+	}
+
+	const Settings* settings = Settings::instance();
+
+	std::string pragma = "PRAGMA journal_mode";
+	if (!settings->m_prefsDbJournalMode.empty())
+		pragma += "=" + settings->m_prefsDbJournalMode;
+
+	// the journal mode is persistent, so read back what the file actually uses
+	sqlite3_stmt* statement = runSqlQuery(pragma);
+	if (statement) {
+		if (sqlite3_step(statement) == SQLITE_ROW) {
+			const char* mode = (const char*) sqlite3_column_text(statement, 0);
+			m_walMode = (mode && strcasecmp(mode, "wal") == 0);
+		}
+		sqlite3_finalize(statement);
+	}
+
+	if (!settings->m_prefsDbSynchronous.empty())
+		(void) runSqlCommand("PRAGMA synchronous=" + settings->m_prefsDbSynchronous);
+
+	if (settings->m_prefsDbCacheSizeKb > 0)
+		(void) runSqlCommand("PRAGMA cache_size=-" + std::to_string(settings->m_prefsDbCacheSizeKb));
+
+	if (settings->m_prefsDbMmapSize > 0)
+		(void) runSqlCommand("PRAGMA mmap_size=" + std::to_string(settings->m_prefsDbMmapSize));
+
+	PmLogDebug(sysServiceLogContext(), "prefs db [%s] opened, wal mode: %s", m_dbFilename.c_str(), m_walMode ? "yes" : "no");
+}
+
+bool PrefsDb::checkpoint(bool truncate)
+{
+	if (!m_prefsDb || !m_walMode)
+		return true;
+
+	int logFrames = 0;
+	int checkpointedFrames = 0;
+	int ret = sqlite3_wal_checkpoint_v2(m_prefsDb, NULL,
+										truncate ? SQLITE_CHECKPOINT_TRUNCATE : SQLITE_CHECKPOINT_PASSIVE,
+										&logFrames, &checkpointedFrames);
+	if (ret != SQLITE_OK) {
+		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "wal checkpoint failed: %s", sqlite3_errmsg(m_prefsDb));
+		return false;
+	}
+
+	PmLogDebug(sysServiceLogContext(), "wal checkpoint: %d of %d frames", checkpointedFrames, logFrames);
+	return true;
+}
+
+void PrefsDb::scheduleCheckpoint()
+{
+	if (!m_walMode)
 		return;
+
+	m_lastWriteTime = g_get_monotonic_time();
+
+	// the timer is armed once and pushed back from its own callback while writes keep coming
+	if (!m_checkpointSource) {
+		m_checkpointSource = g_timeout_add_full(G_PRIORITY_LOW, Settings::instance()->m_prefsDbCheckpointIdleMs,
+												cbCheckpointTimeout, this, NULL);
+	}
+}
+
+gboolean PrefsDb::cbCheckpointTimeout(gpointer data)
+{
+	PrefsDb* self = static_cast<PrefsDb*>(data);
+	gint64 idleMs = Settings::instance()->m_prefsDbCheckpointIdleMs;
+	gint64 sinceLastWriteMs = (g_get_monotonic_time() - self->m_lastWriteTime) / 1000;
+
+	if (sinceLastWriteMs < idleMs) {
+		self->m_checkpointSource = g_timeout_add_full(G_PRIORITY_LOW, idleMs - sinceLastWriteMs,
+													  cbCheckpointTimeout, self, NULL);
+		return G_SOURCE_REMOVE;
+	}
+
+	self->m_checkpointSource = 0;
+	(void) self->checkpoint();
+	return G_SOURCE_REMOVE;
+}
+
+bool PrefsDb::loadCache()
+{
+	m_cache.clear();
+	m_cacheKeys.clear();
+	m_cacheLoaded = false;
+	notifyChanged(std::string());
+
+	if (!m_storage)
+		return false;
+
+	bool ok = m_storage->iterate([this](const PrefsStorage::Record& record) {
+		m_cache[record.key] = StoredPref { record.value, record.json.empty() ? canonicalJson(record.value) : record.json, record.revision };
+		m_cacheKeys.insert(record.key);
+		// only sqlite can ask for MAX(revision), the log backend's sequence picks up from here
+		m_revision = std::max(m_revision, record.revision);
+	});
+
+	if (!ok) {
+		m_cache.clear();
+		m_cacheKeys.clear();
+		return false;
+	}
+
+	for (const auto& pref: m_volatileValues) {
+		m_cache[pref.first] = pref.second;
+		m_cacheKeys.insert(pref.first);
+		m_revision = std::max(m_revision, pref.second.revision);
 	}
 
-	if (!checkTableConsistency()) {
+	m_cacheLoaded = true;
+	PmLogDebug(sysServiceLogContext(),"loaded %zu preferences into cache", m_cache.size());
+	return true;
+}
+
+int PrefsDb::verifyCache()
+{
+	if (!m_cacheLoaded)
+		return 0;
+
+	// keys with writes in flight are compared with what was last stored for them
+	auto committedPref = [this](const std::string& key) -> const StoredPref* {
+		std::unordered_map<std::string, PendingWrite>::const_iterator pending = m_pendingWrites.find(key);
+		if (pending != m_pendingWrites.end())
+			return pending->second.committed ? &pending->second.value : 0;
+
+		std::unordered_map<std::string, StoredPref>::const_iterator it = m_cache.find(key);
+		return it != m_cache.end() ? &it->second : 0;
+	};
+
+	std::map<std::string,std::string> dbPrefs = readAllPrefsFromDb();
+	int divergent = 0;
 
-		PmLogWarning(sysServiceLogContext(),"TABLE_CREATE_ERROR",0,"Failed to create Preferences table");
-		sqlite3_close(m_prefsDb);
-		m_prefsDb = 0;
-		return;
-	}
+	for (const auto& pref: dbPrefs) {
+		if (isVolatileKey(pref.first))
+			continue;
 
-	ret = sqlite3_exec(m_prefsDb,
-					   "CREATE TABLE IF NOT EXISTS Preferences "
-					   "(key   TEXT NOT NULL ON CONFLICT FAIL UNIQUE ON CONFLICT REPLACE, "
-					   " value TEXT);", NULL, NULL, NULL);
-	if (ret) {
-		PmLogWarning(sysServiceLogContext(),"TABLE_CREATE_ERROR",0,"Failed to create Preferences table");
-		sqlite3_close(m_prefsDb);
-		m_prefsDb = 0;
-		return;
+		const StoredPref* cached = committedPref(pref.first);
+		if (!cached) {
+			PmLogWarning(sysServiceLogContext(), "CACHE_DIVERGENCE", 0, "key [%s] is in the db but not in the cache", pref.first.c_str());
+			++divergent;
+		}
+		else if (cached->value != pref.second) {
+			PmLogWarning(sysServiceLogContext(), "CACHE_DIVERGENCE", 0, "key [%s] has a different value in the cache", pref.first.c_str());
+			++divergent;
+		}
 	}
-}
 
-void PrefsDb::closePrefsDb()
-{
-	if (!m_prefsDb)
-		return;
+	for (const auto& pref: m_cache) {
+		if (!isVolatileKey(pref.first) && committedPref(pref.first) && dbPrefs.find(pref.first) == dbPrefs.end()) {
+			PmLogWarning(sysServiceLogContext(), "CACHE_DIVERGENCE", 0, "key [%s] is in the cache but not in the db", pref.first.c_str());
+			++divergent;
+		}
+	}
 
-	(void) sqlite3_close(m_prefsDb);
-	m_prefsDb = 0;
+	return divergent;
 }
 
 bool PrefsDb::checkTableConsistency()
@@ -500,17 +2092,12 @@ bool PrefsDb::checkTableConsistency()
 		goto Recreate;
 	}
 
-	if (!m_standalone)
-	{
-		// check to see if all the defaults from the s_defaultPrefsFile at least exist and if not, add them
-		synchronizeDefaults();
-		synchronizePlatformDefaults();
+	if (!m_standalone && !upgradeValueColumns())
+		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to upgrade preference values to typed storage");
 
-		//check the same with the "customer care" file
-		synchronizeCustomerCareInfo();
+	if (!m_standalone)
+		resyncDefaults();
 
-		updateWithCustomizationPrefOverrides();
-	}
 	//Everything is now ok.
 	return true;
 
@@ -526,7 +2113,7 @@ Recreate:
 		return false;
 	}
 
-	ret = sqlite3_exec(m_prefsDb, "INSERT INTO Preferences VALUES ('databaseVersion', '1.0')",
+	ret = sqlite3_exec(m_prefsDb, "INSERT INTO Preferences (key, value) VALUES ('databaseVersion', '1.0')",
 					   NULL, NULL, NULL);
 	if (ret) {
 		PmLogWarning(sysServiceLogContext(),"TABLE_CREATE_ERROR",0,"Failed to create Preferences table");
@@ -536,13 +2123,149 @@ Recreate:
 
 	if (!m_standalone)
 	{
+		(void) upgradeValueColumns();
+
 		loadDefaultPrefs();
 		loadDefaultPlatformPrefs();
-		updateWithCustomizationPrefOverrides();
+		(void) updateWithCustomizationPrefOverrides();
+
+		// the defaults above went in as plain key/value rows
+		(void) upgradeValueColumns();
 	}
 	return true;
 }
 
+void PrefsDb::resyncDefaults()
+{
+	// nothing to do unless one of the defaults files changed since the last resync
+	std::string fingerprint = defaultsFingerprint();
+	std::string storedFingerprint;
+
+	if (getPref(s_defaultsFingerprintKey, storedFingerprint) && storedFingerprint == fingerprint) {
+		PmLogDebug(sysServiceLogContext(), "default preference files unchanged, skipping resync");
+	}
+	else {
+		// diff the files against an in-memory snapshot, one transaction per file. A file that
+		// fails doesn't take the others with it; the fingerprint stays as it was, so the next
+		// start tries again
+		(void) loadCache();
+
+		const struct {
+			bool (PrefsDb::*synchronize)();
+			const char* file;
+		} steps[] = {
+			// check to see if all the defaults from the s_defaultPrefsFile at least exist and if not, add them
+			{ &PrefsDb::synchronizeDefaults, s_defaultPrefsFile },
+			{ &PrefsDb::synchronizePlatformDefaults, s_defaultPlatformPrefsFile },
+			//check the same with the "customer care" file
+			{ &PrefsDb::synchronizeCustomerCareInfo, s_custCareNumberFile },
+			{ &PrefsDb::updateWithCustomizationPrefOverrides, s_customizationOverridePrefsFile }
+		};
+
+		bool ok = true;
+		for (const auto& step: steps) {
+			if (!(this->*step.synchronize)()) {
+				PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to synchronize default preferences from %s", step.file);
+				ok = false;
+			}
+		}
+
+		if (ok && !setPref(s_defaultsFingerprintKey, fingerprint))
+			PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to store the default preferences fingerprint");
+	}
+}
+
+bool PrefsDb::upgradeValueColumns()
+{
+	// databases created by older releases lack some or all of the columns next to key and value
+	static const char* columns[][2] = {
+		{ "type", "TEXT" },
+		{ "json", "TEXT" },
+		{ "revision", "INTEGER" }
+	};
+
+	std::set<std::string> present;
+	sqlite3_stmt* statement = runSqlQuery("PRAGMA table_info(Preferences)");
+	if (!statement)
+		return false;
+
+	while (sqlite3_step(statement) == SQLITE_ROW) {
+		const char* column = (const char*) sqlite3_column_text(statement, 1);
+		if (column)
+			present.insert(column);
+	}
+	sqlite3_finalize(statement);
+
+	for (const auto& column: columns) {
+		if (present.find(column[0]) != present.end())
+			continue;
+
+		PmLogInfo(sysServiceLogContext(), "PREFSDB_UPGRADE", 0, "adding column %s to [%s]", column[0], m_dbFilename.c_str());
+		if (!runSqlCommand(std::string("ALTER TABLE Preferences ADD COLUMN ") + column[0] + " " + column[1]))
+			return false;
+	}
+
+	m_revision = 0;
+	statement = runSqlQuery("SELECT MAX(revision) FROM Preferences");
+	if (!statement)
+		return false;
+	if (sqlite3_step(statement) == SQLITE_ROW)
+		m_revision = sqlite3_column_int64(statement, 0);
+	sqlite3_finalize(statement);
+
+	return fillValueColumns();
+}
+
+bool PrefsDb::fillValueColumns()
+{
+	// rows written without them: migrated rows, restored backups, raw default loads. Each gets
+	// a new revision, so it shows up as changed to anyone who has seen an older one
+	std::vector<std::pair<std::string, std::string> > untyped;
+	sqlite3_stmt* statement = runSqlQuery("SELECT key, value FROM Preferences "
+										  "WHERE (json IS NULL OR revision IS NULL) AND value IS NOT NULL");
+	if (!statement)
+		return false;
+
+	while (sqlite3_step(statement) == SQLITE_ROW) {
+		const char* key = (const char*) sqlite3_column_text(statement, 0);
+		const char* val = (const char*) sqlite3_column_text(statement, 1);
+		if (key && val)
+			untyped.emplace_back(key, val);
+	}
+	sqlite3_finalize(statement);
+
+	if (untyped.empty())
+		return true;
+
+	statement = runSqlQuery("UPDATE Preferences SET type=?, json=?, revision=? WHERE key=?");
+	if (!statement)
+		return false;
+
+	bool ok = beginBatch();
+	for (auto it = untyped.begin(); ok && it != untyped.end(); ++it) {
+		const char* type = 0;
+		std::string json = canonicalJson(it->second, &type);
+
+		sqlite3_bind_text(statement, 1, type, -1, SQLITE_STATIC);
+		sqlite3_bind_text(statement, 2, json.c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_int64(statement, 3, m_revision + 1);
+		sqlite3_bind_text(statement, 4, it->first.c_str(), -1, SQLITE_STATIC);
+		ok = (sqlite3_step(statement) == SQLITE_DONE);
+		sqlite3_reset(statement);
+		if (ok)
+			++m_revision;
+	}
+	sqlite3_finalize(statement);
+
+	if (!ok) {
+		rollbackBatch();
+		return false;
+	}
+
+	PmLogDebug(sysServiceLogContext(),"stored typed values for %zu preferences", untyped.size());
+	return commitBatch();
+}
+
 bool PrefsDb::integrityCheckDb()
 {
 	if (!m_prefsDb)
@@ -552,8 +2275,16 @@ bool PrefsDb::integrityCheckDb()
 	const char* tail = 0;
 	int ret = 0;
 	bool integrityOk = false;
+	bool fullCheck = true;
+
+	// with the background check only quick_check runs here, unless the last full check found a problem
+	if (backgroundIntegrityCheck()) {
+		std::string lastCheck = lastIntegrityCheck();
+		fullCheck = !lastCheck.empty() && !JDomParser::fromString(lastCheck)["ok"].asBool();
+	}
+	m_fullCheckAtOpen = false;
 
-	ret = sqlite3_prepare(m_prefsDb, "PRAGMA integrity_check", -1, &statement, &tail);
+	ret = sqlite3_prepare(m_prefsDb, fullCheck ? "PRAGMA integrity_check" : "PRAGMA quick_check", -1, &statement, &tail);
 	if (ret) {
 		PmLogCritical(sysServiceLogContext(), "SQL_PREPARE_FAILED", 0, "Failed to prepare sql statement for integrity_check");
 		goto CorruptDb;
@@ -571,7 +2302,8 @@ bool PrefsDb::integrityCheckDb()
 	if (!integrityOk)
 		goto CorruptDb;
 
-	PmLogDebug(sysServiceLogContext(),"Integrity check for database passed");
+	PmLogDebug(sysServiceLogContext(),"Integrity check for database passed (%s)", fullCheck ? "full" : "quick");
+	m_fullCheckAtOpen = fullCheck;
 
 	return true;
 
@@ -579,8 +2311,10 @@ CorruptDb:
 
 	PmLogCritical(sysServiceLogContext(), "INTEGRITY_CHECK_FAILED", 0, "integrity check failed. recreating database");
 
+	m_storage.reset();
+	finalizeStatements();
 	sqlite3_close(m_prefsDb);
-	unlink(m_dbFilename.c_str());
+	unlinkDatabaseFiles(m_dbFilename);
 
 	ret = sqlite3_open_v2 (m_dbFilename.c_str(), &m_prefsDb, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, NULL);
 	if (ret) {
@@ -588,23 +2322,404 @@ CorruptDb:
 		return false;
 	}
 
+	configureConnection();
+	m_storage.reset(new SqlitePrefsStorage(m_prefsDb, m_standalone));
+
 	return true;
 }
 
-void PrefsDb::synchronizeDefaults() {
+std::string PrefsDb::lastIntegrityCheck()
+{
+	std::string result;
+	(void) getPref(s_integrityCheckKey, result);
+	return result;
+}
+
+bool PrefsDb::backgroundIntegrityCheck() const
+{
+	// a reader on another connection only leaves writers alone in WAL mode
+	return !m_standalone && m_walMode && Settings::instance()->m_prefsDbIntegrityCheck == "background";
+}
+
+void PrefsDb::scheduleIntegrityCheck()
+{
+	if (m_standalone || m_integrityThread || m_integrityCheckSource)
+		return;
+
+	if (m_fullCheckAtOpen) {
+		recordIntegrityCheck(true, "ok");
+		return;
+	}
+
+	if (!backgroundIntegrityCheck())
+		return;
+
+	JValue lastCheck = JDomParser::fromString(lastIntegrityCheck());
+	if (lastCheck.isObject() && lastCheck["ok"].asBool()) {
+		gint64 age = (gint64) time(NULL) - lastCheck["time"].asNumber<int64_t>();
+		if (age >= 0 && age < Settings::instance()->m_prefsDbIntegrityCheckMaxAgeSec) {
+			PmLogDebug(sysServiceLogContext(), "last integrity check passed %" G_GINT64_FORMAT " s ago, not running another", age);
+			return;
+		}
+	}
+
+	m_integrityCheckSource = g_timeout_add_seconds_full(G_PRIORITY_LOW, s_integrityCheckDelaySec,
+														cbIntegrityCheckTimeout, this, NULL);
+}
+
+void PrefsDb::stopIntegrityCheck()
+{
+	if (m_integrityCheckSource) {
+		g_source_remove(m_integrityCheckSource);
+		m_integrityCheckSource = 0;
+	}
+
+	if (m_integrityThread) {
+		sqlite3_interrupt(m_integrityCheckDb);
+		g_thread_join(m_integrityThread);
+		m_integrityThread = 0;
+	}
+
+	// only read once the thread is joined: it may have posted its result already
+	if (m_integrityCheckDoneSource) {
+		g_source_remove(m_integrityCheckDoneSource);
+		m_integrityCheckDoneSource = 0;
+	}
+
+	if (m_integrityCheckDb) {
+		(void) sqlite3_close(m_integrityCheckDb);
+		m_integrityCheckDb = 0;
+	}
+}
+
+void PrefsDb::recordIntegrityCheck(bool ok, const std::string& message)
+{
+	// a verdict the record already has is written again only once it is too old to go by,
+	// not on every boot that runs the full check
+	JValue last = JDomParser::fromString(lastIntegrityCheck());
+	if (last.isObject() && last["ok"].asBool() == ok && last["message"].asString() == message) {
+		gint64 age = (gint64) time(NULL) - last["time"].asNumber<int64_t>();
+		if (age >= 0 && age < Settings::instance()->m_prefsDbIntegrityCheckMaxAgeSec)
+			return;
+	}
+
+	JObject record {{"ok", ok}, {"time", (int64_t) time(NULL)}, {"message", message}};
+	if (!setPref(s_integrityCheckKey, record.stringify()))
+		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to record integrity check result");
+}
+
+gboolean PrefsDb::cbIntegrityCheckTimeout(gpointer data)
+{
+	PrefsDb* self = static_cast<PrefsDb*>(data);
+
+	self->m_integrityCheckSource = 0;
+	if (sqlite3_open_v2(self->m_dbFilename.c_str(), &self->m_integrityCheckDb, SQLITE_OPEN_READONLY, NULL) != SQLITE_OK) {
+		PmLogWarning(sysServiceLogContext(), "DB_OPEN_ERROR", 0, "Failed to open [%s] for the integrity check", self->m_dbFilename.c_str());
+		(void) sqlite3_close(self->m_integrityCheckDb);
+		self->m_integrityCheckDb = 0;
+		return G_SOURCE_REMOVE;
+	}
+
+	// the thread posts cbIntegrityCheckDone() to the main loop when it is finished
+	self->m_integrityCheckResult.clear();
+	self->m_integrityThread = g_thread_new("prefsdb-check", integrityCheckThread, self);
+	return G_SOURCE_REMOVE;
+}
+
+gboolean PrefsDb::cbIntegrityCheckDone(gpointer data)
+{
+	PrefsDb* self = static_cast<PrefsDb*>(data);
+
+	// this can run before the thread has stored the id of this source; joining it first
+	// makes that store and m_integrityCheckResult visible here
+	g_thread_join(self->m_integrityThread);
+	self->m_integrityThread = 0;
+	self->m_integrityCheckDoneSource = 0;
+	(void) sqlite3_close(self->m_integrityCheckDb);
+	self->m_integrityCheckDb = 0;
+
+	if (self->m_integrityCheckResult.empty()) {
+		PmLogWarning(sysServiceLogContext(), "INTEGRITY_CHECK_INCOMPLETE", 0, "background integrity check did not complete");
+		return G_SOURCE_REMOVE;
+	}
+
+	bool ok = (strcasecmp(self->m_integrityCheckResult.c_str(), "ok") == 0);
+	if (!ok) {
+		// the database is in use; the next open runs the full check again and recreates it if needed
+		PmLogCritical(sysServiceLogContext(), "INTEGRITY_CHECK_FAILED", 0, "background integrity check failed: %s",
+					  self->m_integrityCheckResult.c_str());
+	}
+	self->recordIntegrityCheck(ok, self->m_integrityCheckResult);
+
+	return G_SOURCE_REMOVE;
+}
+
+gpointer PrefsDb::integrityCheckThread(gpointer data)
+{
+	PrefsDb* self = static_cast<PrefsDb*>(data);
+	sqlite3_stmt* statement = 0;
+	std::string result;
+	int ret = SQLITE_ERROR;
+
+	if (sqlite3_prepare_v2(self->m_integrityCheckDb, "PRAGMA integrity_check", -1, &statement, 0) == SQLITE_OK) {
+		// a single "ok" row, or one row per problem found
+		while ((ret = sqlite3_step(statement)) == SQLITE_ROW) {
+			const char* row = (const char*) sqlite3_column_text(statement, 0);
+			if (!row)
+				continue;
+			if (!result.empty())
+				result += "; ";
+			result += row;
+		}
+	}
+	sqlite3_finalize(statement);
+
+	// interrupted or could not read the database: no verdict
+	if (ret != SQLITE_DONE)
+		result.clear();
+
+	self->m_integrityCheckResult = result;
+	self->m_integrityCheckDoneSource = g_idle_add_full(G_PRIORITY_LOW, cbIntegrityCheckDone, self, NULL);
+	return 0;
+}
+
+void PrefsDb::startWriter()
+{
+	// reads are served from the cache while writes are in flight, and only WAL lets
+	// the main connection read while the writer's connection writes
+	if (m_writerThread || m_standalone || !m_walMode || !m_cacheLoaded)
+		return;
+	if (!Settings::instance()->m_prefsDbWriterThread)
+		return;
+
+	if (sqlite3_open_v2(m_dbFilename.c_str(), &m_writerDb, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to open writer connection, writing on the main loop: %s",
+					 m_writerDb ? sqlite3_errmsg(m_writerDb) : "out of memory");
+		(void) sqlite3_close(m_writerDb);
+		m_writerDb = 0;
+		return;
+	}
+
+	// checkpoints on the main connection may hold the write lock for a moment
+	(void) sqlite3_busy_timeout(m_writerDb, 5000);
+	const std::string& synchronous = Settings::instance()->m_prefsDbSynchronous;
+	if (!synchronous.empty())
+		(void) sqlite3_exec(m_writerDb, ("PRAGMA synchronous=" + synchronous).c_str(), NULL, NULL, NULL);
+
+	m_writeQueue = g_async_queue_new();
+	m_writeDoneQueue = g_async_queue_new();
+	m_writerThread = g_thread_new("prefsdb-writer", writerThread, this);
+}
+
+void PrefsDb::stopWriter()
+{
+	if (!m_writerThread)
+		return;
+
+	// jobs are written in order, so everything queued is done when the thread sees this one
+	g_async_queue_push(m_writeQueue, new WriteJob { {}, 0, 0, false, true, false });
+	g_thread_join(m_writerThread);
+	m_writerThread = 0;
+
+	(void) sqlite3_close(m_writerDb);
+	m_writerDb = 0;
+
+	// the cache is settled now, whoever stopped the writer goes on with it; the callbacks
+	// run from the main loop as they would have
+	completeWrites(true);
+
+	g_async_queue_unref(m_writeQueue);
+	g_async_queue_unref(m_writeDoneQueue);
+	m_writeQueue = 0;
+	m_writeDoneQueue = 0;
+}
+
+void PrefsDb::completeWrites(bool deferDone)
+{
+	if (!m_writeDoneQueue)
+		return;
+
+	while (WriteJob* job = static_cast<WriteJob*>(g_async_queue_try_pop(m_writeDoneQueue))) {
+		if (job->flush) {
+			completeCoalesceFlush(job);
+			delete job;
+			continue;
+		}
+
+		for (const WriteJob::Row& row: job->rows) {
+			std::unordered_map<std::string, PendingWrite>::iterator pending = m_pendingWrites.find(row.key);
+			if (pending == m_pendingWrites.end())
+				continue;
+
+			if (job->ok) {
+				countWrite(row.key, row.value, row.json);
+				pending->second.committed = true;
+				pending->second.value = StoredPref { row.value, row.json, row.revision };
+			}
+
+			// the cache has the newest value queued; once nothing is left in flight it goes
+			// back to what is stored, which is only different after a failed write, and
+			// listeners hear about it again
+			if (--pending->second.jobs == 0) {
+				if (!job->ok && m_cacheLoaded) {
+					if (pending->second.committed) {
+						m_cache[row.key] = pending->second.value;
+					}
+					else {
+						m_cache.erase(row.key);
+						m_cacheKeys.erase(row.key);
+					}
+					notifyChanged(row.key);
+				}
+				m_pendingWrites.erase(pending);
+			}
+		}
+
+		if (job->ok)
+			scheduleCheckpoint();
+		else
+			PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Writer thread failed to store %zu preferences", job->rows.size());
+
+		if (job->done && deferDone) {
+			job->rows.clear();
+			m_finishedJobs.push_back(job);
+			if (!m_finishedJobsSource)
+				m_finishedJobsSource = g_idle_add(cbFinishedJobs, this);
+			continue;
+		}
+
+		if (job->done)
+			job->done(job->ok, job->userData);
+		delete job;
+	}
+}
+
+void PrefsDb::runFinishedJobs()
+{
+	if (m_finishedJobsSource) {
+		g_source_remove(m_finishedJobsSource);
+		m_finishedJobsSource = 0;
+	}
+
+	// a callback may stop the writer again and finish more jobs
+	while (!m_finishedJobs.empty()) {
+		WriteJob* job = m_finishedJobs.front();
+		m_finishedJobs.pop_front();
+		job->done(job->ok, job->userData);
+		delete job;
+	}
+}
+
+gboolean PrefsDb::cbFinishedJobs(gpointer data)
+{
+	PrefsDb* self = static_cast<PrefsDb*>(data);
+	self->m_finishedJobsSource = 0;
+	self->runFinishedJobs();
+	return G_SOURCE_REMOVE;
+}
+
+gboolean PrefsDb::cbWritesDone(gpointer data)
+{
+	static_cast<PrefsDb*>(data)->completeWrites();
+	return G_SOURCE_REMOVE;
+}
+
+gpointer PrefsDb::writerThread(gpointer data)
+{
+	PrefsDb* self = static_cast<PrefsDb*>(data);
+	sqlite3_stmt* statement = 0;
+
+	if (sqlite3_prepare_v2(self->m_writerDb, SqlitePrefsStorage::putQuery(false), -1, &statement, 0) != SQLITE_OK)
+		statement = 0;
+
+	while (true) {
+		WriteJob* job = static_cast<WriteJob*>(g_async_queue_pop(self->m_writeQueue));
+		if (job->stop) {
+			delete job;
+			break;
+		}
+
+		bool ok = statement && sqlite3_exec(self->m_writerDb, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL) == SQLITE_OK;
+		if (ok) {
+			for (const WriteJob::Row& row: job->rows) {
+				sqlite3_bind_text(statement, 1, row.key.c_str(), -1, SQLITE_STATIC);
+				sqlite3_bind_text(statement, 2, row.value.c_str(), -1, SQLITE_STATIC);
+				sqlite3_bind_text(statement, 3, row.type, -1, SQLITE_STATIC);
+				sqlite3_bind_text(statement, 4, row.json.c_str(), -1, SQLITE_STATIC);
+				sqlite3_bind_int64(statement, 5, row.revision);
+				ok = (sqlite3_step(statement) == SQLITE_DONE);
+				sqlite3_reset(statement);
+				sqlite3_clear_bindings(statement);
+				if (!ok)
+					break;
+			}
+
+			if (ok)
+				ok = (sqlite3_exec(self->m_writerDb, "COMMIT TRANSACTION", NULL, NULL, NULL) == SQLITE_OK);
+			if (!ok)
+				(void) sqlite3_exec(self->m_writerDb, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+		}
+		job->ok = ok;
+
+		g_async_queue_push(self->m_writeDoneQueue, job);
+		g_idle_add_full(G_PRIORITY_DEFAULT, cbWritesDone, self, NULL);
+	}
+
+	sqlite3_finalize(statement);
+	return 0;
+}
+
+std::string PrefsDb::defaultsFingerprint()
+{
+	const char* files[] = {
+		s_defaultPrefsFile,
+		s_defaultPlatformPrefsFile,
+		s_custCareNumberFile,
+		s_customizationOverridePrefsFile
+	};
+
+	JObject fingerprint;
+	for (const char* file: files) {
+		gchar* contents = 0;
+		gsize length = 0;
+		std::string digest;
+
+		if (g_file_get_contents(file, &contents, &length, NULL)) {
+			Utils::gstring checksum = g_compute_checksum_for_data(G_CHECKSUM_SHA1, (const guchar*) contents, length);
+			digest = checksum.get();
+			g_free(contents);
+		}
+		fingerprint.put(file, digest);
+	}
+
+	return fingerprint.stringify();
+}
+
+void PrefsDb::renewEpoch()
+{
+	Utils::gstring epoch = g_strdup_printf("%08x%08x", g_random_int(), g_random_int());
+	m_epoch = epoch.get();
+	if (!setPref(s_epochKey, m_epoch))
+		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to store the revision epoch");
+}
+
+bool PrefsDb::synchronizeDefaults() {
 
 	JValue root = JDomParser::fromFile(s_defaultPrefsFile);
 	if (!root.isObject()) {
 		PmLogWarning(sysServiceLogContext(),"LOAD_JSON_FAILED",0,"Failed to load json from the default prefs file: %s . %s",s_defaultPrefsFile,root.errorString().c_str());
-		return;
+		return true;
 	}
 
 	JValue prefs = root["preferences"];
 	if (!prefs.isObject()) {
 		PmLogWarning(sysServiceLogContext(), "INVALID_PREFERENCES", 0, "Failed to get valid preferences entry from file");
-		return;
+		return true;
 	}
 
+	if (!beginBatch())
+		return false;
+
 	for (JValue::KeyValue pref: prefs.children()) {
 		std::string p_cDbv = pref.second.stringify();
 
@@ -613,33 +2728,39 @@ void PrefsDb::synchronizeDefaults() {
 		std::string cv = getPref(key);
 
 		//allow special keys to be overriden
-		if ((cv.length() == 0) || ((strncmp(key.c_str(),".sysservice",11) == 0))) {
+		if ((cv.length() == 0) || ((strncmp(key.c_str(),".sysservice",11) == 0) && (cv != p_cDbv))) {
 
-			Utils::gstring queryStr = g_strdup_printf("INSERT INTO Preferences "
-													  "VALUES ('%s', '%s')",
-													  key.c_str(), p_cDbv.c_str());
-
-			if (sqlite3_exec(m_prefsDb, queryStr.get(), NULL, NULL, NULL)) {
-				PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to execute query: %s",queryStr.get());
+			if (!setPref(key, p_cDbv)) {
+				rollbackBatch();
+				return false;
 			}
 		}
 	}
+
+	if (!commitBatch()) {
+		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to commit defaults from %s", s_defaultPrefsFile);
+		return false;
+	}
+	return true;
 }
 
-void PrefsDb::synchronizePlatformDefaults() {
+bool PrefsDb::synchronizePlatformDefaults() {
 
 	JValue root = JDomParser::fromFile(s_defaultPlatformPrefsFile);
 	if (!root.isObject()) {
 		PmLogWarning(sysServiceLogContext(),"LOAD_JSON_FAILED",0,"Failed to load json from the default platform prefs file: %s",s_defaultPlatformPrefsFile);
-		return;
+		return true;
 	}
 
 	JValue prefs = root["preferences"];
 	if (!prefs.isObject()) {
 		PmLogWarning(sysServiceLogContext(), "INVALID_PREFERENCES", 0, "Failed to get valid preferences entry from file");
-		return;
+		return true;
 	}
 
+	if (!beginBatch())
+		return false;
+
 	for (const JValue::KeyValue pref: prefs.children()) {
 
 		if (!pref.second.isString())
@@ -653,31 +2774,37 @@ void PrefsDb::synchronizePlatformDefaults() {
 
 		if (cv.length() == 0) {
 
-			Utils::gstring queryStr = g_strdup_printf("INSERT INTO Preferences "
-													  "VALUES ('%s', '%s')",
-													  key.c_str(), p_cDbv.c_str());
-
-			if (sqlite3_exec(m_prefsDb, queryStr.get(), NULL, NULL, NULL)) {
-				PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to execute query:%s",queryStr.get());
+			if (!setPref(key, p_cDbv)) {
+				rollbackBatch();
+				return false;
 			}
 		}
 	}
+
+	if (!commitBatch()) {
+		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to commit platform defaults from %s", s_defaultPlatformPrefsFile);
+		return false;
+	}
+	return true;
 }
 
-void PrefsDb::synchronizeCustomerCareInfo() {
+bool PrefsDb::synchronizeCustomerCareInfo() {
 
 	JValue root = JDomParser::fromFile(s_custCareNumberFile);
 	if (!root.isObject()) {
 		PmLogWarning(sysServiceLogContext(), "LOAD_JSON_ERROR", 0, "Failed to load json from the customer care file: %s", s_custCareNumberFile);
-		return;
+		return true;
 	}
 
 	JValue prefs = root["preferences"];
 	if (!prefs.isObject()) {
 		PmLogWarning(sysServiceLogContext(), "INVALID_PREFERENCES", 0, "Failed to get valid preferences entry from file");
-		return;
+		return true;
 	}
 
+	if (!beginBatch())
+		return false;
+
 	for (const JValue::KeyValue pref: prefs.children()) {
 
 		if (!pref.second.isString())
@@ -687,52 +2814,64 @@ void PrefsDb::synchronizeCustomerCareInfo() {
 
 		//check the key to see if it exists in the db already
 		std::string key = pref.first.asString();
-		std::string cv = getPref(key);
-
-		if (cv.length() == 0) {
-			Utils::gstring queryStr = g_strdup_printf("INSERT INTO Preferences "
-											  "VALUES ('%s', '%s')",
-											  key.c_str(), p_cDbv.c_str());
+		std::string cv;
 
-			if (sqlite3_exec(m_prefsDb, queryStr.get(), NULL, NULL, NULL)) {
-				PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to execute query: %s", queryStr.get());
+		if (!getPref(key, cv) || cv != p_cDbv) {
+			//insert or update
+			if (!setPref(key, p_cDbv)) {
+				rollbackBatch();
+				return false;
 			}
 		}
-		else if (cv != p_cDbv) {
-			//update
-			setPref(key.c_str(), p_cDbv.c_str());
-		}
 	}
+
+	if (!commitBatch()) {
+		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to commit customer care info from %s", s_custCareNumberFile);
+		return false;
+	}
+	return true;
 }
 
-void PrefsDb::updateWithCustomizationPrefOverrides() {
+bool PrefsDb::updateWithCustomizationPrefOverrides() {
 
 	JValue root = JDomParser::fromFile(s_customizationOverridePrefsFile);
 	if (!root.isObject()) {
 		PmLogWarning(sysServiceLogContext(), "LOAD_JSON_FAILED", 0, "Failed to load json from the customization's prefs override file:%s", s_customizationOverridePrefsFile);
-		return;
+		return true;
 	}
 
 	JValue prefs = root["preferences"];
 	if (!prefs.isObject()) {
 		PmLogWarning(sysServiceLogContext(), "INVALID_PREFERENCES", 0, "Failed to get valid preferences entry from file");
-		return;
+		return true;
 	}
 
+	if (!beginBatch())
+		return false;
+
 	for (const JValue::KeyValue pref: prefs.children()) {
 
 		if (!pref.second.isString())
 			continue; //TODO: really should delete this key if it is in the database
 
-		Utils::gstring queryStr = g_strdup_printf("INSERT INTO Preferences "
-										  "VALUES ('%s', '%s')",
-										  pref.first.asString().c_str(),
-										  pref.second.asString().c_str());
+		std::string key = pref.first.asString();
+		std::string value = pref.second.asString();
+		std::string cv;
+
+		if (getPref(key, cv) && cv == value)
+			continue;
 
-		if (sqlite3_exec(m_prefsDb, queryStr.get(), NULL, NULL, NULL)) {
-			PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to execute query: %s", queryStr.get());
+		if (!setPref(key, value)) {
+			rollbackBatch();
+			return false;
 		}
 	}
+
+	if (!commitBatch()) {
+		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to commit customization overrides from %s", s_customizationOverridePrefsFile);
+		return false;
+	}
+	return true;
 }
 
 static const char* s_DEFAULT_uaString[] =	{"uaString","\"GenericPalmModel\""};
@@ -758,7 +2897,7 @@ void PrefsDb::loadDefaultPrefs() {
 
 		for (const JValue::KeyValue pref: prefs.children()) {
 
-			queryStr = g_strdup_printf("INSERT INTO Preferences "
+			queryStr = g_strdup_printf("INSERT INTO Preferences (key, value) "
 									   "VALUES ('%s', '%s')",
 									   pref.first.asString().c_str(),
 									   pref.second.asString().c_str());
@@ -772,7 +2911,7 @@ void PrefsDb::loadDefaultPrefs() {
 Stage1a:
 	// ----------------- Load in the db tokens that let the system service know what restore stage the system is in (after reformats, etc)
 
-	queryStr = g_strdup_printf("INSERT INTO Preferences "
+	queryStr = g_strdup_printf("INSERT INTO Preferences (key, value) "
 							   "VALUES ('%s', '%s')",
 							   s_DBNEWTOKEN[0],s_DBNEWTOKEN[1]);
 
@@ -791,7 +2930,7 @@ Stage1a:
 
 		if (!pref.second.isString()) continue;
 
-		queryStr = g_strdup_printf("INSERT INTO Preferences "
+		queryStr = g_strdup_printf("INSERT INTO Preferences (key, value) "
 								   "VALUES ('%s', '%s')",
 								   pref.first.asString().c_str(),
 								   pref.second.asString().c_str());
@@ -805,7 +2944,7 @@ Stage1a:
 	}
 
 Stage3:
-	queryStr = g_strdup_printf("INSERT INTO Preferences "
+	queryStr = g_strdup_printf("INSERT INTO Preferences (key, value) "
 							   "VALUES ('%s', '%s')",
 							   s_DEFAULT_uaProf[0],s_DEFAULT_uaProf[1]);
 
@@ -814,7 +2953,7 @@ Stage3:
 		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "[Stage 3] Failed to execute query: %s" , queryStr.get());
 	}
 
-	queryStr = g_strdup_printf("INSERT INTO Preferences "
+	queryStr = g_strdup_printf("INSERT INTO Preferences (key, value) "
 							   "VALUES ('%s', '%s')",
 							   s_DEFAULT_uaString[0],s_DEFAULT_uaString[1]);
 
@@ -847,7 +2986,7 @@ void PrefsDb::loadDefaultPlatformPrefs() {
 
 		for (const JValue::KeyValue pref: prefs.children()) {
 
-			Utils::gstring queryStr = g_strdup_printf("INSERT INTO Preferences "
+			Utils::gstring queryStr = g_strdup_printf("INSERT INTO Preferences (key, value) "
 											  "VALUES ('%s', '%s')",
 											  pref.first.asString().c_str(),
 											  pref.second.asString().c_str());
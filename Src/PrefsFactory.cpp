@@ -24,7 +24,10 @@
 #include <iterator>
 #include <algorithm>
 #include <map>
+#include <set>
+#include <vector>
 #include <luna-service2++/error.hpp>
+#include <sqlite3.h>
 
 #include "ErrorException.h"
 #include "LocalePrefsHandler.h"
@@ -37,18 +40,38 @@
 
 #include "UrlRep.h"
 #include "JSONUtils.h"
+#include "Settings.h"
 
 using namespace pbnjson;
 
 static const char* s_logChannel = "PrefsFactory";
 
+// room for the replies to popular key sets and a few timezone lists
+static const size_t s_replyCacheMaxBytes = 1024 * 1024;
+
+static std::string prefixSubscriptionKey(const std::string& prefix)
+{
+	return std::string("getPreferencesByPrefix:") + prefix;
+}
+
+static std::string rateLimitedSubscriptionKey(const std::string& key, int intervalMs)
+{
+	return std::string("getPreferences/") + std::to_string(intervalMs) + ":" + key;
+}
+
 static bool cbSetPreferences(LSHandle* lsHandle, LSMessage* message,
 							 void* user_data);
 static bool cbGetPreferences(LSHandle* lsHandle, LSMessage* message,
 							 void* user_data);
 static bool cbGetPreferenceValues(LSHandle* lsHandle, LSMessage* message,
 								  void* user_data);
+static bool cbGetPreferencesByPrefix(LSHandle* lsHandle, LSMessage* message,
+									 void* user_data);
 static bool cbSwInfo(LSHandle* lsHandle, LSMessage* message, void* user_data);
+static bool cbGetIntegrityStatus(LSHandle* lsHandle, LSMessage* message, void* user_data);
+static bool cbGetWriteStats(LSHandle* lsHandle, LSMessage* message, void* user_data);
+static bool cbGetNotificationStats(LSHandle* lsHandle, LSMessage* message, void* user_data);
+static bool cbGetReplyCacheStats(LSHandle* lsHandle, LSMessage* message, void* user_data);
 
 /*!
  * \page com_palm_systemservice Service API com.webos.service.systemservice/
@@ -57,12 +80,20 @@ static bool cbSwInfo(LSHandle* lsHandle, LSMessage* message, void* user_data);
  * - \ref com_palm_systemservice_set_preferences
  * - \ref com_palm_systemservice_get_preferences
  * - \ref com_palm_systemservice_get_preference_values
+ * - \ref com_palm_systemservice_get_preferences_by_prefix
+ *
+ * Private methods:
+ * - \ref com_palm_systemservice_prefsdb_get_integrity_status
+ * - \ref com_palm_systemservice_prefsdb_get_write_stats
+ * - \ref com_palm_systemservice_prefsdb_get_notification_stats
+ * - \ref com_palm_systemservice_prefsdb_get_reply_cache_stats
  */
 
 static LSMethod s_methods[] = {
 	{ "setPreferences", cbSetPreferences },
 	{ "getPreferences", cbGetPreferences },
 	{ "getPreferenceValues", cbGetPreferenceValues },
+	{ "getPreferencesByPrefix", cbGetPreferencesByPrefix },
 	{ 0, 0 }
 };
 
@@ -71,10 +102,31 @@ static LSMethod q_methods[] = {
 	{ 0,0}
 };
 
+static LSMethod s_prefsDbMethods[] = {
+	{ "getIntegrityStatus", cbGetIntegrityStatus },
+	{ "getWriteStats", cbGetWriteStats },
+	{ "getNotificationStats", cbGetNotificationStats },
+	{ "getReplyCacheStats", cbGetReplyCacheStats },
+	{ 0, 0 }
+};
+
 PrefsFactory::PrefsFactory()
 	: m_serviceHandle(nullptr)
+	, m_retiredDelivered(0)
+	, m_retiredCollapsed(0)
+	, m_replyCache(s_replyCacheMaxBytes)
 {
-	PrefsDb::instance();
+	PrefsDb::instance()->setChangeListener([this](const std::string& key) { m_replyCache.invalidate(key); });
+
+	for (const std::string& limit : Settings::instance()->m_notifyRateLimits) {
+		size_t colon = limit.rfind(':');
+		int intervalMs = (colon == std::string::npos) ? 0 : atoi(limit.c_str() + colon + 1);
+		if (colon == 0 || intervalMs <= 0) {
+			PmLogWarning(sysServiceLogContext(), "BAD_RATE_LIMIT", 0, "Ignoring rate limit [%s], expected key:milliseconds", limit.c_str());
+			continue;
+		}
+		m_rateLimits[limit.substr(0, colon)] = intervalMs;
+	}
 }
 
 std::string exec(std::string command)
@@ -114,6 +166,12 @@ void PrefsFactory::setServiceHandle(LSHandle* serviceHandle)
 		return;
 	}
 
+	if (!LSRegisterCategory(serviceHandle, "/prefsDb", s_prefsDbMethods, nullptr, nullptr, error))
+	{
+		PmLogCritical(sysServiceLogContext(), "FAILED_TO_REGISTER", 0, "Failed to register methods:%s", error.what());
+		return;
+	}
+
 	// Now we can create all the prefs handlers
 	registerPrefHandler(std::make_shared<LocalePrefsHandler>(serviceHandle));
 	registerPrefHandler(std::make_shared<TimePrefsHandler>(serviceHandle));
@@ -141,94 +199,392 @@ void PrefsFactory::registerPrefHandler(const PrefsHandlerPtr& handler)
 
 void PrefsFactory::postPrefChange(const std::string& keyStr,const std::string& valueStr)
 {
-	LSSubscriptionIter *iter=NULL;
-	LSError lserror;
-	LSHandle * lsHandle;
+	if (!hasSubscribers(keyStr))
+		return;
 
-	LSErrorInit(&lserror);
+	JsonWriter reply(keyStr.size() + valueStr.size() + 8);
+	reply.beginObject().key(keyStr).raw(valueStr).endObject();
+
+	notifySubscribers(keyStr, std::make_shared<const std::string>(reply.release()));
+}
 
-	std::string reply = std::string("{ \"")+keyStr+std::string("\":")+valueStr+std::string("}");
+void PrefsFactory::postPrefChangeValueIsCompleteString(const std::string& keyStr,const std::string& json_string)
+{
+	if (!hasSubscribers(keyStr))
+		return;
+
+	//**DEBUG validate for correct UTF-8 output
+	if (!g_utf8_validate (json_string.c_str(), -1, NULL))
+	{
+		PmLogWarning(sysServiceLogContext(), "BUS_REPLY_FAIL", 0,  "bus reply fails UTF-8 validity check! [%s]", json_string.c_str());
+	}
 
-	bool retVal = LSSubscriptionAcquire(m_serviceHandle, keyStr.c_str(), &iter, &lserror);
-	if (retVal) {
-		lsHandle = m_serviceHandle;
-		while (LSSubscriptionHasNext(iter)) {
+	notifySubscribers(keyStr, std::make_shared<const std::string>(json_string));
+}
 
-			LSMessage *message = LSSubscriptionNext(iter);
-			if (!LSMessageReply(lsHandle,message,reply.c_str(),&lserror)) {
-				LSErrorPrint(&lserror,stderr);
-				LSErrorFree(&lserror);
+void PrefsFactory::subscriberAdded(const std::string& subscriptionKey)
+{
+	++m_subscriberCounts[subscriptionKey];
+}
+
+unsigned int PrefsFactory::subscriberCount(const std::string& subscriptionKey)
+{
+	auto it = m_subscriberCounts.find(subscriptionKey);
+	if (it == m_subscriberCounts.end())
+		return 0;
+
+	// cancellations are only seen by luna-service, so the count is refreshed from there and
+	// the key forgotten once its last subscriber is gone
+	it->second = LSSubscriptionGetHandleSubscribersCount(m_serviceHandle, subscriptionKey.c_str());
+	if (it->second == 0) {
+		m_subscriberCounts.erase(it);
+		return 0;
+	}
+	return it->second;
+}
+
+bool PrefsFactory::hasSubscribers(const std::string& keyStr)
+{
+	if (subscriberCount(keyStr) > 0)
+		return true;
+
+	auto limited = m_rateLimitedSubscriptions.find(keyStr);
+	if (limited != m_rateLimitedSubscriptions.end()) {
+		std::set<int>& intervals = limited->second;
+		bool subscribed = false;
+		for (auto it = intervals.begin(); it != intervals.end(); ) {
+			std::string subscriptionKey = rateLimitedSubscriptionKey(keyStr, *it);
+			if (subscriberCount(subscriptionKey) > 0) {
+				subscribed = true;
+				++it;
+				continue;
 			}
+
+			// nobody left at this pace: forget it along with any update still waiting
+			auto throttled = m_throttledKeys.find(subscriptionKey);
+			if (throttled != m_throttledKeys.end())
+				forgetThrottledKey(throttled);
+			it = intervals.erase(it);
 		}
 
-		LSSubscriptionRelease(iter);
+		if (intervals.empty())
+			m_rateLimitedSubscriptions.erase(limited);
+		if (subscribed)
+			return true;
 	}
-	else {
-		LSErrorFree(&lserror);
+
+	return !prefixSubscriptionsOf(keyStr).empty();
+}
+
+std::list<std::string> PrefsFactory::prefixSubscriptionsOf(const std::string& keyStr)
+{
+	std::list<std::string> subscriptionKeys;
+	if (m_prefixSubscriptions.empty())
+		return subscriptionKeys;
+
+	for (const std::string& prefix : m_prefixSubscriptions.matches(keyStr)) {
+		std::string subscriptionKey = prefixSubscriptionKey(prefix);
+		if (subscriberCount(subscriptionKey) == 0)
+			m_prefixSubscriptions.erase(prefix);
+		else
+			subscriptionKeys.push_back(subscriptionKey);
 	}
+	return subscriptionKeys;
+}
+
+int PrefsFactory::rateLimit(const std::string& keyStr) const
+{
+	auto it = m_rateLimits.find(keyStr);
+	int intervalMs = (it != m_rateLimits.end()) ? it->second : 0;
 
+	// coalesced keys aren't announced faster than they are stored
+	if (PrefsDb::instance()->isCoalescedKey(keyStr))
+		intervalMs = std::max(intervalMs, Settings::instance()->m_prefsDbCoalesceWindowMs);
 
+	return intervalMs;
 }
 
-void PrefsFactory::postPrefChangeValueIsCompleteString(const std::string& keyStr,const std::string& json_string)
+void PrefsFactory::notifySubscribers(const std::string& keyStr, const ReplyPtr& reply)
 {
-	LSSubscriptionIter *iter=NULL;
-	LSError lserror;
-	LSHandle * lsHandle;
+	int intervalMs = rateLimit(keyStr);
+	if (!intervalMs || !deferNotification(keyStr, keyStr, intervalMs, reply))
+		deliverToSubscribers(keyStr, *reply);
 
-	LSErrorInit(&lserror);
-	//std::string reply = std::string("{ \"")+keyStr+std::string("\":")+valueStr+std::string("}");
-	const std::string reply = json_string;
-	//**DEBUG validate for correct UTF-8 output
-	if (!g_utf8_validate (reply.c_str(), -1, NULL))
-	{
-		PmLogWarning(sysServiceLogContext(), "BUS_REPLY_FAIL", 0,  "bus reply fails UTF-8 validity check! [%s]", reply.c_str());
+	notifyRateLimitedSubscribers(keyStr, reply);
+}
+
+void PrefsFactory::notifyRateLimitedSubscribers(const std::string& keyStr, const ReplyPtr& reply)
+{
+	auto limited = m_rateLimitedSubscriptions.find(keyStr);
+	if (limited == m_rateLimitedSubscriptions.end())
+		return;
+
+	for (int intervalMs : limited->second) {
+		std::string subscriptionKey = rateLimitedSubscriptionKey(keyStr, intervalMs);
+		if (!deferNotification(subscriptionKey, keyStr, intervalMs, reply))
+			replyToSubscribers(subscriptionKey, *reply);
 	}
+}
 
-	bool retVal = LSSubscriptionAcquire(m_serviceHandle, keyStr.c_str(), &iter, &lserror);
-	if (retVal) {
-		lsHandle = m_serviceHandle;
-		while (LSSubscriptionHasNext(iter)) {
+bool PrefsFactory::deferNotification(const std::string& subscriptionKey, const std::string& keyStr, int intervalMs,
+									 const ReplyPtr& reply)
+{
+	auto it = m_throttledKeys.find(subscriptionKey);
+	if (it == m_throttledKeys.end()) {
+		// this one goes out now, the ones coming in during the next interval wait for its end
+		m_throttledKeys[subscriptionKey] = ThrottledKey{keyStr, intervalMs, scheduleDeferredNotification(subscriptionKey, intervalMs),
+														ReplyPtr(), 1, 0};
+		return false;
+	}
 
-			LSMessage *message = LSSubscriptionNext(iter);
-			if (!LSMessageReply(lsHandle,message,reply.c_str(),&lserror)) {
-				LSErrorPrint(&lserror,stderr);
-				LSErrorFree(&lserror);
-			}
-		}
+	// the update sent at the end of this interval carries this value
+	ThrottledKey& state = it->second;
+	state.intervalMs = intervalMs;
+	if (state.reply)
+		++state.collapsed;
+	state.reply = reply;
+	return true;
+}
 
-		LSSubscriptionRelease(iter);
+guint PrefsFactory::scheduleDeferredNotification(const std::string& subscriptionKey, int intervalMs)
+{
+	return g_timeout_add_full(G_PRIORITY_DEFAULT, intervalMs, cbDeferredNotification,
+							  new std::string(subscriptionKey), [](gpointer data) { delete static_cast<std::string*>(data); });
+}
+
+void PrefsFactory::forgetThrottledKey(std::map<std::string, ThrottledKey>::iterator it)
+{
+	if (it->second.source)
+		g_source_remove(it->second.source);
+	m_retiredDelivered += it->second.delivered;
+	m_retiredCollapsed += it->second.collapsed;
+	m_throttledKeys.erase(it);
+}
+
+gboolean PrefsFactory::cbDeferredNotification(gpointer data)
+{
+	const std::string& subscriptionKey = *static_cast<std::string*>(data);
+	PrefsFactory* self = PrefsFactory::instance();
+
+	auto it = self->m_throttledKeys.find(subscriptionKey);
+	if (it == self->m_throttledKeys.end())
+		return G_SOURCE_REMOVE;
+
+	ThrottledKey& state = it->second;
+	state.source = 0;
+	if (!state.reply) {
+		// a whole interval without updates: the next one can go out right away
+		self->forgetThrottledKey(it);
+		return G_SOURCE_REMOVE;
+	}
+
+	ReplyPtr reply;
+	reply.swap(state.reply);
+	++state.delivered;
+	state.source = scheduleDeferredNotification(subscriptionKey, state.intervalMs);
+
+	// delivering can drop subscriptions and with them this entry
+	std::string key = state.key;
+	if (subscriptionKey == key)
+		self->deliverToSubscribers(key, *reply);
+	else
+		self->replyToSubscribers(subscriptionKey, *reply);
+
+	return G_SOURCE_REMOVE;
+}
+
+bool PrefsFactory::subscribeRateLimited(LSHandle* lsHandle, LSMessage* message, const std::string& keyStr, int intervalMs)
+{
+	// everybody gets the key's own pace anyway, asking for less is a plain subscription
+	bool slower = intervalMs > rateLimit(keyStr);
+	std::string subscriptionKey = slower ? rateLimitedSubscriptionKey(keyStr, intervalMs) : keyStr;
+
+	LS::Error error;
+	if (!LSSubscriptionAdd(lsHandle, subscriptionKey.c_str(), message, error))
+		return false;
+
+	subscriberAdded(subscriptionKey);
+	if (slower)
+		m_rateLimitedSubscriptions[keyStr].insert(intervalMs);
+	return true;
+}
+
+std::list<PrefsFactory::RateLimitStats> PrefsFactory::rateLimitStats()
+{
+	std::list<RateLimitStats> stats;
+	for (const auto& throttled : m_throttledKeys) {
+		const ThrottledKey& state = throttled.second;
+		stats.push_back(RateLimitStats{state.key, state.intervalMs, subscriberCount(throttled.first),
+									   state.delivered, state.collapsed});
+	}
+	return stats;
+}
 
+void PrefsFactory::rateLimitTotals(uint64_t& r_delivered, uint64_t& r_collapsed) const
+{
+	r_delivered = m_retiredDelivered;
+	r_collapsed = m_retiredCollapsed;
+	for (const auto& throttled : m_throttledKeys) {
+		r_delivered += throttled.second.delivered;
+		r_collapsed += throttled.second.collapsed;
 	}
-	else  {
+}
+
+bool PrefsFactory::subscribeToPrefix(LSHandle* lsHandle, LSMessage* message, const std::string& prefix)
+{
+	std::string subscriptionKey = prefixSubscriptionKey(prefix);
+	LS::Error error;
+	if (!LSSubscriptionAdd(lsHandle, subscriptionKey.c_str(), message, error))
+		return false;
+
+	subscriberAdded(subscriptionKey);
+	m_prefixSubscriptions.insert(prefix);
+	return true;
+}
+
+void PrefsFactory::deliverToSubscribers(const std::string& keyStr, const std::string& reply)
+{
+	if (subscriberCount(keyStr) > 0)
+		replyToSubscribers(keyStr, reply);
+
+	// subscribers of every prefix the key falls under get the same update
+	for (const std::string& subscriptionKey : prefixSubscriptionsOf(keyStr))
+		replyToSubscribers(subscriptionKey, reply);
+}
+
+void PrefsFactory::replyToSubscribers(const std::string& subscriptionKey, const std::string& reply)
+{
+	// luna-service fans the one buffer out to every subscriber of the key
+	LSError lserror;
+	LSErrorInit(&lserror);
+
+	if (!LSSubscriptionReply(m_serviceHandle, subscriptionKey.c_str(), reply.c_str(), &lserror)) {
+		PmLogWarning(sysServiceLogContext(), "BUS_REPLY_FAIL", 0, "Can't notify subscribers of %s: %s", subscriptionKey.c_str(), lserror.message);
 		LSErrorFree(&lserror);
 	}
+}
 
+void PrefsFactory::refreshAllKeys(int64_t sinceRevision)
+{
+	//get the keys changed since then from the db
+	refreshKeys(PrefsDb::instance()->getKeysChangedSince(sinceRevision));
 }
 
-void PrefsFactory::refreshAllKeys()
+void PrefsFactory::refreshKeys(const std::list<std::string>& changedKeys)
 {
+	if (changedKeys.empty())
+		return;
 
-	//get all the keys from the db
-	std::map<std::string,std::string> allPrefs = PrefsDb::instance()->getAllPrefs();
+	// the canonical JSON serves both: it is always valid, so each value is parsed once for its
+	// handler, and it goes to subscribers as it is
+	std::map<std::string,std::string> changedJson = PrefsDb::instance()->getPrefsAsJson(changedKeys);
 
-	for (std::map<std::string,std::string>::const_iterator it = allPrefs.begin();
-			it != allPrefs.end(); ++it)
+	// Inform each handler once about all of its changed keys
+	std::map<PrefsHandlerPtr, std::map<std::string,JValue> > handlerBatches;
+	for (const auto& keyjson : changedJson)
 	{
-		//iterate over all the keys in the database
-		std::string key = it->first;
-		std::string val = it->second;
-		auto handler = PrefsFactory::instance()->getPrefsHandler(key);
-		// Inform the handler about the change
+		auto handler = getPrefsHandler(keyjson.first);
 		if (handler)
-		{
-			handler->valueChanged(key, val);
+			handlerBatches[handler].emplace(keyjson.first, JDomParser::fromString(keyjson.second));
+	}
+	for (const auto& batch : handlerBatches)
+		batch.first->valuesChanged(batch.second);
+
+	//post change about the ones somebody listens to
+	for (auto it = changedJson.begin(); it != changedJson.end(); ) {
+		if (hasSubscribers(it->first))
+			++it;
+		else
+			it = changedJson.erase(it);
+	}
+	if (!changedJson.empty())
+		postPrefChanges(changedJson);
+}
+
+void PrefsFactory::collectSubscribers(const std::string& subscriptionKey, const std::string& key,
+									  std::map<LSMessage*, std::list<std::string> >& r_updates)
+{
+	LSSubscriptionIter *iter=NULL;
+	LS::Error error;
+
+	if (subscriberCount(subscriptionKey) == 0)
+		return;
+
+	if (!LSSubscriptionAcquire(m_serviceHandle, subscriptionKey.c_str(), &iter, error))
+		return;
+
+	while (LSSubscriptionHasNext(iter)) {
+		LSMessage *message = LSSubscriptionNext(iter);
+		std::list<std::string>& keys = r_updates[message];
+		// a message subscribed through both a key and a prefix still gets the key only once
+		if (keys.empty() || keys.back() != key)
+			keys.push_back(key);
+	}
+
+	LSSubscriptionRelease(iter);
+}
+
+void PrefsFactory::postPrefChanges(const std::map<std::string,std::string>& changedJson)
+{
+	std::map<LSMessage*, std::list<std::string> > updates;
+
+	for (const auto& keyjson : changedJson) {
+		const std::string& key = keyjson.first;
+		if (!hasSubscribers(key))
+			continue;
+
+		// a lone key reaches everybody through the same message, and rate limited keys keep
+		// their own pace
+		bool alone = (changedJson.size() == 1 || rateLimit(key) > 0);
+		if (alone || m_rateLimitedSubscriptions.count(key)) {
+			JsonWriter writer(key.size() + keyjson.second.size() + 8);
+			writer.beginObject().key(key).raw(keyjson.second).endObject();
+			ReplyPtr reply = std::make_shared<const std::string>(writer.release());
+			if (alone) {
+				notifySubscribers(key, reply);
+				continue;
+			}
+			notifyRateLimitedSubscribers(key, reply);
 		}
 
-		//post change about it
-		postPrefChange(key,val);
+		collectSubscribers(key, key, updates);
+
+		for (const std::string& subscriptionKey : prefixSubscriptionsOf(key))
+			collectSubscribers(subscriptionKey, key, updates);
 	}
 
+	// one update per subscriber carrying all of its keys that changed; subscribers of the
+	// same keys share the serialized reply
+	std::map<std::list<std::string>, std::string> replies;
+	JsonWriter writer;
+	for (const auto& update : updates) {
+		auto inserted = replies.emplace(update.second, std::string());
+		std::string& reply = inserted.first->second;
+		if (inserted.second) {
+			writer.beginObject();
+			for (const std::string& key : update.second)
+				writer.key(key).raw(changedJson.at(key));
+			writer.endObject();
+			reply = writer.release();
+		}
+
+		LS::Error error;
+		if (!LSMessageReply(m_serviceHandle, update.first, reply.c_str(), error)) {
+			PmLogWarning(sysServiceLogContext(), "BUS_REPLY_FAIL", 0, "Can't send changed keys to subscriber: %s", error.what());
+		}
+	}
+}
+
+bool PrefsFactory::isPrefConsistent(const std::string& key, const PrefsHandlerPtr& handler)
+{
+	if (m_consistencyCache.isConsistent(key))
+		return true;
+
+	if (!handler->isPrefConsistent())
+		return false;
+
+	m_consistencyCache.setConsistent(key, PrefsDb::instance()->getPref(key), handler->consistencyFiles());
+	return true;
 }
 
 void PrefsFactory::runConsistencyChecksOnAllHandlers()
@@ -240,7 +596,7 @@ void PrefsFactory::runConsistencyChecksOnAllHandlers()
 		auto handler = it->second;
 		if (handler) {
 			//run the verifier on this key to make sure the pref is correct
-			if (handler->isPrefConsistent() == false) {
+			if (isPrefConsistent(key, handler) == false) {
 				PmLogWarning(sysServiceLogContext(), "INCONSISTENCY_KEY", 0,"reports inconsistency with key [%s].Restoring default...", key.c_str());
 				handler->restoreToDefault();		//something is wrong with this...try and restore it
 				std::string restoreVal = PrefsDb::instance()->getPref(key);
@@ -275,12 +631,14 @@ Sets preference keys to specified values.
 \code
 {
 	"returnValue": boolean,
-	"errorText": string
+	"errorText": string,
+	"failedKeys": object
 }
 \endcode
 
 \param returnValue Indicates if the call was succesful.
 \param errorText Description of the error if call was not succesful.
+\param failedKeys Maps each key that was not saved to the reason. Keys that pass validation are written in a single transaction, so if one of them cannot be written none of them are saved.
 
 \subsection com_palm_systemservice_set_preferences_examples Examples:
 \code
@@ -302,20 +660,85 @@ Example response for a failed call:
 }
 \endcode
 */
+// a setPreferences call waiting for its transaction to be written
+struct PendingSetPreferences
+{
+	LSHandle* lsHandle;
+	LSMessage* message;
+	std::vector<PrefValue> savedPrefs;
+	JObject failedKeys;
+	int errcount;
+	std::set<std::string> unchangedKeys;	// set to the value they had, nothing to announce
+};
+
+static void replySetPreferences(LSHandle* lsHandle, LSMessage* message, bool success,
+								const std::string& errorText, JObject& failedKeys)
+{
+	JObject result {{"returnValue", success}};
+	if (!success) {
+		result.put("errorText", errorText);
+		if (failedKeys.objectSize() > 0)
+			result.put("failedKeys", failedKeys);
+		PmLogWarning(sysServiceLogContext(), "ERROR_MESSAGE", 0, "error: %s", errorText.c_str());
+	}
+
+	LS::Error error;
+	(void) LSMessageReply(lsHandle, message, result.stringify().c_str(), error);
+}
+
+static void cbPreferencesSaved(bool committed, gpointer userData)
+{
+	std::unique_ptr<PendingSetPreferences> pending(static_cast<PendingSetPreferences*>(userData));
+	int savecount = 0;
+
+	// all or nothing: if the transaction failed, none of the validated keys are kept
+	if (!committed) {
+		for (const PrefValue& pref: pending->savedPrefs) {
+			++pending->errcount;
+			pending->failedKeys.put(pref.key, "could not be saved");
+		}
+		pending->savedPrefs.clear();
+	}
+
+	// subscribers get one update per transaction with all of their keys that changed, unless
+	// they already have the values. The stored serialization is theirs, nothing else needs it
+	std::map<std::string, std::string> changedJson;
+	for (PrefValue& pref: pending->savedPrefs) {
+		if (pending->unchangedKeys.find(pref.key) == pending->unchangedKeys.end()
+			&& PrefsFactory::instance()->hasSubscribers(pref.key)) {
+			changedJson[pref.key] = std::move(pref.json);
+		}
+	}
+	PrefsFactory::instance()->postPrefChanges(changedJson);
+
+	for (const PrefValue& pref: pending->savedPrefs) {
+		++savecount;
+
+		// Inform the handler about the change (handlers may act on a repeated value)
+		auto handler = PrefsFactory::instance()->getPrefsHandler(pref.key);
+		if (handler)
+			handler->valueChanged(pref.key, pref.value);
+	}
+
+	PmLogDebug(sysServiceLogContext(),"setPreferences saved %d, failed %d", savecount, pending->errcount);
+
+	bool success = (pending->errcount == 0);
+	replySetPreferences(pending->lsHandle, pending->message, success,
+						success ? std::string() : std::string("Some settings could not be saved"), pending->failedKeys);
+	LSMessageUnref(pending->message);
+}
+
 static bool cbSetPreferences(LSHandle* lsHandle, LSMessage* message,
 							 void* user_data)
 {
-	bool success = true;
 	std::string errorText;
-	int savecount=0;
-	int errcount=0;
 	std::string callerId;
+	JObject failedKeys;
 
 	do {
         auto payload = LSMessageGetPayload(message);
 
         if (!payload) {
-            success = false;
             errorText = std::string("Payload get failed, null payload");
             break;
         }
@@ -323,7 +746,6 @@ static bool cbSetPreferences(LSHandle* lsHandle, LSMessage* message,
 		JValue root = JDomParser::fromString(payload);
 		if (!root.isObject())
 		{
-			success = false;
 			errorText = std::string("invalid payload (should be an object)");
 			break;
 		}
@@ -335,66 +757,49 @@ static bool cbSetPreferences(LSHandle* lsHandle, LSMessage* message,
             callerId = "";
         }
 
+		// keys that passed validation, written in one transaction and announced once it is durable;
+		// the reply is sent from cbPreferencesSaved() so other requests are served meanwhile.
+		// Each value is serialized once, after validation, for the database and subscribers alike
+		std::unique_ptr<PendingSetPreferences> pending(new PendingSetPreferences { lsHandle, message, {}, JObject(), 0, {} });
+		pending->savedPrefs.reserve(root.objectSize());
+
 		for (JValue::KeyValue pref: root.children()) {
 			// Is there a preferences handler for this?
-			bool savedPref = false;
+			bool validPref = true;
 
 			std::string key = pref.first.asString();
-			std::string value = pref.second.stringify();
 
 			auto handler = PrefsFactory::instance()->getPrefsHandler(key);
 			if (handler) {
 				PMLOG_TRACE("found handler for %s", key.c_str());
 				if (handler->validate(key, pref.second, callerId)) {
 					PmLogDebug(sysServiceLogContext(),"handler validated value for key [%s]",key.c_str());
-					savedPref = PrefsDb::instance()->setPref(key, value);
 				}
 				else {
 					PmLogWarning(sysServiceLogContext(), "VALIDATE_FAIL", 0, "handler DID NOT validate value for key: %s", key.c_str());
+					validPref = false;
 				}
 			}
 			else {
 				PmLogWarning(sysServiceLogContext(), "HANDLER_NOT_FOUND", 0, "setPref did NOT find handler for: %s", key.c_str());
-
-				//filter out
-				savedPref = PrefsDb::instance()->setPref(key, value);
 			}
-			PmLogDebug(sysServiceLogContext(),"setPref saved? %s",(savedPref ? "true" : "false"));
 
-			if (savedPref) {
-				++savecount;
-
-				// successfully set the preference. post a notification about it
-				JObject json {{key, pref.second}};
-
-				PrefsFactory::instance()->postPrefChangeValueIsCompleteString(key, json.stringify());
-
-				// Inform the handler about the change
-				if (handler)
-					handler->valueChanged(key, pref.second);
-
-				success=true;
+			if (!validPref) {
+				++pending->errcount;
+				pending->failedKeys.put(key, "invalid value");
+				continue;
 			}
-			else {
-				++errcount;
-			}
-		}
 
-		if (errcount) {
-			success=false;
-			errorText=std::string("Some settings could not be saved");
+			pending->savedPrefs.emplace_back(std::move(key), pref.second);
 		}
-	} while (false);
-
-	JObject result {{"returnValue", success}};
-	if (!success) {
-		result.put("errorText", errorText);
-		PmLogWarning(sysServiceLogContext(), "ERROR_MESSAGE", 0, "error: %s", errorText.c_str());
-	}
 
-	LS::Error error;
-	(void) LSMessageReply(lsHandle, message, result.stringify().c_str(), error);
+		LSMessageRef(message);
+		PendingSetPreferences* saving = pending.release();
+		PrefsDb::instance()->setPrefsAsync(saving->savedPrefs, cbPreferencesSaved, saving, &saving->unchangedKeys);
+		return true;
+	} while (false);
 
+	replySetPreferences(lsHandle, message, false, errorText, failedKeys);
 	return true;
 }
 
@@ -465,51 +870,19 @@ static bool cbSwInfo(LSHandle *lsHandle, LSMessage *message, void *)
 	return true;
 }
 
-static bool quotesRequired(const std::string& value)
+static void restoreInconsistentPrefs(const std::list<std::string>& keys)
 {
-	bool isQuotes(true);
-
-	const char* val_str = value.c_str();
-	char* pEnd;
-	double result = strtod(val_str, &pEnd);
-	if (!(abs(result - 0.0) < 0.1)) {
-		isQuotes = false;			// maybe number, will continue check
-		while (*pEnd != '\0') {
-			if (!isspace(*pEnd)) {		// if we have not spaces symbols after number => we have string
-				isQuotes = true;
-				break;
-			}
-			pEnd++;
-		}
-	}
-	else if (val_str != pEnd) {	// check if value == 0.0
-		isQuotes = false;		// number detected
-	}
-
-	if (isQuotes) {
-		switch(value[0]) {
-		case '"':
-			isQuotes = false;
-			break;
-		case 'f':
-			if ("false" == value) {
-				isQuotes = false;
-			}
-			break;
-		case 't':
-			if ("true" == value) {
-				isQuotes = false;
-			}
-			break;
-		case 'n':
-			if ("null" == value) {
-				isQuotes = false;
+	for (const std::string& key_str: keys) {
+		auto handler = PrefsFactory::instance()->getPrefsHandler(key_str);
+		if (handler) {
+			//run the verifier on this key to make sure the pref is correct
+			if (PrefsFactory::instance()->isPrefConsistent(key_str, handler) == false) {
+				handler->restoreToDefault();		//something is wrong with this...try and restore it
+				std::string restoreVal = PrefsDb::instance()->getPref(key_str);
+				PrefsFactory::instance()->postPrefChange(key_str,restoreVal);
 			}
-			break;
 		}
 	}
-
-	return isQuotes;
 }
 
 /*!
@@ -526,23 +899,35 @@ Retrieves the values for keys specified in a passed array. If subscribe is set t
 \subsection com_palm_systemservice_get_preferences_syntax Syntax:
 \code
 {
-	"subscribe" : boolean,
-	"keys"      : string array
+	"subscribe"     : boolean,
+	"keys"          : string array,
+	"wildcard"      : boolean,
+	"sinceRevision" : integer,
+	"epoch"         : string,
+	"minIntervalMs" : integer
 }
 \endcode
 
-\param subscribe If true, getPreferences sends an update whenever the value of one of the keys changes.
+\param subscribe If true, getPreferences sends an update whenever the value of one of the keys changes. Keys changed by one setPreferences call arrive together in a single update.
 \param keys An array of key names. Required.
+\param wildcard If true, a name in keys ending in "*" stands for all keys starting with what comes before it; subscribed, it also covers keys created later. Keys starting with "." are never matched that way. Without it every name is a literal key name, a trailing "*" included. Optional, defaults to false.
+\param sinceRevision Return only the keys that changed after this revision, as returned in "revision" by an earlier call. Pass 0 to get all keys along with the current revision. Optional.
+\param epoch With sinceRevision: the "epoch" returned along with that revision. If the preferences database was recreated or restored since, revisions started over, and all keys are returned as if sinceRevision were 0. Optional, but without it only a sinceRevision higher than the current revision is recognized as such.
+\param minIntervalMs With subscribe: send at most one update per key in this many milliseconds (up to 60000), carrying the latest value; updates in between are dropped. Keys rate limited in sysservice.conf are never sent faster than configured. These updates hold a single key each. Does not apply to wildcard names. Optional.
 
 \subsection com_palm_systemservice_get_preferences_returns Returns:
 \code
 {
    "[no name]"   : object,
+   "revision"    : integer,
+   "epoch"       : string,
    "returnValue" : boolean
 }
 \endcode
 
 \param "[no name]" Key-value pairs containing the values for the requested preferences. If the requested preferences key or keys do not exist, the object is empty.
+\param revision Only if sinceRevision was given: the current revision of the preferences database, to pass as sinceRevision next time.
+\param epoch Only if sinceRevision was given: the epoch of that revision, to pass along with it next time.
 \param returnValue Indicates if the call was succesful.
 
 \subsection com_palm_systemservice_get_preferences_examples Examples:
@@ -578,8 +963,13 @@ Example response for a failed call:
 static bool cbGetPreferences(LSHandle* lsHandle, LSMessage* message, void*)
 {
 	// {"subscribe": boolean, "keys": array of strings}
-	LSMessageJsonParser parser(message, STRICT_SCHEMA(PROPS_2(PROPERTY(subscribe, boolean),
-															  R"("keys":{"type": "array", "minItems": 1, "items": {"type":"string"}})")
+	// {"subscribe": boolean, "keys": array of strings, "wildcard": boolean, "sinceRevision": integer, "epoch": string, "minIntervalMs": integer}
+	LSMessageJsonParser parser(message, STRICT_SCHEMA(PROPS_6(PROPERTY(subscribe, boolean),
+															  R"("keys":{"type": "array", "minItems": 1, "items": {"type":"string"}})",
+															  PROPERTY(wildcard, boolean),
+															  R"("sinceRevision":{"type": "integer", "minimum": 0})",
+															  PROPERTY(epoch, string),
+															  R"("minIntervalMs":{"type": "integer", "minimum": 0, "maximum": 60000})")
 													  REQUIRED_1(keys)));
 
 	if (!parser.parse(__FUNCTION__, lsHandle, EValidateAndErrorAlways))
@@ -589,81 +979,210 @@ static bool cbGetPreferences(LSHandle* lsHandle, LSMessage* message, void*)
 
 	bool subscription = false;
 
+	// with "wildcard", "prefix*" stands for every key starting with prefix, now and later;
+	// otherwise a trailing '*' is part of the key name, as it always was
+	bool wildcard = root.hasKey("wildcard") && root["wildcard"].asBool();
 	JValue label = root["keys"];
 	std::list<std::string> keyList;
+	std::list<std::string> prefixList;
 	for (const JValue &key: label.items()) {
-		std::string key_str = key.asString();
-		auto handler = PrefsFactory::instance()->getPrefsHandler(key_str);
-		if (handler) {
-			//run the verifier on this key to make sure the pref is correct
-			if (handler->isPrefConsistent() == false) {
-				handler->restoreToDefault();		//something is wrong with this...try and restore it
-				std::string restoreVal = PrefsDb::instance()->getPref(key_str);
-				PrefsFactory::instance()->postPrefChange(key_str,restoreVal);
-			}
-		}
-		keyList.push_back(key_str);
+		std::string keyStr = key.asString();
+		if (wildcard && keyStr.size() > 1 && keyStr.back() == '*')
+			prefixList.push_back(keyStr.substr(0, keyStr.size() - 1));
+		else
+			keyList.push_back(keyStr);
 	}
 
-	std::map<std::string, std::string> resultMap = PrefsDb::instance()->getPrefs(keyList);
+	std::list<std::string> matchingKeys = keyList;
+	for (const std::string& prefix : prefixList)
+		matchingKeys.splice(matchingKeys.end(), PrefsDb::instance()->getKeysByPrefix(prefix));
+	restoreInconsistentPrefs(matchingKeys);
+
+	bool delta = root.hasKey("sinceRevision");
+	sqlite3_int64 sinceRevision = delta ? root["sinceRevision"].asNumber<int64_t>() : 0;
+	sqlite3_int64 revision = PrefsDb::instance()->currentRevision();
+	const std::string& epoch = PrefsDb::instance()->epoch();
+
+	// a revision from an earlier database: everything may have changed since
+	if (delta && ((root.hasKey("epoch") && root["epoch"].asString() != epoch) || sinceRevision > revision))
+		sinceRevision = 0;
 
 	if (LSMessageIsSubscription(message)) {
 
-		LS::Error tmp_error;
+		int minIntervalMs = root.hasKey("minIntervalMs") ? root["minIntervalMs"].asNumber<int>() : 0;
 		for (std::list<std::string>::const_iterator it = keyList.begin();
 			 it != keyList.end(); ++it) {
-			(void) LSSubscriptionAdd(lsHandle, (*it).c_str(),
-									 message, tmp_error);
+			(void) PrefsFactory::instance()->subscribeRateLimited(lsHandle, message, *it, minIntervalMs);
 		}
+		for (const std::string& prefix : prefixList)
+			(void) PrefsFactory::instance()->subscribeToPrefix(lsHandle, message, prefix);
 		subscription = true;
 	}
 	else
 		subscription = false;
 
-	JObject reply;
-	std::string errorCode;
-	for (std::map<std::string, std::string>::const_iterator it = resultMap.begin();
-		 it != resultMap.end(); ++it) {
-		JValue value = JDomParser::fromString((*it).second);
-		if (value.isValid()) {
-			PmLogDebug(sysServiceLogContext(),"resultMap: [%s] -> [---, length %zu]",(*it).first.c_str(),(*it).second.size());
-			reply.put((*it).first, value);
-		}
-		else {
-			// not JSON, try to work with json primitive (ex. string, number)
-			std::string primitive;
-			if (quotesRequired((*it).second)) {
-				primitive = "[\"" + (*it).second + "\"]";
-			}
-			else {
-				primitive = "[" + (*it).second + "]";
-			}
+	LS::Error error;
 
-			JValue arr = JDomParser::fromString(primitive);
-			if (arr.isValid()) {
-				reply.put((*it).first, arr[0]);
-			}
-			else {
-				errorCode = arr.errorString();
-				break;
-			}
+	// the same key set always gets the same reply until one of the keys changes. Not for deltas
+	// (the reply depends on the revision), wildcards (on which keys exist) or inside a batch
+	bool cacheable = !delta && prefixList.empty() && !PrefsDb::instance()->inBatch();
+	std::string request;
+	if (cacheable) {
+		std::set<std::string> sortedKeys(keyList.begin(), keyList.end());
+		request = subscription ? "getPreferences+" : "getPreferences-";
+		for (const std::string& key : sortedKeys)
+			request += std::to_string(key.size()) + ":" + key;
+
+		const std::string* cached = PrefsFactory::instance()->replyCache().find(request);
+		if (cached) {
+			(void) LSMessageReply(lsHandle, message, cached->c_str(), error);
+			return true;
 		}
 	}
 
-	if (errorCode.empty()) {
-		reply.put("subscribed", subscription);
-		reply.put("returnValue", true);
-	}
-	else {
-		reply = JObject {{"returnValue", false},
-						 {"subscribed", false},
-						 {"errorCode", errorCode}};
+	// values are stored as canonical JSON, so they are spliced into the reply without reparsing
+	std::map<std::string, std::string> resultMap = PrefsDb::instance()->getPrefsAsJson(matchingKeys, sinceRevision);
 
-		PmLogWarning(sysServiceLogContext(), "ERROR_MESSAGE", 0, "error: %s", errorCode.c_str());
+	// handlers run one at a time on the main loop, so one buffer serves every reply
+	static JsonWriter reply;
+	reply.clear();
+	reply.beginObject();
+	for (std::map<std::string, std::string>::const_iterator it = resultMap.begin();
+		 it != resultMap.end(); ++it) {
+		// these are set below and always won over a preference of the same name
+		if ((*it).first == "subscribed" || (*it).first == "returnValue" ||
+			(delta && ((*it).first == "revision" || (*it).first == "epoch")))
+			continue;
+
+		PmLogDebug(sysServiceLogContext(),"resultMap: [%s] -> [---, length %zu]",(*it).first.c_str(),(*it).second.size());
+		reply.key((*it).first).raw((*it).second);
+	}
+	if (delta) {
+		reply.put("revision", revision);
+		reply.put("epoch", epoch);
 	}
+	reply.put("subscribed", subscription);
+	reply.put("returnValue", true);
+	reply.endObject();
+
+	if (cacheable)
+		PrefsFactory::instance()->replyCache().insert(request, keyList, reply.str());
+
+	(void) LSMessageReply(lsHandle, message, reply.c_str(), error);
+
+	return true;
+}
+
+/*!
+\page com_palm_systemservice
+\n
+\section com_palm_systemservice_get_preferences_by_prefix getPreferencesByPrefix
+
+\e Public.
+
+com.webos.service.systemservice/getPreferencesByPrefix
+
+Retrieves the values of all keys that start with the given prefix, in key order. The service's internal keys (those starting with ".") are never listed. Long results can be read in pages by passing a limit and, for every following page, the continuationKey from the previous reply.
+
+\subsection com_palm_systemservice_get_preferences_by_prefix_syntax Syntax:
+\code
+{
+	"prefix"          : string,
+	"limit"           : integer,
+	"continuationKey" : string,
+	"subscribe"       : boolean
+}
+\endcode
+
+\param prefix Key prefix. Required.
+\param limit Maximum number of keys to return. Optional, all keys are returned if not given.
+\param continuationKey Return only keys after this one. Optional.
+\param subscribe If true, getPreferencesByPrefix sends an update whenever a key starting with prefix changes. Updates have the same form as getPreferences updates: the changed keys and their new values.
+
+\subsection com_palm_systemservice_get_preferences_by_prefix_returns Returns:
+\code
+{
+	"prefix"          : string,
+	"preferences"     : object,
+	"continuationKey" : string,
+	"subscribed"      : boolean,
+	"returnValue"     : boolean
+}
+\endcode
+
+\param prefix The requested prefix.
+\param preferences Key-value pairs of the matching preferences. Empty if no key matches.
+\param continuationKey Present only if more keys match than were returned. Pass it in the next call to get the next page.
+\param subscribed True if subscribed to changes.
+\param returnValue Indicates if the call was succesful.
+
+\subsection com_palm_systemservice_get_preferences_by_prefix_examples Examples:
+\code
+luna-send -n 1 -f luna://com.webos.service.systemservice/getPreferencesByPrefix '{"prefix": "time", "limit": 2}'
+\endcode
+
+Example response for a succesful call:
+\code
+{
+	"prefix": "time",
+	"preferences": {
+		"timeChangeLaunch": [],
+		"timeFormat": "HH12"
+	},
+	"continuationKey": "timeFormat",
+	"subscribed": false,
+	"returnValue": true
+}
+\endcode
+*/
+static bool cbGetPreferencesByPrefix(LSHandle* lsHandle, LSMessage* message, void*)
+{
+	// {"prefix": string, "limit": integer, "continuationKey": string, "subscribe": boolean}
+	LSMessageJsonParser parser(message, STRICT_SCHEMA(PROPS_4(R"("prefix":{"type": "string", "minLength": 1})",
+															  R"("limit":{"type": "integer", "minimum": 1})",
+															  PROPERTY(continuationKey, string),
+															  PROPERTY(subscribe, boolean))
+													  REQUIRED_1(prefix)));
+
+	if (!parser.parse(__FUNCTION__, lsHandle, EValidateAndErrorAlways))
+		return true;
+
+	JValue root = parser.get();
+
+	std::string prefix = root["prefix"].asString();
+	std::string continuationKey;
+	size_t limit = 0;
+
+	if (root.hasKey("continuationKey"))
+		continuationKey = root["continuationKey"].asString();
+	if (root.hasKey("limit"))
+		limit = root["limit"].asNumber<int>();
+
+	bool more = false;
+	std::list<std::string> keyList = PrefsDb::instance()->getKeysByPrefix(prefix, continuationKey, limit, &more);
+	restoreInconsistentPrefs(keyList);
+
+	std::map<std::string, std::string> resultMap = PrefsDb::instance()->getPrefsAsJson(keyList);
+
+	bool subscription = false;
+	if (LSMessageIsSubscription(message))
+		subscription = PrefsFactory::instance()->subscribeToPrefix(lsHandle, message, prefix);
+
+	static JsonWriter reply;
+	reply.clear();
+	reply.beginObject().put("prefix", prefix).key("preferences").beginObject();
+	for (std::map<std::string, std::string>::const_iterator it = resultMap.begin();
+		 it != resultMap.end(); ++it)
+		reply.key((*it).first).raw((*it).second);
+	reply.endObject();
+	if (more && !keyList.empty())
+		reply.put("continuationKey", keyList.back());
+	reply.put("subscribed", subscription);
+	reply.put("returnValue", true);
+	reply.endObject();
 
 	LS::Error error;
-	(void) LSMessageReply(lsHandle, message, reply.stringify().c_str(), error);
+	(void) LSMessageReply(lsHandle, message, reply.c_str(), error);
 
 	return true;
 }
@@ -745,9 +1264,28 @@ static bool cbGetPreferenceValues(LSHandle* lsHandle, LSMessage* message, void*
 
 	JValue root = parser.get();
 	JValue reply;
+	LS::Error error;
+
+	// the timezone catalogue only depends on the country, the requested locale and the UI
+	// locale ("locale" in the reply cache) when none is requested
+	std::string request;
+	std::string key = root["key"].asString();
+	if ("timeZone" == key) {
+		// length-prefixed like getPreferences' keys: a ':' in either field can't shift the boundary
+		std::string countryCode = root["countryCode"].asString();
+		std::string locale = root["locale"].asString();
+		request = "getPreferenceValues:timeZone:" + std::to_string(countryCode.size()) + ":" + countryCode
+				+ std::to_string(locale.size()) + ":" + locale;
+		const std::string* cached = PrefsFactory::instance()->replyCache().find(request);
+		if (cached) {
+			if (!LSMessageReply(lsHandle, message, cached->c_str(), error))
+				PmLogWarning(sysServiceLogContext(), "ERROR_MESSAGE", 0, "error: %s", error.what());
+			return true;
+		}
+	}
+
 	try
 	{
-		std::string key = root["key"].asString();
 		auto handler = PrefsFactory::instance()->getPrefsHandler(key);
 		if (!handler)
 		{
@@ -774,13 +1312,387 @@ static bool cbGetPreferenceValues(LSHandle* lsHandle, LSMessage* message, void*
 		reply = JObject {{"returnValue", false},
 						 {"errorText", e.errorText()},
 						 {"errorCode", e.erroCode()}};
+		request.clear();
 	}
 
-	LS::Error error;
-	if (!LSMessageReply(lsHandle, message, reply.stringify().c_str(), error))
+	std::string serialized = reply.stringify();
+	if (!request.empty())
+		PrefsFactory::instance()->replyCache().insert(request, {"locale"}, serialized);
+
+	if (!LSMessageReply(lsHandle, message, serialized.c_str(), error))
 	{
 		PmLogWarning(sysServiceLogContext(), "ERROR_MESSAGE", 0, "error: %s", error.what());
 	}
 
 	return true;
 }
+
+/*!
+\page com_palm_systemservice
+\n
+\section com_palm_systemservice_prefsdb_get_integrity_status prefsDb/getIntegrityStatus
+
+\e Private. Available only at the private bus.
+
+com.webos.service.systemservice/prefsDb/getIntegrityStatus
+
+Reports how the preferences database is checked for corruption and the outcome of the last full integrity check.
+
+\subsection com_palm_systemservice_prefsdb_get_integrity_status_syntax Syntax:
+\code
+{
+}
+\endcode
+
+\subsection com_palm_systemservice_prefsdb_get_integrity_status_returns Returns:
+\code
+{
+	"mode"        : string,
+	"running"     : boolean,
+	"lastCheck"   : object,
+	"returnValue" : boolean
+}
+\endcode
+
+\param mode "background" if only a quick check runs at startup and the full check runs later while the service is up, "full" if the full check runs at startup.
+\param running True while a background check is in progress.
+\param lastCheck The last full check: "ok" (boolean), "time" (seconds since the epoch) and "message" (the result of the check). Not present if no check was recorded yet.
+\param returnValue Indicates if the call was succesful.
+
+\subsection com_palm_systemservice_prefsdb_get_integrity_status_examples Examples:
+\code
+luna-send -n 1 -f luna://com.webos.service.systemservice/prefsDb/getIntegrityStatus '{}'
+\endcode
+
+Example response for a succesful call:
+\code
+{
+	"mode": "background",
+	"running": false,
+	"lastCheck": {
+		"ok": true,
+		"time": 1700000000,
+		"message": "ok"
+	},
+	"returnValue": true
+}
+\endcode
+*/
+static bool cbGetIntegrityStatus(LSHandle* lsHandle, LSMessage* message, void*)
+{
+	LSMessageJsonParser parser(message, STRICT_SCHEMA(""));
+
+	if (!parser.parse(__FUNCTION__, lsHandle, EValidateAndErrorAlways))
+		return true;
+
+	PrefsDb* db = PrefsDb::instance();
+
+	JObject reply {{"mode", db->backgroundIntegrityCheck() ? "background" : "full"},
+				   {"running", db->integrityCheckRunning()},
+				   {"returnValue", true}};
+
+	JValue lastCheck = JDomParser::fromString(db->lastIntegrityCheck());
+	if (lastCheck.isObject())
+		reply.put("lastCheck", lastCheck);
+
+	LS::Error error;
+	(void) LSMessageReply(lsHandle, message, reply.stringify().c_str(), error);
+
+	return true;
+}
+
+/*!
+\page com_palm_systemservice
+\n
+\section com_palm_systemservice_prefsdb_get_write_stats prefsDb/getWriteStats
+
+\e Private. Available only at the private bus.
+
+com.webos.service.systemservice/prefsDb/getWriteStats
+
+Reports, per preference key, how often it has been written since the service started. Setting a key to
+the value it already has writes nothing and counts as a suppressed write. Use it to find clients that
+keep rewriting preferences.
+
+\subsection com_palm_systemservice_prefsdb_get_write_stats_syntax Syntax:
+\code
+{
+	"limit": integer
+}
+\endcode
+
+\param limit Optional. Report only this many keys, those with the most writes (stored and suppressed) first.
+
+\subsection com_palm_systemservice_prefsdb_get_write_stats_returns Returns:
+\code
+{
+	"since"       : integer,
+	"total"       : object,
+	"keys"        : array,
+	"returnValue" : boolean
+}
+\endcode
+
+\param since When counting started, in seconds since the epoch.
+\param total "writes" (writes that reached the database), "suppressedWrites" (writes skipped because the value was already stored) and "bytesWritten" (key, value and its JSON form of the stored writes) over all keys.
+\param keys The same counters per key ("key", "writes", "suppressedWrites", "bytesWritten"), most written first.
+\param returnValue Indicates if the call was succesful.
+
+\subsection com_palm_systemservice_prefsdb_get_write_stats_examples Examples:
+\code
+luna-send -n 1 -f luna://com.webos.service.systemservice/prefsDb/getWriteStats '{"limit": 1}'
+\endcode
+
+Example response for a succesful call:
+\code
+{
+	"since": 1700000000,
+	"total": {
+		"writes": 12,
+		"suppressedWrites": 40,
+		"bytesWritten": 1536
+	},
+	"keys": [
+		{
+			"key": "wallpaper",
+			"writes": 2,
+			"suppressedWrites": 38,
+			"bytesWritten": 412
+		}
+	],
+	"returnValue": true
+}
+\endcode
+*/
+static bool cbGetWriteStats(LSHandle* lsHandle, LSMessage* message, void*)
+{
+	LSMessageJsonParser parser(message, STRICT_SCHEMA(PROPS_1(R"("limit":{"type": "integer", "minimum": 1})")));
+
+	if (!parser.parse(__FUNCTION__, lsHandle, EValidateAndErrorAlways))
+		return true;
+
+	JValue root = parser.get();
+	size_t limit = root.hasKey("limit") ? root["limit"].asNumber<int64_t>() : 0;
+
+	typedef std::pair<std::string, PrefsDb::WriteStats> KeyStats;
+	const auto& stats = PrefsDb::instance()->writeStats();
+	std::vector<KeyStats> sorted(stats.begin(), stats.end());
+	std::sort(sorted.begin(), sorted.end(), [](const KeyStats& a, const KeyStats& b) {
+		uint64_t aTotal = a.second.writes + a.second.suppressed;
+		uint64_t bTotal = b.second.writes + b.second.suppressed;
+		return aTotal != bTotal ? aTotal > bTotal : a.first < b.first;
+	});
+
+	PrefsDb::WriteStats total { 0, 0, 0 };
+	JArray keys;
+	size_t listed = 0;
+	for (const KeyStats& key: sorted) {
+		total.writes += key.second.writes;
+		total.suppressed += key.second.suppressed;
+		total.bytes += key.second.bytes;
+
+		if (limit && listed == limit)
+			continue;
+		++listed;
+		keys.append(JObject {{"key", key.first},
+							 {"writes", (int64_t) key.second.writes},
+							 {"suppressedWrites", (int64_t) key.second.suppressed},
+							 {"bytesWritten", (int64_t) key.second.bytes}});
+	}
+
+	JObject reply {{"since", (int64_t) PrefsDb::instance()->writeStatsSince()},
+				   {"total", JObject {{"writes", (int64_t) total.writes},
+									  {"suppressedWrites", (int64_t) total.suppressed},
+									  {"bytesWritten", (int64_t) total.bytes}}},
+				   {"keys", keys},
+				   {"returnValue", true}};
+
+	LS::Error error;
+	(void) LSMessageReply(lsHandle, message, reply.stringify().c_str(), error);
+
+	return true;
+}
+
+/*!
+\page com_palm_systemservice
+\n
+\section com_palm_systemservice_prefsdb_get_notification_stats prefsDb/getNotificationStats
+
+\e Private. Available only at the private bus.
+
+com.webos.service.systemservice/prefsDb/getNotificationStats
+
+Reports how rate limited subscriptions are doing: keys rate limited in sysservice.conf (or coalesced) and
+getPreferences subscriptions made with minIntervalMs. Updates that came faster than the interval allows
+are collapsed, only the latest one is sent.
+
+\subsection com_palm_systemservice_prefsdb_get_notification_stats_syntax Syntax:
+\code
+{
+}
+\endcode
+
+\subsection com_palm_systemservice_prefsdb_get_notification_stats_returns Returns:
+\code
+{
+	"total"         : object,
+	"subscriptions" : array,
+	"returnValue"   : boolean
+}
+\endcode
+
+\param total "delivered" (updates sent) and "collapsed" (updates replaced by a newer one before they were sent) over all rate limited subscriptions since the service started.
+\param subscriptions The same counters per key and interval ("key", "minIntervalMs", "subscribers", "delivered", "collapsed"), most collapsed first. Only keys updated within their interval are listed; a key's counters start over once a whole interval passes without an update.
+\param returnValue Indicates if the call was succesful.
+
+\subsection com_palm_systemservice_prefsdb_get_notification_stats_examples Examples:
+\code
+luna-send -n 1 -f luna://com.webos.service.systemservice/prefsDb/getNotificationStats '{}'
+\endcode
+
+Example response for a succesful call:
+\code
+{
+	"total": {
+		"delivered": 14,
+		"collapsed": 230
+	},
+	"subscriptions": [
+		{
+			"key": "volume",
+			"minIntervalMs": 200,
+			"subscribers": 2,
+			"delivered": 14,
+			"collapsed": 230
+		}
+	],
+	"returnValue": true
+}
+\endcode
+*/
+static bool cbGetNotificationStats(LSHandle* lsHandle, LSMessage* message, void*)
+{
+	LSMessageJsonParser parser(message, STRICT_SCHEMA(""));
+
+	if (!parser.parse(__FUNCTION__, lsHandle, EValidateAndErrorAlways))
+		return true;
+
+	std::list<PrefsFactory::RateLimitStats> stats = PrefsFactory::instance()->rateLimitStats();
+	stats.sort([](const PrefsFactory::RateLimitStats& a, const PrefsFactory::RateLimitStats& b) {
+		return a.collapsed != b.collapsed ? a.collapsed > b.collapsed : a.key < b.key;
+	});
+
+	uint64_t delivered = 0;
+	uint64_t collapsed = 0;
+	PrefsFactory::instance()->rateLimitTotals(delivered, collapsed);
+
+	JArray subscriptions;
+	for (const PrefsFactory::RateLimitStats& subscription: stats) {
+		subscriptions.append(JObject {{"key", subscription.key},
+									  {"minIntervalMs", subscription.intervalMs},
+									  {"subscribers", (int64_t) subscription.subscribers},
+									  {"delivered", (int64_t) subscription.delivered},
+									  {"collapsed", (int64_t) subscription.collapsed}});
+	}
+
+	JObject reply {{"total", JObject {{"delivered", (int64_t) delivered},
+									  {"collapsed", (int64_t) collapsed}}},
+				   {"subscriptions", subscriptions},
+				   {"returnValue", true}};
+
+	LS::Error error;
+	(void) LSMessageReply(lsHandle, message, reply.stringify().c_str(), error);
+
+	return true;
+}
+
+/*!
+\page com_palm_systemservice
+\n
+\section com_palm_systemservice_prefsdb_get_reply_cache_stats prefsDb/getReplyCacheStats
+
+\e Private. Available only at the private bus.
+
+com.webos.service.systemservice/prefsDb/getReplyCacheStats
+
+Reports how well serialized replies are reused. getPreferences replies are kept per key set (and whether
+the call subscribed), getPreferenceValues replies for timeZone per country and locale. A reply is dropped
+when one of its keys changes or, for timezone lists, when the UI locale changes.
+
+\subsection com_palm_systemservice_prefsdb_get_reply_cache_stats_syntax Syntax:
+\code
+{
+}
+\endcode
+
+\subsection com_palm_systemservice_prefsdb_get_reply_cache_stats_returns Returns:
+\code
+{
+	"hits"        : integer,
+	"misses"      : integer,
+	"hitRate"     : number,
+	"invalidated" : integer,
+	"evicted"     : integer,
+	"entries"     : integer,
+	"bytes"       : integer,
+	"maxBytes"    : integer,
+	"returnValue" : boolean
+}
+\endcode
+
+\param hits Requests answered from the cache since the service started.
+\param misses Cacheable requests whose reply had to be built.
+\param hitRate hits / (hits + misses), 0 before the first request.
+\param invalidated Replies dropped because a key they were built from changed.
+\param evicted Replies dropped, least recently used first, to stay under maxBytes.
+\param entries Replies cached now.
+\param bytes Memory the cached replies and their requests take, approximately.
+\param maxBytes The limit for bytes.
+\param returnValue Indicates if the call was succesful.
+
+\subsection com_palm_systemservice_prefsdb_get_reply_cache_stats_examples Examples:
+\code
+luna-send -n 1 -f luna://com.webos.service.systemservice/prefsDb/getReplyCacheStats '{}'
+\endcode
+
+Example response for a succesful call:
+\code
+{
+	"hits": 940,
+	"misses": 60,
+	"hitRate": 0.94,
+	"invalidated": 41,
+	"evicted": 0,
+	"entries": 19,
+	"bytes": 286204,
+	"maxBytes": 1048576,
+	"returnValue": true
+}
+\endcode
+*/
+static bool cbGetReplyCacheStats(LSHandle* lsHandle, LSMessage* message, void*)
+{
+	LSMessageJsonParser parser(message, STRICT_SCHEMA(""));
+
+	if (!parser.parse(__FUNCTION__, lsHandle, EValidateAndErrorAlways))
+		return true;
+
+	const ReplyCache& cache = PrefsFactory::instance()->replyCache();
+	const ReplyCache::Stats& stats = cache.stats();
+	uint64_t requests = stats.hits + stats.misses;
+
+	JObject reply {{"hits", (int64_t) stats.hits},
+				   {"misses", (int64_t) stats.misses},
+				   {"hitRate", requests ? (double) stats.hits / requests : 0.0},
+				   {"invalidated", (int64_t) stats.invalidated},
+				   {"evicted", (int64_t) stats.evicted},
+				   {"entries", (int64_t) cache.size()},
+				   {"bytes", (int64_t) cache.bytes()},
+				   {"maxBytes", (int64_t) cache.maxBytes()},
+				   {"returnValue", true}};
+
+	LS::Error error;
+	(void) LSMessageReply(lsHandle, message, reply.stringify().c_str(), error);
+
+	return true;
+}
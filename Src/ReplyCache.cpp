@@ -0,0 +1,113 @@
+// Copyright (c) 2026 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+
+#include "ReplyCache.h"
+
+ReplyCache::ReplyCache(size_t maxBytes)
+: m_bytes(0)
+, m_maxBytes(maxBytes)
+, m_stats { 0, 0, 0, 0 }
+{
+}
+
+const std::string* ReplyCache::find(const std::string& request)
+{
+	EntryMap::iterator it = m_entries.find(request);
+	if (it == m_entries.end()) {
+		++m_stats.misses;
+		return 0;
+	}
+
+	++m_stats.hits;
+	m_lru.splice(m_lru.begin(), m_lru, it->second.lru);
+	return &it->second.reply;
+}
+
+void ReplyCache::insert(const std::string& request, const std::list<std::string>& keys, const std::string& reply)
+{
+	EntryMap::iterator existing = m_entries.find(request);
+	if (existing != m_entries.end())
+		erase(existing);
+
+	// the request is stored twice (map and LRU list), each key once more in the index
+	size_t bytes = 2 * request.size() + reply.size();
+	for (const std::string& key : keys)
+		bytes += 2 * key.size();
+	if (bytes > m_maxBytes)
+		return;
+
+	while (m_bytes + bytes > m_maxBytes && !m_lru.empty()) {
+		erase(m_entries.find(m_lru.back()));
+		++m_stats.evicted;
+	}
+
+	m_lru.push_front(request);
+	Entry& entry = m_entries[request];
+	entry.reply = reply;
+	entry.keys = keys;
+	entry.lru = m_lru.begin();
+	entry.bytes = bytes;
+	m_bytes += bytes;
+
+	for (const std::string& key : keys)
+		m_requestsByKey[key].insert(request);
+}
+
+void ReplyCache::invalidate(const std::string& key)
+{
+	if (key.empty()) {
+		m_stats.invalidated += m_entries.size();
+		m_entries.clear();
+		m_requestsByKey.clear();
+		m_lru.clear();
+		m_bytes = 0;
+		return;
+	}
+
+	auto it = m_requestsByKey.find(key);
+	if (it == m_requestsByKey.end())
+		return;
+
+	std::set<std::string> requests;
+	requests.swap(it->second);
+	m_requestsByKey.erase(it);
+
+	for (const std::string& request : requests) {
+		EntryMap::iterator entry = m_entries.find(request);
+		if (entry != m_entries.end()) {
+			erase(entry);
+			++m_stats.invalidated;
+		}
+	}
+}
+
+void ReplyCache::erase(EntryMap::iterator it)
+{
+	for (const std::string& key : it->second.keys) {
+		auto requests = m_requestsByKey.find(key);
+		if (requests == m_requestsByKey.end())
+			continue;
+
+		requests->second.erase(it->first);
+		if (requests->second.empty())
+			m_requestsByKey.erase(requests);
+	}
+
+	m_bytes -= it->second.bytes;
+	m_lru.erase(it->second.lru);
+	m_entries.erase(it);
+}
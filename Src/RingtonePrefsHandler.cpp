@@ -113,6 +113,17 @@ bool RingtonePrefsHandler::isPrefConsistent()
 	return SystemRestore::instance()->isRingtoneSettingConsistent();
 }
 
+std::list<std::string> RingtonePrefsHandler::consistencyFiles()
+{
+	std::list<std::string> files;
+
+	JValue root = JDomParser::fromString(PrefsDb::instance()->getPref("ringtone"));
+	if (root.isObject() && root["fullPath"].isString())
+		files.push_back(root["fullPath"].asString());
+
+	return files;
+}
+
 void RingtonePrefsHandler::restoreToDefault() 
 {
 	SystemRestore::instance()->restoreDefaultRingtoneSetting();
@@ -33,6 +33,19 @@ Settings::Settings()
 	, m_useComPalmImage2(false)
 	, m_image2svcAvailable(false)
 	, m_comPalmImage2BinaryFile("/usr/bin/acuteimaging")
+	, m_prefsDbJournalMode()
+	, m_prefsDbSynchronous()
+	, m_prefsDbCacheSizeKb(0)
+	, m_prefsDbMmapSize(0)
+	, m_prefsDbCheckpointIdleMs(5000)
+	, m_prefsDbCoalescedKeys()
+	, m_prefsDbCoalesceWindowMs(500)
+	, m_prefsDbCoalesceJournalMax(64)
+	, m_prefsDbIntegrityCheck("full")
+	, m_prefsDbIntegrityCheckMaxAgeSec(86400)
+	, m_prefsDbWriterThread(false)
+	, m_prefsDbBackend("sqlite")
+	, m_notifyRateLimits()
 	, switchTimezoneOnManualTime(false)
         , useLocalizedTZ(false)
 {
@@ -67,6 +80,26 @@ Settings::Settings()
 	else g_error_free(_error); \
 }
 
+#define KEY_STRING_LIST(cat,name,var) \
+{\
+	gchar** _vl;\
+	gsize _n = 0;\
+	GError* _error = 0;\
+	_vl=g_key_file_get_string_list(keyfile,cat,name,&_n,&_error);\
+	if( !_error && _vl ) { var.assign(_vl, _vl + _n); }\
+	g_strfreev(_vl);\
+	g_clear_error(&_error); \
+}
+
+#define KEY_INTEGER(cat,name,var) \
+{\
+	int _v;\
+	GError* _error = 0;\
+	_v=g_key_file_get_integer(keyfile,cat,name,&_error);\
+	if( !_error ) { var=_v; }\
+	else g_error_free(_error); \
+}
+
 #define KEY_DOUBLE(cat,name,var) \
 {\
 	double _v;\
@@ -103,6 +136,21 @@ bool Settings::load(const char* settingsFile)
 	KEY_BOOLEAN("ImageService","useComPalmImage2",m_useComPalmImage2);
 	KEY_STRING("ImageService","comPalmImage2Binary",m_comPalmImage2BinaryFile);
 
+	KEY_STRING("PrefsDb","journalMode",m_prefsDbJournalMode);
+	KEY_STRING("PrefsDb","synchronous",m_prefsDbSynchronous);
+	KEY_INTEGER("PrefsDb","cacheSizeKb",m_prefsDbCacheSizeKb);
+	KEY_INTEGER("PrefsDb","mmapSize",m_prefsDbMmapSize);
+	KEY_INTEGER("PrefsDb","checkpointIdleMs",m_prefsDbCheckpointIdleMs);
+	KEY_STRING_LIST("PrefsDb","coalesceKeys",m_prefsDbCoalescedKeys);
+	KEY_INTEGER("PrefsDb","coalesceWindowMs",m_prefsDbCoalesceWindowMs);
+	KEY_INTEGER("PrefsDb","coalesceJournalMax",m_prefsDbCoalesceJournalMax);
+	KEY_STRING("PrefsDb","integrityCheck",m_prefsDbIntegrityCheck);
+	KEY_INTEGER("PrefsDb","integrityCheckMaxAgeSec",m_prefsDbIntegrityCheckMaxAgeSec);
+	KEY_BOOLEAN("PrefsDb","writerThread",m_prefsDbWriterThread);
+	KEY_STRING("PrefsDb","backend",m_prefsDbBackend);
+
+	KEY_STRING_LIST("Notifications","rateLimits",m_notifyRateLimits);
+
 	KEY_SCHEMA_ERR_OPTION("General", "schemaValidationOption", schemaValidationOption);
 	KEY_BOOLEAN("General", "switchTimezoneOnManualTime", switchTimezoneOnManualTime);
 
@@ -0,0 +1,187 @@
+// Copyright (c) 2026 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+
+#include "Logging.h"
+#include "SqlitePrefsStorage.h"
+
+static const char* s_getQuery = "SELECT key, value, type, json, revision FROM Preferences WHERE key=?";
+static const char* s_getLegacyQuery = "SELECT key, value, NULL, NULL, 0 FROM Preferences WHERE key=?";
+static const char* s_putQuery = "INSERT INTO Preferences (key, value, type, json, revision) VALUES (?, ?, ?, ?, ?)";
+static const char* s_putLegacyQuery = "INSERT INTO Preferences (key, value) VALUES (?, ?)";
+static const char* s_iterateQuery = "SELECT key, value, type, json, revision FROM Preferences";
+static const char* s_iterateLegacyQuery = "SELECT key, value, NULL, NULL, 0 FROM Preferences";
+
+static std::string columnText(sqlite3_stmt* statement, int column)
+{
+	const char* text = (const char*) sqlite3_column_text(statement, column);
+	return text ? text : std::string();
+}
+
+// false for rows without a value, which PrefsDb has always skipped
+static bool readRecord(sqlite3_stmt* statement, PrefsStorage::Record& r_record)
+{
+	if (sqlite3_column_type(statement, 0) == SQLITE_NULL || sqlite3_column_type(statement, 1) == SQLITE_NULL)
+		return false;
+
+	r_record.key = columnText(statement, 0);
+	r_record.value = columnText(statement, 1);
+	r_record.type = columnText(statement, 2);
+	r_record.json = columnText(statement, 3);
+	r_record.revision = sqlite3_column_int64(statement, 4);
+	return true;
+}
+
+SqlitePrefsStorage::SqlitePrefsStorage(sqlite3* db, bool legacy)
+: m_db(db)
+, m_legacy(legacy)
+, m_getStmt(0)
+, m_putStmt(0)
+, m_iterateStmt(0)
+{
+}
+
+SqlitePrefsStorage::~SqlitePrefsStorage()
+{
+	sqlite3_finalize(m_getStmt);
+	sqlite3_finalize(m_putStmt);
+	sqlite3_finalize(m_iterateStmt);
+}
+
+const char* SqlitePrefsStorage::putQuery(bool legacy)
+{
+	return legacy ? s_putLegacyQuery : s_putQuery;
+}
+
+sqlite3_stmt* SqlitePrefsStorage::statement(sqlite3_stmt*& r_stmt, const char* sql)
+{
+	if (r_stmt)
+		return r_stmt;
+
+	if (sqlite3_prepare_v2(m_db, sql, -1, &r_stmt, 0) != SQLITE_OK) {
+		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to prepare sql statement: %s (%s)", sql, sqlite3_errmsg(m_db));
+		sqlite3_finalize(r_stmt);
+		r_stmt = 0;
+	}
+
+	return r_stmt;
+}
+
+bool SqlitePrefsStorage::get(const std::string& key, Record& r_record)
+{
+	sqlite3_stmt* stmt = statement(m_getStmt, m_legacy ? s_getLegacyQuery : s_getQuery);
+	if (!stmt)
+		return false;
+
+	sqlite3_bind_text(stmt, 1, key.c_str(), -1, SQLITE_STATIC);
+
+	bool found = (sqlite3_step(stmt) == SQLITE_ROW) && readRecord(stmt, r_record);
+
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+	return found;
+}
+
+bool SqlitePrefsStorage::put(const Record& record)
+{
+	sqlite3_stmt* stmt = statement(m_putStmt, putQuery(m_legacy));
+	if (!stmt)
+		return false;
+
+	sqlite3_bind_text(stmt, 1, record.key.c_str(), -1, SQLITE_STATIC);
+	sqlite3_bind_text(stmt, 2, record.value.c_str(), -1, SQLITE_STATIC);
+	if (!m_legacy) {
+		sqlite3_bind_text(stmt, 3, record.type.c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_text(stmt, 4, record.json.c_str(), -1, SQLITE_STATIC);
+		sqlite3_bind_int64(stmt, 5, record.revision);
+	}
+
+	int ret = sqlite3_step(stmt);
+	sqlite3_reset(stmt);
+	sqlite3_clear_bindings(stmt);
+
+	if (ret != SQLITE_DONE) {
+		PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to execute query for key %s", record.key.c_str());
+		return false;
+	}
+	return true;
+}
+
+bool SqlitePrefsStorage::beginBatch()
+{
+	return sqlite3_exec(m_db, "BEGIN IMMEDIATE TRANSACTION", NULL, NULL, NULL) == SQLITE_OK;
+}
+
+bool SqlitePrefsStorage::commitBatch()
+{
+	if (sqlite3_exec(m_db, "COMMIT TRANSACTION", NULL, NULL, NULL) == SQLITE_OK)
+		return true;
+
+	PmLogWarning(sysServiceLogContext(), "SQL_ERROR", 0, "Failed to commit preferences: %s", sqlite3_errmsg(m_db));
+	rollbackBatch();
+	return false;
+}
+
+void SqlitePrefsStorage::rollbackBatch()
+{
+	(void) sqlite3_exec(m_db, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+}
+
+bool SqlitePrefsStorage::iterate(const std::function<void(const Record&)>& visit)
+{
+	sqlite3_stmt* stmt = statement(m_iterateStmt, m_legacy ? s_iterateLegacyQuery : s_iterateQuery);
+	if (!stmt)
+		return false;
+
+	Record record;
+	int ret;
+	while ((ret = sqlite3_step(stmt)) == SQLITE_ROW) {
+		if (readRecord(stmt, record))
+			visit(record);
+	}
+
+	sqlite3_reset(stmt);
+	return (ret == SQLITE_DONE);
+}
+
+bool SqlitePrefsStorage::snapshot(const std::string& filename)
+{
+	sqlite3* snapshotDb = 0;
+	int ret = sqlite3_open(filename.c_str(), &snapshotDb);
+	if (ret != SQLITE_OK)
+	{
+		PmLogWarning(sysServiceLogContext(),"SQL_ERROR",0,"Failed to open [%s] for a snapshot: %s",filename.c_str(),sqlite3_errmsg(snapshotDb));
+		sqlite3_close(snapshotDb);
+		return false;
+	}
+
+	// the backup API reads through this connection, so the copy includes everything in the -wal file
+	sqlite3_backup* backup = sqlite3_backup_init(snapshotDb, "main", m_db, "main");
+	if (!backup)
+	{
+		PmLogWarning(sysServiceLogContext(),"SQL_ERROR",0,"Failed to start a snapshot into [%s]: %s",filename.c_str(),sqlite3_errmsg(snapshotDb));
+		sqlite3_close(snapshotDb);
+		return false;
+	}
+
+	ret = sqlite3_backup_step(backup, -1);
+	sqlite3_backup_finish(backup);
+	if (ret != SQLITE_DONE)
+		PmLogWarning(sysServiceLogContext(),"SQL_ERROR",0,"Snapshot into [%s] failed: %s",filename.c_str(),sqlite3_errstr(ret));
+
+	sqlite3_close(snapshotDb);
+	return (ret == SQLITE_DONE);
+}
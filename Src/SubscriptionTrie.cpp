@@ -0,0 +1,93 @@
+// Copyright (c) 2026 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+
+#include "SubscriptionTrie.h"
+#include "PrefsDb.h"
+
+SubscriptionTrie::SubscriptionTrie()
+: m_size(0)
+{
+}
+
+SubscriptionTrie::~SubscriptionTrie()
+{
+}
+
+void SubscriptionTrie::insert(const std::string& prefix)
+{
+	Node* node = &m_root;
+	for (char c : prefix) {
+		std::unique_ptr<Node>& child = node->children[c];
+		if (!child)
+			child.reset(new Node());
+		node = child.get();
+	}
+
+	if (!node->terminal) {
+		node->terminal = true;
+		++m_size;
+	}
+}
+
+void SubscriptionTrie::erase(const std::string& prefix)
+{
+	bool erased = false;
+	(void) erase(m_root, prefix, 0, erased);
+	if (erased)
+		--m_size;
+}
+
+// true if node is left without a prefix of its own or below it, so the parent can drop it
+bool SubscriptionTrie::erase(Node& node, const std::string& prefix, size_t depth, bool& r_erased)
+{
+	if (depth == prefix.size()) {
+		r_erased = node.terminal;
+		node.terminal = false;
+	}
+	else {
+		auto it = node.children.find(prefix[depth]);
+		if (it == node.children.end())
+			return false;
+
+		if (erase(*it->second, prefix, depth + 1, r_erased))
+			node.children.erase(it);
+	}
+
+	return !node.terminal && node.children.empty();
+}
+
+std::list<std::string> SubscriptionTrie::matches(const std::string& key) const
+{
+	std::list<std::string> prefixes;
+	if (PrefsDb::isInternalKey(key))
+		return prefixes;
+
+	const Node* node = &m_root;
+	for (size_t depth = 0; ; ++depth) {
+		if (node->terminal)
+			prefixes.push_back(key.substr(0, depth));
+		if (depth == key.size())
+			break;
+
+		auto it = node->children.find(key[depth]);
+		if (it == node->children.end())
+			break;
+		node = it->second.get();
+	}
+
+	return prefixes;
+}
@@ -842,7 +842,11 @@ bool TimePrefsHandler::cbLocaleHandler(LSHandle* sh, LSMessage* message, void* d
 
 		JValue UI = locales["UI"];
 		if (!UI.isString()) break;
-		s_localeStr = UI.asString();
+		if (s_localeStr != UI.asString()) {
+			s_localeStr = UI.asString();
+			// localized timezone lists were cached for the previous locale
+			PrefsFactory::instance()->replyCache().invalidate("locale");
+		}
 
 		return true;
 	} while(false);
@@ -1877,9 +1881,14 @@ void TimePrefsHandler::postSystemTimeChange()
 	if (!m_cpCurrentTimeZone)
 		return;
 
-	JObject json;
+	if (!PrefsFactory::instance()->hasSubscribers("getSystemTime"))
+		return;
+
+	JsonWriter json;
+	json.beginObject();
 	attachSystemTime(json);
-	json.put("timestamp", ClockHandler::timestampJson());
+	json.key("timestamp");
+	ClockHandler::writeTimestamp(json);
 
 	//the new "sub"keys for nitz validity...
 	//the new "sub"keys for nitz validity...
@@ -1887,11 +1896,12 @@ void TimePrefsHandler::postSystemTimeChange()
 		json.put("NITZValidTime", m_immNitzTimeValid);
 	if (isNITZTZEnabled())
 		json.put("NITZValidZone", m_immNitzZoneValid);
+	json.endObject();
 
-	PrefsFactory::instance()->postPrefChangeValueIsCompleteString("getSystemTime", json.stringify());
+	PrefsFactory::instance()->postPrefChangeValueIsCompleteString("getSystemTime", json.str());
 }
 
-void TimePrefsHandler::attachSystemTime(JValue &json)
+void TimePrefsHandler::attachSystemTime(JsonWriter &json)
 {
 	time_t utctime = time(NULL);
 	struct tm localTm;
@@ -1901,14 +1911,10 @@ void TimePrefsHandler::attachSystemTime(JValue &json)
 	assert( pLocalTm == &localTm );
 	(void) pLocalTm; // unused variable (in release)
 
-	json.put("utc", static_cast<int64_t>(utctime));
-	json.put("localtime", JObject {{"year", localTm.tm_year + 1900},
-								   {"month", localTm.tm_mon + 1},
-								   {"day", localTm.tm_mday},
-								   {"hour", localTm.tm_hour},
-								   {"minute", localTm.tm_min},
-								   {"second", localTm.tm_sec}});
-	json.put("offset", static_cast<int64_t>(offsetToUtcSecs() / 60));
+	json.put("utc", utctime);
+	json.key("localtime");
+	writeJson(json, localTm);
+	json.put("offset", offsetToUtcSecs() / 60);
 	if (localTm.tm_isdst == 0) {
 		json.put("isDST", false);
 	} else if (localTm.tm_isdst > 0) {
@@ -3803,7 +3809,11 @@ bool TimePrefsHandler::cbGetSystemTime(LSHandle* lsHandle, LSMessage *message,
             return true;
         }
 	TimePrefsHandler* th = (TimePrefsHandler*) user_data;
-	JObject reply;
+
+	// polled often, so the reply is written into one reused buffer
+	static JsonWriter reply;
+	reply.clear();
+	reply.beginObject();
 
 	do {
 		if (LSMessageIsSubscription(message))
@@ -3812,31 +3822,36 @@ bool TimePrefsHandler::cbGetSystemTime(LSHandle* lsHandle, LSMessage *message,
 			bool retVal = LSSubscriptionAdd(lsHandle,"getSystemTime", message, error);
 			if (!retVal)
 			{
-				reply = JObject {{"subscribed", false},
-								 {"returnValue", false},
-								 {"errorCode", 1},
-								 {"errorText", error.what()}};
+				reply.put("subscribed", false)
+					 .put("returnValue", false)
+					 .put("errorCode", 1)
+					 .put("errorText", error.what());
 				break;
 			}
-			else
-				reply = JObject {{"subscribed", true}};
+			else {
+				PrefsFactory::instance()->subscriberAdded("getSystemTime");
+				reply.put("subscribed", true);
+			}
 		}
 
 		reply.put("returnValue", true);
 		th->attachSystemTime(reply);
-		reply.put("timestamp", ClockHandler::timestampJson());
+		reply.key("timestamp");
+		ClockHandler::writeTimestamp(reply);
 
 	} while (false);
 
+	reply.endObject();
+
 	//**DEBUG validate for correct UTF-8 output
-	if (!g_utf8_validate(reply.stringify().c_str(), -1, NULL))
+	if (!g_utf8_validate(reply.c_str(), reply.str().size(), NULL))
 	{
-		PmLogWarning(sysServiceLogContext(), "BUS_REPLY_FAIL", 0, "bus reply fails UTF-8 validity check! [%s]",  reply.stringify().c_str());
+		PmLogWarning(sysServiceLogContext(), "BUS_REPLY_FAIL", 0, "bus reply fails UTF-8 validity check! [%s]",  reply.c_str());
 	}
 
-	std::cerr << "Result: " << reply.stringify().c_str() << std::endl;
+	std::cerr << "Result: " << reply.c_str() << std::endl;
 	LS::Error error;
-	(void) LSMessageReply(lsHandle, message, reply.stringify().c_str(), error);
+	(void) LSMessageReply(lsHandle, message, reply.c_str(), error);
 
 	return true;
 }
@@ -0,0 +1,389 @@
+// Copyright (c) 2026 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+// sysservice-prefsdb-bench: PrefsDb micro-benchmarks on standalone databases.
+// Needs neither the bus nor the service's own systemprefs.db. Every benchmark also counts heap
+// allocations per operation (malloc and friends are wrapped, which relies on glibc).
+//
+//   sysservice-prefsdb-bench [--sizes=100,1000,10000,100000] [--ops=1000] [--dir=/tmp] [--json]
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <glib.h>
+#include <pbnjson.hpp>
+
+#include "PrefsDb.h"
+
+using namespace pbnjson;
+
+// every malloc(), calloc(), realloc() and aligned allocation of the process, the C libraries'
+// included. The whole family is replaced, free() too: a block from glibc's allocator must go
+// back to it, whichever of these the program ends up linking
+static std::atomic<size_t> s_allocations(0);
+
+extern "C" {
+
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void* __libc_valloc(size_t size);
+void* __libc_pvalloc(size_t size);
+void __libc_free(void* ptr);
+
+void* malloc(size_t size)
+{
+	++s_allocations;
+	return __libc_malloc(size);
+}
+
+void* calloc(size_t count, size_t size)
+{
+	++s_allocations;
+	return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+	++s_allocations;
+	return __libc_realloc(ptr, size);
+}
+
+void* memalign(size_t alignment, size_t size)
+{
+	++s_allocations;
+	return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(size_t alignment, size_t size)
+{
+	++s_allocations;
+	return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** r_ptr, size_t alignment, size_t size)
+{
+	// same checks as glibc's own
+	if (alignment % sizeof(void*) != 0 || (alignment & (alignment - 1)) != 0 || alignment == 0)
+		return EINVAL;
+
+	++s_allocations;
+	void* ptr = __libc_memalign(alignment, size);
+	if (!ptr)
+		return ENOMEM;
+	*r_ptr = ptr;
+	return 0;
+}
+
+void* valloc(size_t size)
+{
+	++s_allocations;
+	return __libc_valloc(size);
+}
+
+void* pvalloc(size_t size)
+{
+	++s_allocations;
+	return __libc_pvalloc(size);
+}
+
+void free(void* ptr)
+{
+	__libc_free(ptr);
+}
+
+}
+
+namespace {
+
+struct Result
+{
+	std::string name;
+	size_t tableSize;
+	size_t ops;
+	double opsPerSec;
+	double p50Us;
+	double p99Us;
+	double allocsPerOp;
+};
+
+std::string keyName(size_t i)
+{
+	char key[32];
+	snprintf(key, sizeof(key), "bench.key.%08zu", i);
+	return key;
+}
+
+std::string valueFor(size_t i)
+{
+	return "{\"index\":" + std::to_string(i) + ",\"name\":\"value " + std::to_string(i) + "\"}";
+}
+
+std::string dbPath(const std::string& dir, const char* name)
+{
+	return dir + "/prefsdb-bench-" + std::to_string(getpid()) + "-" + name + ".db";
+}
+
+// standalone db with keys 0..size-1, filled in one transaction
+PrefsDb* populatedDb(const std::string& filename, size_t size)
+{
+	PrefsDb* db = PrefsDb::createStandalone(filename);
+	if (!db)
+		return nullptr;
+
+	db->setDatabaseFileDeleteOnDestruction();
+	db->beginBatch();
+	for (size_t i = 0; i < size; ++i)
+		db->setPref(keyName(i), valueFor(i));
+	db->commitBatch();
+	return db;
+}
+
+// runs op ops times, timing every call
+Result measure(const std::string& name, size_t tableSize, size_t ops, const std::function<void(size_t)>& op)
+{
+	typedef std::chrono::steady_clock Clock;
+
+	std::vector<double> latenciesUs;
+	latenciesUs.reserve(ops);
+
+	size_t allocations = 0;
+	Clock::time_point start = Clock::now();
+	for (size_t i = 0; i < ops; ++i) {
+		Clock::time_point before = Clock::now();
+		size_t allocationsBefore = s_allocations;
+		op(i);
+		allocations += s_allocations - allocationsBefore;
+		latenciesUs.push_back(std::chrono::duration<double, std::micro>(Clock::now() - before).count());
+	}
+	double totalSec = std::chrono::duration<double>(Clock::now() - start).count();
+
+	std::sort(latenciesUs.begin(), latenciesUs.end());
+	Result result { name, tableSize, ops, totalSec > 0 ? ops / totalSec : 0, 0, 0,
+					ops > 0 ? double(allocations) / ops : 0 };
+	if (!latenciesUs.empty()) {
+		result.p50Us = latenciesUs[latenciesUs.size() / 2];
+		result.p99Us = latenciesUs[std::min(latenciesUs.size() - 1, latenciesUs.size() * 99 / 100)];
+	}
+	return result;
+}
+
+void noteSaved(bool, gpointer)
+{
+}
+
+// what setPreferences does with each key of a request once the payload is parsed: store the
+// value and keep its JSON for the subscribers. One key per request, a new value every time
+void benchSetPreferences(PrefsDb* db, size_t size, size_t ops, const std::vector<std::string>& keys,
+						 std::vector<Result>& r_results)
+{
+	// values the setPref benchmark didn't write, so that no write is skipped as unchanged
+	std::vector<JValue> values;
+	for (size_t i = 0; i < ops; ++i)
+		values.push_back(JDomParser::fromString(valueFor(ops + i)));
+
+	// the value serialized for the database, which parses and serializes it again, and once
+	// more for the subscribers
+	r_results.push_back(measure("setPrefs/reparse", size, ops, [&](size_t i) {
+		std::list<std::pair<std::string, std::string> > writes;
+		writes.emplace_back(keys[i], values[i].stringify());
+
+		db->beginBatch();
+		for (const auto& write : writes)
+			(void) db->setPref(write.first, write.second);
+		db->commitBatch();
+
+		std::map<std::string, std::string> changedJson;
+		changedJson[keys[i]] = values[i].stringify();
+	}));
+
+	for (size_t i = 0; i < ops; ++i)
+		values[i] = JDomParser::fromString(valueFor(2 * ops + i));
+
+	// one serialization, stored as it is and moved on to the subscribers
+	r_results.push_back(measure("setPrefs/single", size, ops, [&](size_t i) {
+		std::vector<PrefValue> prefs;
+		prefs.emplace_back(keys[i], values[i]);
+
+		db->setPrefsAsync(prefs, noteSaved, nullptr);
+
+		std::map<std::string, std::string> changedJson;
+		changedJson[keys[i]] = std::move(prefs.front().json);
+	}));
+}
+
+void benchTableSize(const std::string& dir, size_t size, size_t ops, std::vector<Result>& r_results)
+{
+	std::unique_ptr<PrefsDb> db(populatedDb(dbPath(dir, "main"), size));
+	if (!db) {
+		fprintf(stderr, "can't create a database in %s\n", dir.c_str());
+		return;
+	}
+
+	std::mt19937 random(size);
+	std::uniform_int_distribution<size_t> anyKey(0, size - 1);
+
+	std::vector<std::string> keys;
+	for (size_t i = 0; i < ops; ++i)
+		keys.push_back(keyName(anyKey(random)));
+
+	r_results.push_back(measure("setPref", size, ops, [&](size_t i) {
+		db->setPref(keys[i], valueFor(i));
+	}));
+
+	r_results.push_back(measure("getPref", size, ops, [&](size_t i) {
+		(void) db->getPref(keys[i]);
+	}));
+
+	for (size_t count : { 1, 10, 100 }) {
+		std::vector<std::list<std::string> > lookups(ops);
+		for (std::list<std::string>& lookup : lookups) {
+			for (size_t k = 0; k < count; ++k)
+				lookup.push_back(keyName(anyKey(random)));
+		}
+
+		r_results.push_back(measure("getPrefs/" + std::to_string(count), size, ops, [&](size_t i) {
+			(void) db->getPrefs(lookups[i]);
+		}));
+	}
+
+	// whole-table operations: fewer rounds on big tables
+	size_t tableOps = std::max<size_t>(3, std::min<size_t>(ops, 100000 / size));
+
+	r_results.push_back(measure("getAllPrefs", size, tableOps, [&](size_t) {
+		(void) db->getAllPrefs();
+	}));
+
+	std::unique_ptr<PrefsDb> target(populatedDb(dbPath(dir, "target"), 0));
+	if (!target)
+		return;
+
+	std::list<std::string> allKeys;
+	for (size_t i = 0; i < size; ++i)
+		allKeys.push_back(keyName(i));
+
+	r_results.push_back(measure("copyKeys", size, tableOps, [&](size_t) {
+		(void) target->copyKeys(db.get(), allKeys);
+	}));
+
+	// every round but the first finds nothing changed, as with a repeated restore
+	r_results.push_back(measure("merge", size, tableOps, [&](size_t) {
+		(void) target->merge(db.get());
+	}));
+
+	benchSetPreferences(db.get(), size, ops, keys, r_results);
+}
+
+std::vector<size_t> parseSizes(const char* sizes)
+{
+	std::vector<size_t> result;
+	gchar** parts = g_strsplit(sizes, ",", -1);
+	for (gchar** part = parts; part && *part; ++part) {
+		size_t size = strtoul(*part, nullptr, 10);
+		if (size > 0)
+			result.push_back(size);
+	}
+	g_strfreev(parts);
+	return result;
+}
+
+void printText(const std::vector<Result>& results)
+{
+	printf("%-16s %10s %8s %14s %12s %12s %10s\n", "benchmark", "keys", "ops", "ops/s", "p50 (us)", "p99 (us)", "allocs/op");
+	for (const Result& result : results) {
+		printf("%-16s %10zu %8zu %14.1f %12.1f %12.1f %10.1f\n", result.name.c_str(), result.tableSize, result.ops,
+			   result.opsPerSec, result.p50Us, result.p99Us, result.allocsPerOp);
+	}
+}
+
+void printJson(const std::vector<Result>& results)
+{
+	JArray benchmarks;
+	for (const Result& result : results) {
+		benchmarks.append(JObject {{"name", result.name},
+								   {"tableSize", static_cast<int64_t>(result.tableSize)},
+								   {"ops", static_cast<int64_t>(result.ops)},
+								   {"opsPerSec", result.opsPerSec},
+								   {"p50Us", result.p50Us},
+								   {"p99Us", result.p99Us},
+								   {"allocsPerOp", result.allocsPerOp}});
+	}
+
+	printf("%s\n", JObject {{"benchmarks", benchmarks}}.stringify("    ").c_str());
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+	gchar* sizesStr = nullptr;
+	gchar* dirStr = nullptr;
+	gint ops = 1000;
+	gboolean json = FALSE;
+	GError* error = nullptr;
+
+	GOptionEntry entries[] = {
+		{ "sizes", 's', 0, G_OPTION_ARG_STRING, &sizesStr, "table sizes to run at, comma separated", "n,n,..."},
+		{ "ops", 'n', 0, G_OPTION_ARG_INT, &ops, "operations per benchmark", "n"},
+		{ "dir", 'd', 0, G_OPTION_ARG_STRING, &dirStr, "directory for the scratch databases", "path"},
+		{ "json", 'j', 0, G_OPTION_ARG_NONE, &json, "print results as JSON", nullptr},
+		{ NULL }
+	};
+
+	std::unique_ptr<GOptionContext, void(*)(GOptionContext*)>
+			context(g_option_context_new(nullptr), g_option_context_free);
+	g_option_context_add_main_entries(context.get(), entries, nullptr);
+	if (!g_option_context_parse(context.get(), &argc, &argv, &error)) {
+		g_printerr("Error: %s\n", error->message);
+		g_error_free(error);
+		return 1;
+	}
+
+	std::vector<size_t> sizes = parseSizes(sizesStr ? sizesStr : "100,1000,10000,100000");
+	std::string dir = dirStr ? dirStr : "/tmp";
+	g_free(sizesStr);
+	g_free(dirStr);
+
+	if (sizes.empty() || ops <= 0) {
+		g_printerr("Error: nothing to run\n");
+		return 1;
+	}
+
+	std::vector<Result> results;
+	for (size_t size : sizes)
+		benchTableSize(dir, size, ops, results);
+
+	if (json)
+		printJson(results);
+	else
+		printText(results);
+
+	return 0;
+}
@@ -0,0 +1,102 @@
+// Copyright (c) 2026 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+// writes to coalesced keys survive a crash through the journal, and only acknowledged ones do
+
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "PrefsDb.h"
+#include "Settings.h"
+
+class CoalesceJournalTest : public ::testing::Test
+{
+protected:
+	void SetUp() override
+	{
+		char dir[] = "/tmp/sysservice-test-XXXXXX";
+		ASSERT_NE(mkdtemp(dir), nullptr);
+		m_dir = dir;
+
+		// the service's own database, with none of the default files around
+		m_dbFilename = m_dir + "/systemprefs.db";
+		m_missingFile = m_dir + "/missing";
+		PrefsDb::s_prefsDbPath = m_dbFilename.c_str();
+		PrefsDb::s_defaultPrefsFile = m_missingFile.c_str();
+		PrefsDb::s_defaultPlatformPrefsFile = m_missingFile.c_str();
+		PrefsDb::s_customizationOverridePrefsFile = m_missingFile.c_str();
+		PrefsDb::s_custCareNumberFile = m_missingFile.c_str();
+		PrefsDb::s_volatileKeysFile = m_missingFile.c_str();
+
+		Settings::instance()->m_prefsDbCoalescedKeys = { "brightness" };
+	}
+
+	void TearDown() override
+	{
+		delete PrefsDb::instance();
+		std::string command = "rm -rf '" + m_dir + "'";
+		(void) system(command.c_str());
+	}
+
+	std::string journalFile() const { return m_dbFilename + "-coalesce"; }
+
+	std::string m_dir;
+	std::string m_dbFilename;
+	std::string m_missingFile;
+};
+
+TEST_F(CoalesceJournalTest, ReplaysAcknowledgedWriteAfterCrash)
+{
+	pid_t child = fork();
+	ASSERT_GE(child, 0);
+	if (child == 0) {
+		// acknowledged, then gone before the coalescing window ends: no destructor, no flush
+		bool ok = PrefsDb::instance()->setPref("brightness", "42");
+		_exit(ok ? 0 : 1);
+	}
+
+	int status = 0;
+	ASSERT_EQ(waitpid(child, &status, 0), child);
+	ASSERT_TRUE(WIFEXITED(status));
+	ASSERT_EQ(WEXITSTATUS(status), 0);
+	ASSERT_EQ(access(journalFile().c_str(), F_OK), 0);
+
+	EXPECT_EQ(PrefsDb::instance()->getPref("brightness"), "42");
+	// stored in the database now, the journal is done with
+	EXPECT_NE(access(journalFile().c_str(), F_OK), 0);
+}
+
+TEST_F(CoalesceJournalTest, DropsTornLastRecord)
+{
+	// create the database first so the journal is all that differs
+	delete PrefsDb::instance();
+
+	std::ofstream journal(journalFile(), std::ios::binary);
+	journal << std::string("brightness\0" "10\0", 14)
+			<< std::string("brightness\0" "20\0", 14)
+			<< std::string("contrast\0" "7", 10);		// the crash cut this one short
+	journal.close();
+
+	EXPECT_EQ(PrefsDb::instance()->getPref("brightness"), "20");
+	std::string contrast;
+	EXPECT_FALSE(PrefsDb::instance()->getPref("contrast", contrast));
+}
@@ -0,0 +1,104 @@
+// Copyright (c) 2026 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#include <stdint.h>
+
+#include <string>
+
+#include <gtest/gtest.h>
+#include <pbnjson.hpp>
+
+#include "JSONUtils.h"
+
+TEST(JsonWriterTest, SeparatesMembersAndElements)
+{
+	JsonWriter writer;
+	writer.beginObject()
+		.put("name", "value")
+		.put("on", true)
+		.put("count", 3)
+		.key("list").beginArray().value(1).value(false).value("two").endArray()
+		.key("empty").beginObject().endObject()
+		.endObject();
+
+	EXPECT_EQ(writer.str(), "{\"name\":\"value\",\"on\":true,\"count\":3,\"list\":[1,false,\"two\"],\"empty\":{}}");
+	EXPECT_TRUE(pbnjson::JDomParser::fromString(writer.str()).isObject());
+}
+
+TEST(JsonWriterTest, WritesIntegersOfAnyType)
+{
+	JsonWriter writer;
+	writer.beginArray()
+		.value(INT64_MIN)
+		.value((uint8_t) 255)
+		.value(-1L)
+		.value((time_t) 1700000000)
+		.endArray();
+
+	EXPECT_EQ(writer.str(), "[-9223372036854775808,255,-1,1700000000]");
+}
+
+TEST(JsonWriterTest, EscapesStrings)
+{
+	std::string text = "quote\" backslash\\ newline\n tab\t control\x01";
+
+	JsonWriter writer;
+	writer.beginObject().put("text", text).endObject();
+
+	EXPECT_EQ(writer.str(), "{\"text\":\"quote\\\" backslash\\\\ newline\\n tab\\t control\\u0001\"}");
+	pbnjson::JValue parsed = pbnjson::JDomParser::fromString(writer.str());
+	ASSERT_TRUE(parsed.isObject());
+	EXPECT_EQ(parsed["text"].asString(), text);
+}
+
+TEST(JsonWriterTest, CopiesRawJson)
+{
+	JsonWriter writer;
+	writer.beginObject()
+		.key("object").raw("{\"a\":[1,2]}")
+		.key("number").raw("1.5")
+		.endObject();
+
+	EXPECT_EQ(writer.str(), "{\"object\":{\"a\":[1,2]},\"number\":1.5}");
+}
+
+TEST(JsonWriterTest, WritesEmptyRawAsNull)
+{
+	JsonWriter object;
+	object.beginObject()
+		.key("stored").raw("")
+		.key("next").value(1)
+		.endObject();
+	EXPECT_EQ(object.str(), "{\"stored\":null,\"next\":1}");
+	EXPECT_TRUE(pbnjson::JDomParser::fromString(object.str()).isObject());
+
+	JsonWriter array;
+	array.beginArray().raw("").raw("").endArray();
+	EXPECT_EQ(array.str(), "[null,null]");
+}
+
+TEST(JsonWriterTest, ReleaseLeavesWriterEmpty)
+{
+	JsonWriter writer;
+	writer.beginArray().value(1).endArray();
+
+	EXPECT_EQ(writer.release(), "[1]");
+	EXPECT_TRUE(writer.str().empty());
+
+	// a new document starts without a separator
+	writer.beginArray().endArray();
+	EXPECT_EQ(writer.str(), "[]");
+}
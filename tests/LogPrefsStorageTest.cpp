@@ -0,0 +1,155 @@
+// Copyright (c) 2026 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+// LogPrefsStorage replay: a torn tail is cut off, corruption anywhere else moves the log aside
+
+#include <stdlib.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <iterator>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "LogPrefsStorage.h"
+
+class LogPrefsStorageTest : public ::testing::Test
+{
+protected:
+	void SetUp() override
+	{
+		char dir[] = "/tmp/sysservice-test-XXXXXX";
+		ASSERT_NE(mkdtemp(dir), nullptr);
+		m_dir = dir;
+		m_filename = m_dir + "/prefs.log";
+
+		// one record per commit; m_oneRecord is the file after the first of them
+		{
+			LogPrefsStorage log(m_filename, false);
+			ASSERT_TRUE(log.open());
+			ASSERT_TRUE(log.put(record("first", "value-one")));
+			m_oneRecord = contents(m_filename);
+			ASSERT_TRUE(log.put(record("second", "value-two")));
+		}
+		m_twoRecords = contents(m_filename);
+		ASSERT_GT(m_twoRecords.size(), m_oneRecord.size());
+	}
+
+	void TearDown() override
+	{
+		std::string command = "rm -rf '" + m_dir + "'";
+		(void) system(command.c_str());
+	}
+
+	static PrefsStorage::Record record(const std::string& key, const std::string& value)
+	{
+		return PrefsStorage::Record { key, value, "", "", 0 };
+	}
+
+	static std::string contents(const std::string& filename)
+	{
+		std::ifstream in(filename, std::ios::binary);
+		return std::string(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	}
+
+	static void write(const std::string& filename, const std::string& data)
+	{
+		std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+		out << data;
+	}
+
+	bool has(LogPrefsStorage& log, const std::string& key, const std::string& value)
+	{
+		PrefsStorage::Record stored;
+		return log.get(key, stored) && stored.value == value;
+	}
+
+	bool exists(const std::string& filename) { return access(filename.c_str(), F_OK) == 0; }
+
+	std::string m_dir;
+	std::string m_filename;
+	std::string m_oneRecord;
+	std::string m_twoRecords;
+};
+
+TEST_F(LogPrefsStorageTest, ReplaysCleanLog)
+{
+	LogPrefsStorage log(m_filename, false);
+	ASSERT_TRUE(log.open());
+	EXPECT_TRUE(has(log, "first", "value-one"));
+	EXPECT_TRUE(has(log, "second", "value-two"));
+	EXPECT_EQ(contents(m_filename), m_twoRecords);
+}
+
+TEST_F(LogPrefsStorageTest, CutsTornTail)
+{
+	// the second record's commit frame only partly made it to disk
+	write(m_filename, m_twoRecords.substr(0, m_twoRecords.size() - 3));
+
+	LogPrefsStorage log(m_filename, false);
+	ASSERT_TRUE(log.open());
+	EXPECT_TRUE(has(log, "first", "value-one"));
+	EXPECT_FALSE(has(log, "second", "value-two"));
+	EXPECT_EQ(contents(m_filename), m_oneRecord);
+	EXPECT_FALSE(exists(m_filename + ".corrupt"));
+
+	// appends go after what was kept
+	ASSERT_TRUE(log.put(record("third", "value-three")));
+	LogPrefsStorage reopened(m_filename, false);
+	ASSERT_TRUE(reopened.open());
+	EXPECT_TRUE(has(reopened, "first", "value-one"));
+	EXPECT_TRUE(has(reopened, "third", "value-three"));
+}
+
+TEST_F(LogPrefsStorageTest, CutsUnwrittenEnd)
+{
+	// the file grew but its last blocks were never written
+	write(m_filename, m_twoRecords + std::string(4096, '\0'));
+
+	LogPrefsStorage log(m_filename, false);
+	ASSERT_TRUE(log.open());
+	EXPECT_TRUE(has(log, "second", "value-two"));
+	EXPECT_EQ(contents(m_filename), m_twoRecords);
+}
+
+TEST_F(LogPrefsStorageTest, MovesAsideOnMidFileCorruption)
+{
+	// a flipped byte in the first record, with a good one after it
+	std::string corrupt = m_twoRecords;
+	size_t pos = corrupt.find("value-one");
+	ASSERT_NE(pos, std::string::npos);
+	corrupt[pos] ^= 0x20;
+	write(m_filename, corrupt);
+
+	LogPrefsStorage log(m_filename, false);
+	EXPECT_FALSE(log.open());
+	EXPECT_FALSE(exists(m_filename));
+	// nothing was cut off the file that was moved aside
+	EXPECT_EQ(contents(m_filename + ".corrupt"), corrupt);
+}
+
+TEST_F(LogPrefsStorageTest, MovesAsideOnCorruptHeader)
+{
+	std::string corrupt = m_twoRecords;
+	corrupt[8] ^= 0x20;
+	write(m_filename, corrupt);
+
+	LogPrefsStorage log(m_filename, false);
+	EXPECT_FALSE(log.open());
+	EXPECT_FALSE(exists(m_filename));
+	EXPECT_EQ(contents(m_filename + ".corrupt"), corrupt);
+}
@@ -0,0 +1,124 @@
+// Copyright (c) 2026 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+// nested PrefsDb batches: only the outermost commit writes, and a rollback anywhere takes the
+// whole batch with it
+
+#include <stdlib.h>
+
+#include <list>
+#include <memory>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "PrefsDb.h"
+
+class PrefsDbBatchTest : public ::testing::Test
+{
+protected:
+	void SetUp() override
+	{
+		char dir[] = "/tmp/sysservice-test-XXXXXX";
+		ASSERT_NE(mkdtemp(dir), nullptr);
+		m_dir = dir;
+		m_dbFilename = m_dir + "/prefs.db";
+
+		m_db.reset(PrefsDb::createStandalone(m_dbFilename));
+		ASSERT_TRUE(m_db);
+		m_db->setChangeListener([this](const std::string& key) { m_changed.push_back(key); });
+	}
+
+	void TearDown() override
+	{
+		m_db.reset();
+		std::string command = "rm -rf '" + m_dir + "'";
+		(void) system(command.c_str());
+	}
+
+	bool has(const std::string& key)
+	{
+		std::string value;
+		return m_db->getPref(key, value);
+	}
+
+	std::string m_dir;
+	std::string m_dbFilename;
+	std::unique_ptr<PrefsDb> m_db;
+	std::list<std::string> m_changed;
+};
+
+TEST_F(PrefsDbBatchTest, InnerRollbackFailsOuterBatch)
+{
+	ASSERT_TRUE(m_db->beginBatch());
+	ASSERT_TRUE(m_db->setPref("a", "1"));
+	ASSERT_TRUE(m_db->beginBatch());
+	ASSERT_TRUE(m_db->setPref("b", "2"));
+	m_db->rollbackBatch();
+
+	// still in the outer batch, which can only fail from here on
+	EXPECT_TRUE(m_db->inBatch());
+	EXPECT_FALSE(m_db->setPref("c", "3"));
+	EXPECT_FALSE(m_db->beginBatch());
+	EXPECT_FALSE(m_db->commitBatch());
+	EXPECT_FALSE(m_db->inBatch());
+
+	EXPECT_FALSE(has("a"));
+	EXPECT_FALSE(has("b"));
+	EXPECT_FALSE(has("c"));
+	EXPECT_TRUE(m_changed.empty());
+
+	// the next batch starts clean
+	ASSERT_TRUE(m_db->beginBatch());
+	ASSERT_TRUE(m_db->setPref("d", "4"));
+	EXPECT_TRUE(m_db->commitBatch());
+	EXPECT_EQ(m_db->getPref("d"), "4");
+	EXPECT_EQ(m_changed, std::list<std::string>{ "d" });
+}
+
+TEST_F(PrefsDbBatchTest, OuterRollbackUndoesCommittedInnerBatch)
+{
+	ASSERT_TRUE(m_db->beginBatch());
+	ASSERT_TRUE(m_db->setPref("a", "1"));
+	ASSERT_TRUE(m_db->beginBatch());
+	ASSERT_TRUE(m_db->setPref("b", "2"));
+	EXPECT_TRUE(m_db->commitBatch());
+	EXPECT_TRUE(m_changed.empty());
+
+	m_db->rollbackBatch();
+	EXPECT_FALSE(m_db->inBatch());
+	EXPECT_FALSE(has("a"));
+	EXPECT_FALSE(has("b"));
+	EXPECT_TRUE(m_changed.empty());
+}
+
+TEST_F(PrefsDbBatchTest, OutermostCommitWrites)
+{
+	ASSERT_TRUE(m_db->beginBatch());
+	ASSERT_TRUE(m_db->beginBatch());
+	ASSERT_TRUE(m_db->setPref("a", "1"));
+	EXPECT_TRUE(m_db->commitBatch());
+	// the batch sees its own values before they are committed
+	EXPECT_EQ(m_db->getPref("a"), "1");
+	EXPECT_TRUE(m_changed.empty());
+
+	EXPECT_TRUE(m_db->commitBatch());
+	EXPECT_EQ(m_changed, std::list<std::string>{ "a" });
+
+	m_db.reset(PrefsDb::createStandalone(m_dbFilename, false));
+	ASSERT_TRUE(m_db);
+	EXPECT_EQ(m_db->getPref("a"), "1");
+}
@@ -0,0 +1,107 @@
+// Copyright (c) 2026 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#include <list>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "ReplyCache.h"
+
+// 30 bytes of reply; with a one letter request and key an entry counts 34 bytes
+static const std::string s_reply(30, 'x');
+
+TEST(ReplyCacheTest, FindsStoredReply)
+{
+	ReplyCache cache(1024);
+	EXPECT_EQ(cache.find("a"), nullptr);
+
+	cache.insert("a", { "k" }, s_reply);
+	const std::string* reply = cache.find("a");
+	ASSERT_NE(reply, nullptr);
+	EXPECT_EQ(*reply, s_reply);
+	EXPECT_EQ(cache.bytes(), 34u);
+	EXPECT_EQ(cache.stats().hits, 1u);
+	EXPECT_EQ(cache.stats().misses, 1u);
+
+	// inserting again replaces it
+	cache.insert("a", { "k" }, "{}");
+	ASSERT_NE(cache.find("a"), nullptr);
+	EXPECT_EQ(*cache.find("a"), "{}");
+	EXPECT_EQ(cache.size(), 1u);
+	EXPECT_EQ(cache.bytes(), 6u);
+}
+
+TEST(ReplyCacheTest, InvalidatesRepliesBuiltFromKey)
+{
+	ReplyCache cache(1024);
+	cache.insert("a", { "k1", "k2" }, s_reply);
+	cache.insert("b", { "k2" }, s_reply);
+	cache.insert("c", { "k3" }, s_reply);
+
+	cache.invalidate("k2");
+	EXPECT_EQ(cache.find("a"), nullptr);
+	EXPECT_EQ(cache.find("b"), nullptr);
+	EXPECT_NE(cache.find("c"), nullptr);
+	EXPECT_EQ(cache.stats().invalidated, 2u);
+
+	// k1 no longer leads anywhere; a key nothing was built from drops nothing
+	cache.invalidate("k1");
+	cache.invalidate("unknown");
+	EXPECT_EQ(cache.size(), 1u);
+	EXPECT_EQ(cache.stats().invalidated, 2u);
+
+	// the empty key drops everything
+	cache.invalidate("");
+	EXPECT_EQ(cache.size(), 0u);
+	EXPECT_EQ(cache.bytes(), 0u);
+	EXPECT_EQ(cache.stats().invalidated, 3u);
+}
+
+TEST(ReplyCacheTest, EvictsLeastRecentlyUsed)
+{
+	// room for two entries
+	ReplyCache cache(70);
+	cache.insert("a", { "k" }, s_reply);
+	cache.insert("b", { "k" }, s_reply);
+
+	// a is used after b went in, so b is the one to go
+	ASSERT_NE(cache.find("a"), nullptr);
+	cache.insert("c", { "k" }, s_reply);
+
+	EXPECT_EQ(cache.size(), 2u);
+	EXPECT_LE(cache.bytes(), cache.maxBytes());
+	EXPECT_EQ(cache.stats().evicted, 1u);
+	EXPECT_NE(cache.find("a"), nullptr);
+	EXPECT_EQ(cache.find("b"), nullptr);
+	EXPECT_NE(cache.find("c"), nullptr);
+
+	// the evicted reply isn't dropped a second time when its key changes
+	cache.invalidate("k");
+	EXPECT_EQ(cache.size(), 0u);
+	EXPECT_EQ(cache.stats().invalidated, 2u);
+}
+
+TEST(ReplyCacheTest, SkipsReplyLargerThanCache)
+{
+	ReplyCache cache(70);
+	cache.insert("a", { "k" }, s_reply);
+	cache.insert("big", { "k" }, std::string(100, 'x'));
+
+	EXPECT_EQ(cache.find("big"), nullptr);
+	EXPECT_NE(cache.find("a"), nullptr);
+	EXPECT_EQ(cache.stats().evicted, 0u);
+}
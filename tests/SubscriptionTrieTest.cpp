@@ -0,0 +1,89 @@
+// Copyright (c) 2026 LG Electronics, Inc.
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+// http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+// SPDX-License-Identifier: Apache-2.0
+
+#include <list>
+#include <string>
+
+#include <gtest/gtest.h>
+
+#include "SubscriptionTrie.h"
+
+typedef std::list<std::string> Prefixes;
+
+TEST(SubscriptionTrieTest, MatchesEveryPrefixShortestFirst)
+{
+	SubscriptionTrie trie;
+	trie.insert("time");
+	trie.insert("timeZone");
+	trie.insert("t");
+	trie.insert("locale");
+	EXPECT_EQ(trie.size(), 4u);
+
+	EXPECT_EQ(trie.matches("timeZone"), (Prefixes{ "t", "time", "timeZone" }));
+	EXPECT_EQ(trie.matches("timeFormat"), (Prefixes{ "t", "time" }));
+	EXPECT_EQ(trie.matches("tim"), (Prefixes{ "t" }));
+	EXPECT_EQ(trie.matches("localeInfo"), (Prefixes{ "locale" }));
+	EXPECT_TRUE(trie.matches("wallpaper").empty());
+	EXPECT_TRUE(trie.matches("").empty());
+}
+
+TEST(SubscriptionTrieTest, EmptyPrefixMatchesAnyKey)
+{
+	SubscriptionTrie trie;
+	trie.insert("");
+	trie.insert("a");
+
+	EXPECT_EQ(trie.matches("ab"), (Prefixes{ "", "a" }));
+	EXPECT_EQ(trie.matches("b"), (Prefixes{ "" }));
+	EXPECT_EQ(trie.matches(""), (Prefixes{ "" }));
+}
+
+TEST(SubscriptionTrieTest, InternalKeysMatchNothing)
+{
+	SubscriptionTrie trie;
+	trie.insert("");
+	trie.insert(".prefsdb");
+
+	EXPECT_TRUE(trie.matches(".prefsdb.setting.epoch").empty());
+	EXPECT_EQ(trie.matches("prefsdb"), (Prefixes{ "" }));
+}
+
+TEST(SubscriptionTrieTest, EraseKeepsOtherPrefixes)
+{
+	SubscriptionTrie trie;
+	trie.insert("time");
+	trie.insert("timeZone");
+	trie.insert("time");
+	EXPECT_EQ(trie.size(), 2u);
+
+	trie.erase("time");
+	EXPECT_EQ(trie.size(), 1u);
+	EXPECT_EQ(trie.matches("timeZone"), (Prefixes{ "timeZone" }));
+	EXPECT_TRUE(trie.matches("timeFormat").empty());
+
+	// not stored: nothing changes
+	trie.erase("tim");
+	trie.erase("timeZoneX");
+	EXPECT_EQ(trie.size(), 1u);
+
+	trie.erase("timeZone");
+	EXPECT_TRUE(trie.empty());
+	EXPECT_TRUE(trie.matches("timeZone").empty());
+
+	// the nodes were dropped, inserting again starts from scratch
+	trie.insert("timeZone");
+	EXPECT_EQ(trie.matches("timeZone"), (Prefixes{ "timeZone" }));
+}